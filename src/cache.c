@@ -0,0 +1,320 @@
+#include "cache.h"
+
+#include <log4c.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "compress.h"
+
+/* FNV-1a hash of a path and content coding */
+unsigned int hash_path(char* path, content_encoding encoding) {
+    unsigned int hash = 2166136261u;
+    for(; *path; path++) {
+        hash = (hash ^ (unsigned char) *path) * 16777619u;
+    }
+    return (hash ^ encoding) * 16777619u;
+}
+
+/* Bytes an entry counts against the cache's capacity */
+size_t entry_footprint(cache_entry* entry) {
+    return sizeof(cache_entry) + entry->length;
+}
+
+void free_entry(cache_entry* entry) {
+    free(entry->path);
+    free(entry->data);
+    free(entry);
+}
+
+int entry_is_stale(cache_entry* entry, struct stat* sbuf) {
+    return entry->size != sbuf->st_size
+        || entry->inode != sbuf->st_ino
+        || entry->modified.tv_sec != sbuf->st_mtim.tv_sec
+        || entry->modified.tv_nsec != sbuf->st_mtim.tv_nsec;
+}
+
+static_cache* create_cache(size_t capacity, size_t max_file_size) {
+    static_cache* cache = calloc(1, sizeof(static_cache));
+    if(cache == NULL) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Unable to malloc space for the static cache: %s",
+                strerror(errno));
+        return NULL;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->capacity = capacity;
+    cache->max_file_size = MIN(max_file_size, capacity);
+    return cache;
+}
+
+/* Returns the entry for file, or NULL. Must hold the cache's lock. */
+cache_entry* find_entry(static_cache* cache, static_file* file) {
+    cache_entry* entry = cache->buckets[hash_path(file->path, file->encoding)
+        % CACHE_BUCKETS];
+    while(entry != NULL && (entry->encoding != file->encoding
+                || strcmp(entry->path, file->path))) {
+        entry = entry->bucket_next;
+    }
+    return entry;
+}
+
+void unlink_lru(static_cache* cache, cache_entry* entry) {
+    if(entry->lru_previous) {
+        entry->lru_previous->lru_next = entry->lru_next;
+    } else {
+        cache->lru_head = entry->lru_next;
+    }
+    if(entry->lru_next) {
+        entry->lru_next->lru_previous = entry->lru_previous;
+    } else {
+        cache->lru_tail = entry->lru_previous;
+    }
+}
+
+void push_lru(static_cache* cache, cache_entry* entry) {
+    entry->lru_previous = NULL;
+    entry->lru_next = cache->lru_head;
+    if(cache->lru_head) {
+        cache->lru_head->lru_previous = entry;
+    } else {
+        cache->lru_tail = entry;
+    }
+    cache->lru_head = entry;
+}
+
+/* Take an entry out of the cache, freeing it unless a response is still
+ * using it. Must hold the cache's lock.
+ */
+void remove_entry(static_cache* cache, cache_entry* entry) {
+    cache_entry** link = &cache->buckets[hash_path(entry->path,
+            entry->encoding) % CACHE_BUCKETS];
+    while(*link != entry) {
+        link = &(*link)->bucket_next;
+    }
+    *link = entry->bucket_next;
+    unlink_lru(cache, entry);
+    cache->size -= entry_footprint(entry);
+    cache->entry_count--;
+
+    entry->evicted = 1;
+    if(entry->references == 0) {
+        free_entry(entry);
+    }
+}
+
+/* Add an entry, evicting the least recently used ones to make room. Must
+ * hold the cache's lock.
+ */
+void insert_entry(static_cache* cache, cache_entry* entry) {
+    if(entry_footprint(entry) > cache->capacity) {
+        /* Bigger than the whole cache, only the caller will use it, and
+         * nothing else should be evicted for it
+         */
+        entry->evicted = 1;
+        return;
+    }
+    while(cache->lru_tail
+            && cache->size + entry_footprint(entry) > cache->capacity) {
+        remove_entry(cache, cache->lru_tail);
+        cache->evictions++;
+    }
+
+    unsigned int bucket = hash_path(entry->path, entry->encoding)
+        % CACHE_BUCKETS;
+    entry->bucket_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    push_lru(cache, entry);
+    cache->size += entry_footprint(entry);
+    cache->entry_count++;
+}
+
+/* Read a file into a new entry, without touching the cache.
+ *
+ * Returns the entry, or NULL if the file couldn't be read or compressed.
+ */
+cache_entry* load_entry(static_file* file) {
+    struct stat* sbuf = &file->sbuf;
+    cache_entry* entry = calloc(1, sizeof(cache_entry));
+    if(entry == NULL) {
+        return NULL;
+    }
+    entry->path = strdup(file->path);
+    entry->data = malloc(MAX(sbuf->st_size, 1));
+    int file_descriptor = open(file->path, O_RDONLY, 0);
+    if(entry->path == NULL || entry->data == NULL
+            || check_error(file_descriptor, "load_entry")) {
+        free_entry(entry);
+        return NULL;
+    }
+
+    while(entry->length < (size_t) sbuf->st_size) {
+        ssize_t bytes_read = read(file_descriptor,
+                entry->data + entry->length, sbuf->st_size - entry->length);
+        if(bytes_read < 0 && errno == EINTR) {
+            continue;
+        } else if(bytes_read <= 0) {
+            break;
+        }
+        entry->length += bytes_read;
+    }
+    close(file_descriptor);
+    if(entry->length != (size_t) sbuf->st_size) {
+        /* The file changed under us, serve it from disk this time */
+        free_entry(entry);
+        return NULL;
+    }
+
+    if(file->compress) {
+        char* compressed;
+        ssize_t compressed_length = compress_buffer(file->encoding,
+                entry->data, entry->length, &compressed);
+        if(compressed_length < 0) {
+            log4c_category_log(log4c_category_get("spade"),
+                    LOG4C_PRIORITY_WARN, "Unable to compress %s with %s",
+                    file->path, content_encoding_to_string(file->encoding));
+            free_entry(entry);
+            return NULL;
+        }
+        free(entry->data);
+        entry->data = compressed;
+        entry->length = compressed_length;
+    }
+
+    entry->encoding = file->encoding;
+    entry->size = sbuf->st_size;
+    entry->modified = sbuf->st_mtim;
+    entry->inode = sbuf->st_ino;
+    entry->header_length = format_static_headers(entry->headers, file,
+            entry->length);
+    return entry;
+}
+
+cache_entry* cache_lookup(static_cache* cache, static_file* file) {
+    if((size_t) file->sbuf.st_size > cache->max_file_size) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cache_entry* entry = find_entry(cache, file);
+    if(entry && entry_is_stale(entry, &file->sbuf)) {
+        remove_entry(cache, entry);
+        cache->invalidations++;
+        entry = NULL;
+    }
+    if(entry) {
+        cache->hits++;
+        unlink_lru(cache, entry);
+        push_lru(cache, entry);
+        entry->references++;
+        pthread_mutex_unlock(&cache->lock);
+        return entry;
+    }
+    cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+cache_entry* cache_get(static_cache* cache, static_file* file) {
+    cache_entry* entry = cache_lookup(cache, file);
+    if(entry || (size_t) file->sbuf.st_size > cache->max_file_size) {
+        return entry;
+    }
+
+    /* Read the file without holding up other threads */
+    entry = load_entry(file);
+    if(entry == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cache_entry* existing = find_entry(cache, file);
+    if(existing && !entry_is_stale(existing, &file->sbuf)) {
+        /* Another thread loaded it first */
+        free_entry(entry);
+        entry = existing;
+    } else {
+        if(existing) {
+            remove_entry(cache, existing);
+        }
+        insert_entry(cache, entry);
+    }
+    entry->references++;
+    pthread_mutex_unlock(&cache->lock);
+    return entry;
+}
+
+/* Helper function for compression threads */
+void* cache_compression_helper(void* args) {
+    cache_compression* compression = (cache_compression*) args;
+    static_cache* cache = compression->cache;
+    cache_entry* entry = cache_get(cache, &compression->file);
+    if(entry) {
+        cache_release(cache, entry);
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    for(int i = 0; i < MAX_CACHE_COMPRESSIONS; i++) {
+        if(cache->compressing[i] == compression) {
+            cache->compressing[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    free(compression);
+    return NULL;
+}
+
+void cache_compress_later(static_cache* cache, static_file* file,
+        pthread_attr_t* attributes) {
+    pthread_mutex_lock(&cache->lock);
+    int slot = -1;
+    for(int i = 0; i < MAX_CACHE_COMPRESSIONS; i++) {
+        cache_compression* compression = cache->compressing[i];
+        if(compression == NULL) {
+            slot = i;
+        } else if(compression->file.encoding == file->encoding
+                && !strcmp(compression->file.path, file->path)) {
+            slot = -1;
+            break;
+        }
+    }
+    cache_compression* compression = NULL;
+    if(slot >= 0 && (compression = malloc(sizeof(cache_compression)))) {
+        compression->cache = cache;
+        compression->file = *file;
+        cache->compressing[slot] = compression;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if(compression == NULL) {
+        return;
+    }
+
+    pthread_t compression_thread;
+    if(pthread_create(&compression_thread, attributes,
+                cache_compression_helper, compression)) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_WARN,
+                "Unable to start a thread to compress %s", file->path);
+        pthread_mutex_lock(&cache->lock);
+        cache->compressing[slot] = NULL;
+        pthread_mutex_unlock(&cache->lock);
+        free(compression);
+    }
+}
+
+void cache_retain(static_cache* cache, cache_entry* entry) {
+    pthread_mutex_lock(&cache->lock);
+    entry->references++;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_release(static_cache* cache, cache_entry* entry) {
+    pthread_mutex_lock(&cache->lock);
+    if(--entry->references == 0 && entry->evicted) {
+        free_entry(entry);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
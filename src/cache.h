@@ -0,0 +1,110 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "static.h"
+
+/**
+ * cache.h/.c, in-memory cache of static files shared by every thread.
+ *
+ * Entries are keyed by the resolved file path and content coding, and hold
+ * the file's bytes, compressed if need be, along with a prebuilt header
+ * block. The cache is bounded by a byte budget and evicts the least
+ * recently used files first. An entry is dropped as soon as a request's
+ * stat of the file shows a different size, modification time or inode.
+ *
+ * Entries are reference counted, so one that's evicted while a response is
+ * still being sent from it lives until that response is released.
+ */
+
+#define DEFAULT_CACHE_SIZE (32 * 1024 * 1024)
+#define DEFAULT_CACHE_MAX_FILE_SIZE (1024 * 1024)
+#define CACHE_BUCKETS 4096
+#define MAX_CACHE_HEADER_LENGTH 384
+/* Most files compressed in the background at once */
+#define MAX_CACHE_COMPRESSIONS 4
+
+typedef struct cache_entry {
+    char* path;
+    content_encoding encoding;
+    char* data;
+    size_t length;
+    off_t size;               /* The stat that the entry was loaded from */
+    struct timespec modified;
+    ino_t inode;
+    char headers[MAX_CACHE_HEADER_LENGTH]; /* Entity headers, unterminated */
+    size_t header_length;
+    unsigned int references;  /* Responses still being sent from data */
+    int evicted;              /* No longer in the cache, free when unused */
+    struct cache_entry* bucket_next;
+    struct cache_entry* lru_previous;
+    struct cache_entry* lru_next;
+} cache_entry;
+
+struct static_cache;
+
+/* A file being loaded and compressed on a thread of its own */
+typedef struct {
+    struct static_cache* cache;
+    static_file file;
+} cache_compression;
+
+typedef struct static_cache {
+    pthread_mutex_t lock;
+    cache_entry* buckets[CACHE_BUCKETS];
+    cache_entry* lru_head; /* Most recently used */
+    cache_entry* lru_tail;
+    size_t capacity;
+    size_t max_file_size;
+    size_t size;
+    unsigned int entry_count;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long invalidations;
+    cache_compression* compressing[MAX_CACHE_COMPRESSIONS];
+} static_cache;
+
+/* Allocate an empty cache of capacity bytes that holds files of up to
+ * max_file_size bytes.
+ *
+ * Returns the new cache, or NULL if it couldn't be allocated.
+ */
+static_cache* create_cache(size_t capacity, size_t max_file_size);
+
+/* Find a resolved static file in the cache, loading and if need be
+ * compressing it on a miss. The file's fresh stat is used to spot stale
+ * entries.
+ *
+ * Returns an entry that the caller must pass to cache_release once it's
+ * done with the data, or NULL if the file is too large to cache or
+ * couldn't be read or compressed.
+ */
+cache_entry* cache_get(static_cache* cache, static_file* file);
+
+/* Find a resolved static file in the cache, like cache_get, but without
+ * loading it on a miss.
+ *
+ * Returns an entry that the caller must pass to cache_release, or NULL.
+ */
+cache_entry* cache_lookup(static_cache* cache, static_file* file);
+
+/* Load and compress a resolved static file into the cache on a thread of
+ * its own, so that an event loop isn't held up by it. Does nothing if the
+ * file is already being compressed, or MAX_CACHE_COMPRESSIONS others are.
+ */
+void cache_compress_later(static_cache* cache, static_file* file,
+        pthread_attr_t* attributes);
+
+/* Take another reference to an entry the caller already holds one to. */
+void cache_retain(static_cache* cache, cache_entry* entry);
+
+/* Drop a reference returned by cache_get. */
+void cache_release(static_cache* cache, cache_entry* entry);
+
+#endif // _CACHE_H_
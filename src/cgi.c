@@ -1,35 +1,148 @@
 #include "cgi.h"
 #include "server.h"
 
-void set_static_cgi_environment(struct spade_server* server) {
-    setenv("SERVER_SOFTWARE", SPADE_SERVER_DESCRIPTOR, 1);
-    setenv("SERVER_NAME", server->hostname, 1);
-    setenv("GATEWAY_INTERFACE", CGI_VERSION, 1);
+/* Append "name=value" and a NUL to buf at *used.
+ *
+ * Returns 0 if it fit in length, or -1 if not.
+ */
+int append_cgi_variable(char* buf, size_t length, size_t* used,
+        const char* name, const char* value) {
+    int written = snprintf(buf + *used, length - *used, "%s=%s", name, value);
+    if(written < 0 || *used + written + 1 > length) {
+        return -1;
+    }
+    *used += written + 1;
+    return 0;
+}
 
-    setenv("SERVER_PROTOCOL", "HTTP/1.0", 1);
-    char stringified_port[MAX_PORT_LENGTH]; 
+void set_static_cgi_environment(struct spade_server* server) {
+    char stringified_port[MAX_PORT_LENGTH];
     sprintf(stringified_port, "%d", server->port);
-    setenv("SERVER_PORT", stringified_port, 1);
-}
 
-void set_cgi_environment(struct spade_server* server, http_request* request,
-        cgi_handler* handler) {
-    setenv("REQUEST_METHOD", http_method_to_string(request->method), 1);
+    size_t used = 0;
+    char* buf = server->cgi_environment;
+    size_t length = MAX_STATIC_CGI_ENVIRONMENT_LENGTH;
+    append_cgi_variable(buf, length, &used, "SERVER_SOFTWARE",
+            SPADE_SERVER_DESCRIPTOR);
+    append_cgi_variable(buf, length, &used, "SERVER_NAME", server->hostname);
+    append_cgi_variable(buf, length, &used, "GATEWAY_INTERFACE",
+            CGI_VERSION);
+    append_cgi_variable(buf, length, &used, "SERVER_PROTOCOL", "HTTP/1.0");
+    append_cgi_variable(buf, length, &used, "SERVER_PORT", stringified_port);
+    server->cgi_environment_length = used;
+}
 
-    char extra_path[MAX_PATH_LENGTH];
-    strcpy(extra_path, request->uri.path + strlen(handler->handler));
-    setenv("PATH_INFO", extra_path, 1);
+int format_cgi_environment(struct spade_server* server, http_request* request,
+        cgi_handler* handler, const char* extra_path, char* buf,
+        size_t length) {
+    if(server->cgi_environment_length > length) {
+        return -1;
+    }
+    memcpy(buf, server->cgi_environment, server->cgi_environment_length);
+    size_t used = server->cgi_environment_length;
 
     char translated_path[MAX_PATH_LENGTH];
-    strcpy(translated_path, server->cgi_file_path);
-    strcat(translated_path, extra_path);
-    setenv("PATH_TRANSLATED", translated_path, 1);
-
-    setenv("SCRIPT_NAME", handler->path, 1);
-    setenv("QUERY_STRING", request->uri.query_string, 1);
-    setenv("REMOTE_HOST", request->remote_host, 1);
-    setenv("REMOTE_ADDR", request->remote_address, 1);
+    snprintf(translated_path, MAX_PATH_LENGTH, "%s%s", server->cgi_file_path,
+            extra_path);
+
+    if(append_cgi_variable(buf, length, &used, "REQUEST_METHOD",
+                http_method_to_string(request->method))
+            || append_cgi_variable(buf, length, &used, "PATH_INFO",
+                extra_path)
+            || append_cgi_variable(buf, length, &used, "PATH_TRANSLATED",
+                translated_path)
+            || append_cgi_variable(buf, length, &used, "SCRIPT_NAME",
+                handler->path)
+            || append_cgi_variable(buf, length, &used, "QUERY_STRING",
+                http_request_string(request, request->uri.query_string))
+            || append_cgi_variable(buf, length, &used, "REMOTE_HOST",
+                request->remote_host)
+            || append_cgi_variable(buf, length, &used, "REMOTE_ADDR",
+                request->remote_address)) {
+        return -1;
+    }
     // Spade only supports GET requests.
-    // setenv("CONTENT_TYPE", TODO, 1);
-    // setenv("CONTENT_LENGTH", TODO, 1);
+    // CONTENT_TYPE, CONTENT_LENGTH TODO
+    return used;
+}
+
+/* Returns 1 if variable, a "NAME=value" string, sets a name that's also in
+ * the block of length bytes at environment.
+ */
+int cgi_variable_overridden(const char* variable, const char* environment,
+        size_t length) {
+    size_t name_length = strcspn(variable, "=");
+    const char* end = environment + length;
+    while(environment < end) {
+        if(!strncmp(environment, variable, name_length + 1)) {
+            return 1;
+        }
+        environment += strlen(environment) + 1;
+    }
+    return 0;
+}
+
+int build_cgi_envp(char* environment, size_t length, char** envp,
+        size_t max_variables) {
+    size_t count = 0;
+    char* end = environment + length;
+    for(char* variable = environment; variable < end;
+            variable += strlen(variable) + 1) {
+        if(count + 1 >= max_variables) {
+            return -1;
+        }
+        envp[count++] = variable;
+    }
+    /* The server's own environment, for PATH and the like, is read but
+     * never changed after startup, so it's safe to share between threads
+     */
+    for(char** variable = environ; *variable != NULL; variable++) {
+        if(cgi_variable_overridden(*variable, environment, length)) {
+            continue;
+        }
+        if(count + 1 >= max_variables) {
+            return -1;
+        }
+        envp[count++] = *variable;
+    }
+    envp[count] = NULL;
+    return count;
+}
+
+pid_t spawn_cgi_program(const char* program, char* environment,
+        size_t length, int output) {
+    char* envp[MAX_CGI_VARIABLES];
+    if(build_cgi_envp(environment, length, envp, MAX_CGI_VARIABLES) < 0) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    posix_spawn_file_actions_t actions;
+    if(posix_spawn_file_actions_init(&actions)) {
+        return -1;
+    }
+    int result = posix_spawn_file_actions_adddup2(&actions, output,
+            STDOUT_FILENO);
+#if __GLIBC_PREREQ(2, 34)
+    /* Don't hand the program the server's sockets, which would keep other
+     * clients' connections open as long as it runs
+     */
+    if(!result) {
+        result = posix_spawn_file_actions_addclosefrom_np(&actions,
+                STDERR_FILENO + 1);
+    }
+#endif
+
+    pid_t child = -1;
+    char* arguments[] = { (char*) program, NULL };
+    if(!result) {
+        result = posix_spawn(&child, program, &actions, NULL, arguments,
+                envp);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    if(result) {
+        errno = result;
+        return -1;
+    }
+    return child;
 }
@@ -5,21 +5,62 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <spawn.h>
+#include <unistd.h>
 
 #include "http.h"
 #include "constants.h"
 
 #define CGI_VERSION "1.1"
+#define MAX_CGI_ENVIRONMENT_LENGTH 8192
+#define MAX_STATIC_CGI_ENVIRONMENT_LENGTH 1024
+/* Entries in a CGI program's envp, its own and those it inherits */
+#define MAX_CGI_VARIABLES 512
 
 struct spade_server;
 
+struct cgi_pool;
+
 typedef struct {
     char handler[MAX_HANDLER_PATH_LENGTH];
     char path[MAX_DYNAMIC_PATH_PREFIX];
+    struct cgi_pool* pool; /* Persistent workers, or NULL to spawn each time */
 } cgi_handler;
 
+/* Format the CGI variables that are the same for every request into the
+ * server's cgi_environment, leaving the server's own environment alone.
+ *
+ * Modifies server.
+ */
 void set_static_cgi_environment(struct spade_server* server);
-void set_cgi_environment(struct spade_server* server, http_request* request, 
-        cgi_handler* handler);
+
+/* Write the server's static CGI variables and the request's own to buf as
+ * "NAME=value" strings, each followed by a NUL. extra_path, whatever a
+ * trailing "*" in the handler's URL pattern matched, is the PATH_INFO.
+ *
+ * Modifies buf.
+ * Returns the number of bytes written, or -1 if they don't fit in length.
+ */
+int format_cgi_environment(struct spade_server* server, http_request* request,
+        cgi_handler* handler, const char* extra_path, char* buf,
+        size_t length);
+
+/* Point envp at each variable in a block from format_cgi_environment, then
+ * at the entries of environ it doesn't replace, and end it with NULL.
+ *
+ * Modifies envp.
+ * Returns the number of variables, or -1 if more than max_variables - 1.
+ */
+int build_cgi_envp(char* environment, size_t length, char** envp,
+        size_t max_variables);
+
+/* Start program with posix_spawn, which doesn't copy the caller's page
+ * tables as fork does, with the variables in environment and its stdout
+ * on output.
+ *
+ * Returns the child's pid, or -1 with errno set if it couldn't be started.
+ */
+pid_t spawn_cgi_program(const char* program, char* environment,
+        size_t length, int output);
 
 #endif // _CGI_H_
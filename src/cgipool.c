@@ -0,0 +1,266 @@
+#include "cgipool.h"
+
+cgi_pool* create_cgi_pool(const char* program, unsigned int size,
+        unsigned int spawn_rate, unsigned int max_requests) {
+    cgi_pool* pool = calloc(1, sizeof(cgi_pool));
+    if(pool == NULL) {
+        return NULL;
+    }
+    pool->idle = calloc(size, sizeof(cgi_worker*));
+    if(pool->idle == NULL) {
+        free(pool);
+        return NULL;
+    }
+    strncpy(pool->program, program, MAX_HANDLER_PATH_LENGTH - 1);
+    pool->size = size;
+    pool->spawn_rate = spawn_rate > 0 ? spawn_rate : 1;
+    pool->max_requests = max_requests;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->available, NULL);
+    return pool;
+}
+
+/* Close every descriptor from first up in a child about to exec. The
+ * server's sockets and pipes aren't all close-on-exec.
+ */
+void close_descriptors_from(int first) {
+#ifdef SYS_close_range
+    if(syscall(SYS_close_range, first, ~0U, 0) == 0) {
+        return;
+    }
+#endif
+    int last = sysconf(_SC_OPEN_MAX);
+    for(int fd = first; fd < last; fd++) {
+        close(fd);
+    }
+}
+
+/* Start a worker process for the pool's program.
+ *
+ * Returns the worker, or NULL if it couldn't be started.
+ */
+cgi_worker* spawn_cgi_worker(cgi_pool* pool) {
+    cgi_worker* worker = calloc(1, sizeof(cgi_worker));
+    if(worker == NULL) {
+        return NULL;
+    }
+
+    int sockets[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets)) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Unable to create a socket for a CGI worker: %s",
+                strerror(errno));
+        free(worker);
+        return NULL;
+    }
+
+    /* Only async-signal-safe calls between fork and exec, as other threads
+     * may hold locks
+     */
+    char* arguments[] = { "spade", "-w", pool->program, NULL };
+    pid_t pid = fork();
+    if(pid == 0) {
+        if(sockets[1] == CGI_WORKER_SOCKET) {
+            fcntl(CGI_WORKER_SOCKET, F_SETFD, 0);
+        } else {
+            dup2(sockets[1], CGI_WORKER_SOCKET);
+        }
+        close_descriptors_from(CGI_WORKER_SOCKET + 1);
+        execv("/proc/self/exe", arguments);
+        _exit(127);
+    }
+    close(sockets[1]);
+    if(pid < 0) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Unable to fork a CGI worker: %s", strerror(errno));
+        close(sockets[0]);
+        free(worker);
+        return NULL;
+    }
+
+    worker->pid = pid;
+    worker->socket = sockets[0];
+    log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_DEBUG,
+            "Started CGI worker %d for '%s'", pid, pool->program);
+    return worker;
+}
+
+unsigned int start_cgi_pool(cgi_pool* pool) {
+    unsigned int started = 0;
+    pthread_mutex_lock(&pool->lock);
+    while(pool->live_count < pool->size) {
+        cgi_worker* worker = spawn_cgi_worker(pool);
+        if(worker == NULL) {
+            break;
+        }
+        pool->idle[pool->idle_count++] = worker;
+        pool->live_count++;
+        started++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return started;
+}
+
+cgi_worker* acquire_cgi_worker(cgi_pool* pool) {
+    time_t deadline = time(NULL) + CGI_WORKER_WAIT;
+    pthread_mutex_lock(&pool->lock);
+    while(1) {
+        if(pool->idle_count > 0) {
+            cgi_worker* worker = pool->idle[--pool->idle_count];
+            pthread_mutex_unlock(&pool->lock);
+            return worker;
+        }
+
+        time_t now = time(NULL);
+        if(pool->live_count < pool->size) {
+            if(now != pool->spawn_second) {
+                pool->spawn_second = now;
+                pool->spawned = 0;
+            }
+            if(pool->spawned < pool->spawn_rate) {
+                /* Hold the slot while the worker starts outside the lock */
+                pool->spawned++;
+                pool->live_count++;
+                pthread_mutex_unlock(&pool->lock);
+                cgi_worker* worker = spawn_cgi_worker(pool);
+                if(worker != NULL) {
+                    return worker;
+                }
+                pthread_mutex_lock(&pool->lock);
+                pool->live_count--;
+                continue;
+            }
+        }
+
+        if(now >= deadline) {
+            pthread_mutex_unlock(&pool->lock);
+            log4c_category_log(log4c_category_get("spade"),
+                    LOG4C_PRIORITY_WARN,
+                    "Timed out waiting for a CGI worker for '%s'",
+                    pool->program);
+            return NULL;
+        }
+        /* Wake up in time to start a worker the spawn rate has held back */
+        struct timespec until = { .tv_sec =
+            pool->live_count < pool->size ? now + 1 : deadline };
+        pthread_cond_timedwait(&pool->available, &pool->lock, &until);
+    }
+}
+
+int send_cgi_request(cgi_worker* worker, const char* environment,
+        uint32_t length, int output) {
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec frame = { .iov_base = &length, .iov_len = sizeof(length) };
+    struct msghdr message = { .msg_iov = &frame, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr* descriptor = CMSG_FIRSTHDR(&message);
+    descriptor->cmsg_level = SOL_SOCKET;
+    descriptor->cmsg_type = SCM_RIGHTS;
+    descriptor->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(descriptor), &output, sizeof(int));
+
+    ssize_t sent;
+    while((sent = sendmsg(worker->socket, &message, MSG_NOSIGNAL)) < 0
+            && errno == EINTR);
+    if(sent != sizeof(length)
+            || rio_writen(worker->socket, (void*) environment, length)
+                != length) {
+        return -1;
+    }
+    worker->requests++;
+    return 0;
+}
+
+void discard_cgi_worker(cgi_pool* pool, cgi_worker* worker) {
+    close(worker->socket);
+    kill(worker->pid, SIGKILL);
+    waitpid(worker->pid, NULL, 0);
+    free(worker);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->live_count--;
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void release_cgi_worker(cgi_pool* pool, cgi_worker* worker) {
+    int32_t status;
+    if(rio_readn(worker->socket, &status, sizeof(status)) != sizeof(status)) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_WARN,
+                "CGI worker %d for '%s' stopped answering", worker->pid,
+                pool->program);
+        discard_cgi_worker(pool, worker);
+        return;
+    }
+    if(pool->max_requests > 0 && worker->requests >= pool->max_requests) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_DEBUG,
+                "Recycling CGI worker %d after %u requests", worker->pid,
+                worker->requests);
+        discard_cgi_worker(pool, worker);
+        return;
+    }
+    return_cgi_worker(pool, worker);
+}
+
+void return_cgi_worker(cgi_pool* pool, cgi_worker* worker) {
+    pthread_mutex_lock(&pool->lock);
+    pool->idle[pool->idle_count++] = worker;
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Read the next request from the server into environment, which holds
+ * MAX_CGI_ENVIRONMENT_LENGTH bytes.
+ *
+ * Modifies environment, length, output.
+ * Returns 0 if successful, or -1 if the server has gone or broke the
+ * framing.
+ */
+int receive_cgi_request(char* environment, uint32_t* length, int* output) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec frame = { .iov_base = length, .iov_len = sizeof(*length) };
+    struct msghdr message = { .msg_iov = &frame, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control) };
+    ssize_t received;
+    while((received = recvmsg(CGI_WORKER_SOCKET, &message, MSG_WAITALL)) < 0
+            && errno == EINTR);
+    if(received != sizeof(*length)) {
+        return -1;
+    }
+
+    struct cmsghdr* descriptor = CMSG_FIRSTHDR(&message);
+    if(descriptor == NULL || descriptor->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    memcpy(output, CMSG_DATA(descriptor), sizeof(int));
+    if(*length > MAX_CGI_ENVIRONMENT_LENGTH
+            || rio_readn(CGI_WORKER_SOCKET, environment, *length)
+                != *length) {
+        close(*output);
+        return -1;
+    }
+    return 0;
+}
+
+int run_cgi_worker(const char* program) {
+    char environment[MAX_CGI_ENVIRONMENT_LENGTH];
+    uint32_t length;
+    int output;
+    while(!receive_cgi_request(environment, &length, &output)) {
+        pid_t child = spawn_cgi_program(program, environment, length, output);
+        close(output);
+
+        int32_t status = -1;
+        if(child > 0) {
+            int result = -1;
+            while(waitpid(child, &result, 0) < 0 && errno == EINTR);
+            status = result;
+        }
+        if(rio_writen(CGI_WORKER_SOCKET, &status, sizeof(status))
+                != sizeof(status)) {
+            break;
+        }
+    }
+    return 0;
+}
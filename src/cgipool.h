@@ -0,0 +1,107 @@
+#ifndef _CGIPOOL_H_
+#define _CGIPOOL_H_
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <log4c.h>
+
+#include "csapp.h"
+#include "cgi.h"
+
+/**
+ * cgipool.h/.c, persistent worker processes that run a CGI handler's
+ * program without starting it from the server for each request.
+ *
+ * Each worker is the spade executable started again with -w, a small
+ * single threaded process to start programs from. It waits on a Unix socket
+ * for requests, which are framed as a 32 bit length and a block of
+ * "NAME=value" variables from format_cgi_environment. The write end of a
+ * pipe for the program's output comes with the length as SCM_RIGHTS. For
+ * each one the worker spawns the unmodified program with the variables and
+ * the pipe as stdout, then answers with the program's 32 bit wait status
+ * once it has exited.
+ *
+ * Workers are started when the server starts. Ones that fail or have
+ * served their share of requests are replaced as they're needed, no faster
+ * than the spawn rate allows.
+ */
+
+/* Descriptor a worker finds its socket to the server on */
+#define CGI_WORKER_SOCKET 3
+
+#define DEFAULT_CGI_WORKER_SPAWN_RATE 4
+/* Seconds a request waits for a busy pool before giving up with a 503 */
+#define CGI_WORKER_WAIT 30
+
+typedef struct {
+    pid_t pid;
+    int socket;
+    unsigned int requests; /* Served so far */
+} cgi_worker;
+
+typedef struct cgi_pool {
+    char program[MAX_HANDLER_PATH_LENGTH];
+    unsigned int size;         /* Workers to keep running */
+    unsigned int spawn_rate;   /* Most workers started in a second */
+    unsigned int max_requests; /* Before a worker is replaced, 0 for never */
+    pthread_mutex_t lock;
+    pthread_cond_t available; /* Signalled when a worker may be free */
+    cgi_worker** idle;
+    unsigned int idle_count;
+    unsigned int live_count;  /* Idle, busy or being started */
+    time_t spawn_second;
+    unsigned int spawned;     /* In spawn_second */
+} cgi_pool;
+
+/* Allocate a pool for program, without starting any workers.
+ *
+ * Returns the pool, or NULL if out of memory.
+ */
+cgi_pool* create_cgi_pool(const char* program, unsigned int size,
+        unsigned int spawn_rate, unsigned int max_requests);
+
+/* Start the pool's workers.
+ *
+ * Returns the number started.
+ */
+unsigned int start_cgi_pool(cgi_pool* pool);
+
+/* Take an idle worker from the pool, starting one if there's room, or
+ * waiting up to CGI_WORKER_WAIT seconds for one to finish.
+ *
+ * Returns the worker, or NULL if none could be had.
+ */
+cgi_worker* acquire_cgi_worker(cgi_pool* pool);
+
+/* Send a worker a request to run its program with the variables in
+ * environment and its stdout on output.
+ *
+ * Returns 0 if successful, or -1 if the worker has gone away.
+ */
+int send_cgi_request(cgi_worker* worker, const char* environment,
+        uint32_t length, int output);
+
+/* Wait for the program a worker is running to exit, then give the worker
+ * back to the pool, or stop it if it has failed or served max_requests.
+ */
+void release_cgi_worker(cgi_pool* pool, cgi_worker* worker);
+
+/* Give a worker that isn't running anything back to the pool. */
+void return_cgi_worker(cgi_pool* pool, cgi_worker* worker);
+
+/* Stop a worker that can't be used again and let the pool replace it. */
+void discard_cgi_worker(cgi_pool* pool, cgi_worker* worker);
+
+/* Main loop of a worker process started with -w, serving requests on
+ * CGI_WORKER_SOCKET by running program until the server closes it.
+ *
+ * Returns the process's exit status.
+ */
+int run_cgi_worker(const char* program);
+
+#endif // _CGIPOOL_H_
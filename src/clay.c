@@ -1,27 +1,642 @@
 #include "clay.h"
 #include "server.h"
 
-clay_variables build_clay_variables(spade_server* server, http_request* request,
-        clay_handler* handler, int incoming_socket) {
-    clay_variables variables;
-    variables.incoming_socket = incoming_socket;
-
-    strcpy(variables.server_software, SPADE_SERVER_DESCRIPTOR);
-    strcpy(variables.server_name, server->hostname);
-    strcpy(variables.gateway_interface, CGI_VERSION);
-
-    strcpy(variables.server_protocol, "HTTP/1.0");
-    char stringified_port[MAX_PORT_LENGTH]; 
-    sprintf(stringified_port, "%d", server->port);
-    strcpy(variables.server_port, stringified_port);
-    strcpy(variables.request_method, http_method_to_string(request->method));
-
-    strcpy(variables.script_name, handler->path);
-    strcpy(variables.query_string, request->uri.query_string);
+int encode_clay_variables(spade_server* server, http_request* request,
+        clay_handler* handler, const char* path_parameters,
+        const char* extra_path, uint64_t id, clay_encoder* encoder) {
+    if(begin_clay_request(encoder, id)) {
+        return -1;
+    }
+    char stringified_port[MAX_PORT_LENGTH];
+    int port_length = snprintf(stringified_port, MAX_PORT_LENGTH, "%d",
+            server->port);
+    add_clay_variable(encoder, "SERVER_SOFTWARE", SPADE_SERVER_DESCRIPTOR,
+            strlen(SPADE_SERVER_DESCRIPTOR));
+    add_clay_variable(encoder, "SERVER_NAME", server->hostname,
+            strlen(server->hostname));
+    add_clay_variable(encoder, "GATEWAY_INTERFACE", CGI_VERSION,
+            strlen(CGI_VERSION));
+    add_clay_variable(encoder, "SERVER_PROTOCOL", "HTTP/1.0", 8);
+    add_clay_variable(encoder, "SERVER_PORT", stringified_port, port_length);
+
+    const char* method = http_method_to_string(request->method);
+    add_clay_variable(encoder, "REQUEST_METHOD", method, strlen(method));
+    add_clay_variable(encoder, "SCRIPT_NAME", handler->path,
+            strlen(handler->path));
+    add_clay_variable(encoder, "PATH_INFO", extra_path, strlen(extra_path));
+    add_clay_variable(encoder, "QUERY_STRING",
+            http_request_string(request, request->uri.query_string),
+            request->uri.query_string.length);
     if(request->remote_host[0] != '\0') {
-        strcpy(variables.remote_host, request->remote_host);
+        add_clay_variable(encoder, "REMOTE_HOST", request->remote_host,
+                strlen(request->remote_host));
+    }
+    add_clay_variable(encoder, "REMOTE_ADDR", request->remote_address,
+            strlen(request->remote_address));
+    add_clay_variable(encoder, "PATH_PARAMETERS", path_parameters,
+            strlen(path_parameters));
+
+    http_message* message = &request->message;
+    for(unsigned int i = 0; i < message->header_count; i++) {
+        add_clay_header(encoder,
+                http_request_string(request, message->headers[i].key),
+                http_request_string(request, message->headers[i].value));
+    }
+    // Spade only supports GET requests, so there's no body yet.
+    return finish_clay_request(encoder, NULL, 0);
+}
+
+/* Returns the backend with this identity, or NULL if it isn't known. */
+clay_backend* find_clay_backend(clay_handler* handler, const void* identity,
+        size_t length) {
+    for(unsigned int i = 0; i < handler->backend_count; i++) {
+        clay_backend* backend = &handler->backends[i];
+        if(backend->identity_length == length
+                && !memcmp(backend->identity, identity, length)) {
+            return backend;
+        }
+    }
+    return NULL;
+}
+
+int add_clay_backend(clay_handler* handler, const void* identity,
+        size_t length) {
+    if(length > MAX_CLAY_IDENTITY) {
+        return -1;
+    }
+    clay_backend* backend = find_clay_backend(handler, identity, length);
+    if(backend == NULL) {
+        if(handler->backend_count == handler->backend_capacity) {
+            unsigned int capacity = handler->backend_capacity
+                ? handler->backend_capacity * 2 : 4;
+            clay_backend* backends = realloc(handler->backends,
+                    capacity * sizeof(clay_backend));
+            if(backends == NULL) {
+                return -1;
+            }
+            handler->backends = backends;
+            handler->backend_capacity = capacity;
+        }
+        backend = &handler->backends[handler->backend_count++];
+        memset(backend, 0, sizeof(clay_backend));
+        memcpy(backend->identity, identity, length);
+        backend->identity_length = length;
+        backend->serial = ++handler->backend_serials;
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+                "Clay backend %u connected to '%s'",
+                handler->backend_count - 1, handler->endpoint);
+    }
+    /* A backend only says it's ready when it has nothing left to answer */
+    backend->in_flight = 0;
+    backend->last_heard = time(NULL);
+    return 0;
+}
+
+/* Returns the bucket of the handler's pending requests that id goes in. */
+clay_request** find_clay_bucket(clay_handler* handler, uint64_t id) {
+    return &handler->pending[id % CLAY_PENDING_BUCKETS];
+}
+
+/* Remember a request sent to a backend until its response ends. */
+void add_pending_clay_request(clay_handler* handler, clay_request* request) {
+    clay_request** bucket = find_clay_bucket(handler, request->id);
+    request->next = *bucket;
+    *bucket = request;
+}
+
+/* Returns the pending request with this id, taking it out of the pending
+ * requests if remove is set, or NULL if there is none.
+ */
+clay_request* find_pending_clay_request(clay_handler* handler, uint64_t id,
+        int remove) {
+    clay_request** link = find_clay_bucket(handler, id);
+    while(*link != NULL && (*link)->id != id) {
+        link = &(*link)->next;
+    }
+    clay_request* request = *link;
+    if(request != NULL && remove) {
+        *link = request->next;
+    }
+    return request;
+}
+
+/* Link a request whose output has started to queue into the handler's
+ * list of requests with output.
+ */
+void add_clay_writer(clay_handler* handler, clay_request* request) {
+    request->writing_previous = NULL;
+    request->writing_next = handler->writing;
+    if(handler->writing != NULL) {
+        handler->writing->writing_previous = request;
+    }
+    handler->writing = request;
+    request->last_written = time(NULL);
+}
+
+void remove_clay_writer(clay_handler* handler, clay_request* request) {
+    if(request->writing_previous != NULL) {
+        request->writing_previous->writing_next = request->writing_next;
+    } else {
+        handler->writing = request->writing_next;
+    }
+    if(request->writing_next != NULL) {
+        request->writing_next->writing_previous = request->writing_previous;
+    }
+    request->writing_previous = NULL;
+    request->writing_next = NULL;
+}
+
+void free_clay_output(clay_request* request) {
+    while(request->output_head != NULL) {
+        clay_chunk* chunk = request->output_head;
+        request->output_head = chunk->next;
+        free(chunk);
+    }
+    request->output_tail = NULL;
+    request->output_length = 0;
+}
+
+/* Close the request's client connection and drop any output it hadn't
+ * read. The request itself is left for its response to finish.
+ */
+void disconnect_clay_client(clay_handler* handler, clay_request* request) {
+    if(request->incoming_socket >= 0) {
+        epoll_ctl(handler->writers, EPOLL_CTL_DEL, request->incoming_socket,
+                NULL);
+        close(request->incoming_socket);
+        request->incoming_socket = -1;
+    }
+    if(request->output_head != NULL) {
+        remove_clay_writer(handler, request);
+        free_clay_output(request);
+    }
+}
+
+void discard_clay_request(clay_handler* handler, clay_request* request) {
+    disconnect_clay_client(handler, request);
+    free(request->data);
+    free(request);
+}
+
+/* Append a copy of data to the output waiting for the request's client.
+ *
+ * Returns 0 if successful, or -1 if out of memory or the client is too far
+ * behind.
+ */
+int queue_clay_output(clay_request* request, const char* data,
+        size_t length) {
+    if(request->output_length + length > MAX_CLAY_QUEUED_OUTPUT) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_WARN,
+                "Giving up on a Clay client with %zu bytes it hasn't read",
+                request->output_length);
+        return -1;
+    }
+    clay_chunk* chunk = malloc(sizeof(clay_chunk) + length);
+    if(chunk == NULL) {
+        return -1;
+    }
+    chunk->next = NULL;
+    chunk->length = length;
+    chunk->sent = 0;
+    memcpy(chunk->data, data, length);
+    if(request->output_tail != NULL) {
+        request->output_tail->next = chunk;
+    } else {
+        request->output_head = chunk;
+    }
+    request->output_tail = chunk;
+    request->output_length += length;
+    return 0;
+}
+
+/* Write as much of data to the request's client as it will take without
+ * blocking.
+ *
+ * Returns the number of bytes written, or -1 if the client has gone.
+ */
+ssize_t write_clay_client(clay_request* request, const char* data,
+        size_t length) {
+    size_t written = 0;
+    while(written < length) {
+        ssize_t result = write(request->incoming_socket, data + written,
+                length - written);
+        if(result < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        written += result;
+    }
+    if(written > 0) {
+        request->last_written = time(NULL);
+    }
+    return written;
+}
+
+/* Pass a chunk of a response on to the request's client, writing what it's
+ * ready for now and queueing the rest behind any output already waiting.
+ */
+void deliver_clay_output(clay_handler* handler, clay_request* request,
+        const char* data, size_t length) {
+    if(request->incoming_socket < 0 || length == 0) {
+        return;
+    }
+    ssize_t written = 0;
+    if(request->output_head == NULL) {
+        written = write_clay_client(request, data, length);
+        if(written < 0) {
+            disconnect_clay_client(handler, request);
+            return;
+        }
+        if(written == length) {
+            return;
+        }
+        add_clay_writer(handler, request);
+    }
+    if(queue_clay_output(request, data + written, length - written)) {
+        disconnect_clay_client(handler, request);
+    }
+}
+
+/* Write the request's queued output now that its client has room, and
+ * finish with the request once it's all written and the response has
+ * ended.
+ */
+void flush_clay_output(clay_handler* handler, clay_request* request) {
+    while(request->output_head != NULL) {
+        clay_chunk* chunk = request->output_head;
+        ssize_t written = write_clay_client(request,
+                chunk->data + chunk->sent, chunk->length - chunk->sent);
+        if(written < 0) {
+            disconnect_clay_client(handler, request);
+            break;
+        }
+        chunk->sent += written;
+        request->output_length -= written;
+        if(chunk->sent < chunk->length) {
+            return;
+        }
+        request->output_head = chunk->next;
+        free(chunk);
+        if(request->output_head == NULL) {
+            request->output_tail = NULL;
+            remove_clay_writer(handler, request);
+        }
+    }
+    if(request->finished) {
+        discard_clay_request(handler, request);
     }
-    strcpy(variables.remote_address, request->remote_address);
+}
+
+/* Disconnect clients that haven't read any of their output for
+ * CLAY_WRITE_TIMEOUT seconds.
+ */
+void expire_clay_clients(clay_handler* handler) {
+    time_t now = time(NULL);
+    clay_request* request = handler->writing;
+    while(request != NULL) {
+        clay_request* next = request->writing_next;
+        if(now - request->last_written > CLAY_WRITE_TIMEOUT) {
+            log4c_category_log(log4c_category_get("spade"),
+                    LOG4C_PRIORITY_WARN,
+                    "Giving up on a Clay client that has read nothing for "
+                    "%d seconds", CLAY_WRITE_TIMEOUT);
+            disconnect_clay_client(handler, request);
+            if(request->finished) {
+                discard_clay_request(handler, request);
+            }
+        }
+        request = next;
+    }
+}
+
+/* Close the connections of every pending request sent to the backend with
+ * this serial, which won't be answering them.
+ */
+void abandon_clay_requests(clay_handler* handler, unsigned long serial) {
+    for(unsigned int i = 0; i < CLAY_PENDING_BUCKETS; i++) {
+        clay_request** link = &handler->pending[i];
+        while(*link != NULL) {
+            clay_request* request = *link;
+            if(request->backend == serial) {
+                *link = request->next;
+                discard_clay_request(handler, request);
+            } else {
+                link = &request->next;
+            }
+        }
+    }
+}
+
+clay_backend* reserve_clay_backend(clay_handler* handler) {
+    time_t now = time(NULL);
+    clay_backend* chosen = NULL;
+    unsigned int i = 0;
+    while(i < handler->backend_count) {
+        clay_backend* backend = &handler->backends[i];
+        time_t silence = now - backend->last_heard;
+        if(silence > CLAY_BACKEND_EXPIRY) {
+            log4c_category_log(log4c_category_get("spade"),
+                    LOG4C_PRIORITY_INFO,
+                    "Forgetting Clay backend %u of '%s', silent for %ld "
+                    "seconds", i, handler->endpoint, (long) silence);
+            abandon_clay_requests(handler, backend->serial);
+            *backend = handler->backends[--handler->backend_count];
+            chosen = NULL; /* May have moved, so start over */
+            i = 0;
+            continue;
+        }
+        /* An idle backend sends heartbeats, so a quiet one has gone */
+        if(backend->in_flight > 0 || silence <= CLAY_BACKEND_TIMEOUT) {
+            if(chosen == NULL || backend->in_flight < chosen->in_flight
+                    || (backend->in_flight == chosen->in_flight
+                        && backend->last_sent < chosen->last_sent)) {
+                chosen = backend;
+            }
+        }
+        i++;
+    }
+    if(chosen != NULL) {
+        chosen->in_flight++;
+        chosen->last_sent = ++handler->dispatched;
+    }
+    return chosen;
+}
+
+void release_clay_backend(clay_backend* backend) {
+    if(backend->in_flight > 0) {
+        backend->in_flight--;
+    }
+    backend->served++;
+    backend->last_heard = time(NULL);
+}
 
-    return variables;
+int clay_backends_connected(clay_handler* handler) {
+    return __atomic_load_n(&handler->backend_count, __ATOMIC_RELAXED) > 0;
+}
+
+/* Returns 1 if the message part just received on socket has more after
+ * it.
+ */
+int clay_message_has_more(void* socket) {
+    int64_t more = 0;
+    size_t more_size = sizeof(more);
+    zmq_getsockopt(socket, ZMQ_RCVMORE, &more, &more_size);
+    return more != 0;
+}
+
+/* Receive the next part of a message into msg, which must be initialized,
+ * if the last part had more after it.
+ *
+ * Returns 0 if a part was received, or -1 if there are no more.
+ */
+int receive_clay_part(void* socket, zmq_msg_t* msg) {
+    if(!clay_message_has_more(socket)) {
+        return -1;
+    }
+    return zmq_recv(socket, msg, 0) ? -1 : 0;
+}
+
+/* Handle the next message from the handler's backends, if one is waiting.
+ * A ROUTER socket starts each with the sender's identity; then comes an
+ * empty part saying a backend is ready, or a chunk of a response to write
+ * to its client.
+ *
+ * Returns 0 if a message was handled, or -1 if none was waiting.
+ */
+int receive_clay_message(clay_handler* handler) {
+    zmq_msg_t identity, header, body;
+    zmq_msg_init(&identity);
+    if(zmq_recv(handler->socket, &identity, ZMQ_NOBLOCK)) {
+        zmq_msg_close(&identity);
+        return -1;
+    }
+    /* The rest of a multipart message arrives with its first part */
+    zmq_msg_init(&header);
+    zmq_msg_init(&body);
+    if(receive_clay_part(handler->socket, &header)) {
+        zmq_msg_close(&identity);
+        zmq_msg_close(&header);
+        zmq_msg_close(&body);
+        return 0;
+    }
+    int has_body = !receive_clay_part(handler->socket, &body);
+    /* Skip any parts beyond the ones expected */
+    zmq_msg_t extra;
+    zmq_msg_init(&extra);
+    while(!receive_clay_part(handler->socket, &extra));
+    zmq_msg_close(&extra);
+
+    uint64_t id;
+    int flags;
+    if(zmq_msg_size(&header) == 0) {
+        pthread_mutex_lock(&handler->lock);
+        add_clay_backend(handler, zmq_msg_data(&identity),
+                zmq_msg_size(&identity));
+        pthread_mutex_unlock(&handler->lock);
+    } else if(!decode_clay_response_header(zmq_msg_data(&header),
+                zmq_msg_size(&header), &id, &flags)) {
+        pthread_mutex_lock(&handler->lock);
+        clay_backend* backend = find_clay_backend(handler,
+                zmq_msg_data(&identity), zmq_msg_size(&identity));
+        clay_request* request = find_pending_clay_request(handler, id, 0);
+        /* Only the backend a request was sent to may answer it */
+        if(backend == NULL || request == NULL
+                || request->backend != backend->serial) {
+            request = NULL;
+        } else if(flags & CLAY_RESPONSE_END) {
+            find_pending_clay_request(handler, id, 1);
+            release_clay_backend(backend);
+        } else {
+            /* A backend streaming a long response is still alive */
+            backend->last_heard = time(NULL);
+        }
+        pthread_mutex_unlock(&handler->lock);
+
+        if(request != NULL) {
+            if(has_body) {
+                deliver_clay_output(handler, request, zmq_msg_data(&body),
+                        zmq_msg_size(&body));
+            }
+            if(flags & CLAY_RESPONSE_END) {
+                /* Anything still queued is written as the client reads */
+                request->finished = 1;
+                if(request->output_head == NULL) {
+                    discard_clay_request(handler, request);
+                }
+            }
+        }
+    }
+    zmq_msg_close(&identity);
+    zmq_msg_close(&header);
+    zmq_msg_close(&body);
+    return 0;
+}
+
+void free_clay_message(void* data, void* hint) {
+    free(data);
+}
+
+/* Send a queued request to the least loaded backend, as its identity then
+ * the message, and keep it pending until the response ends. Then the
+ * response's status line is sent. If the request can't be sent, the client
+ * is answered with a 502 or 503 and its connection closed.
+ *
+ * From here on the client's socket is non-blocking, and watched for room to
+ * write the response.
+ */
+void dispatch_clay_request(clay_handler* handler, clay_request* request) {
+    pthread_mutex_lock(&handler->lock);
+    clay_backend* backend = reserve_clay_backend(handler);
+    zmq_msg_t identity, msg;
+    int rc = -1;
+    if(backend != NULL
+            && !(rc = zmq_msg_init_size(&identity, backend->identity_length))) {
+        memcpy(zmq_msg_data(&identity), backend->identity,
+                backend->identity_length);
+        rc = zmq_send(handler->socket, &identity, ZMQ_SNDMORE);
+        zmq_msg_close(&identity);
+    }
+    if(rc == 0 && !(rc = zmq_msg_init_data(&msg, request->data,
+                    request->length, free_clay_message, NULL))) {
+        request->data = NULL; /* The message frees it now */
+        rc = zmq_send(handler->socket, &msg, 0);
+        zmq_msg_close(&msg);
+    }
+    if(rc != 0 && backend != NULL) {
+        backend->in_flight--;
+    } else if(rc == 0) {
+        request->backend = backend->serial;
+        add_pending_clay_request(handler, request);
+    }
+    pthread_mutex_unlock(&handler->lock);
+
+    if(rc != 0) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_WARN,
+                "Unable to send a request to a Clay backend at '%s'",
+                handler->endpoint);
+        /* The socket is still blocking, and nothing has been sent on it */
+        if(backend == NULL) {
+            return_client_error(request->incoming_socket, handler->path,
+                    "503", "Service unavailable",
+                    "No Clay backend is ready to take the request");
+        } else {
+            return_client_error(request->incoming_socket, handler->path,
+                    "502", "Bad Gateway",
+                    "Spade couldn't pass the request to a Clay backend");
+        }
+        close(request->incoming_socket);
+        free(request->data);
+        free(request);
+        return;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLOUT | EPOLLET;
+    event.data.ptr = request;
+    if(set_nonblocking(request->incoming_socket, 1)
+            || epoll_ctl(handler->writers, EPOLL_CTL_ADD,
+                request->incoming_socket, &event)) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_WARN,
+                "Unable to watch a Clay client: %s", strerror(errno));
+        close(request->incoming_socket);
+        request->incoming_socket = -1;
+        return;
+    }
+
+    /* Only now is the request sure to be answered. Its status line goes
+     * out ahead of any chunk, as they're handled on this thread too.
+     */
+    char headers[MAXLINE];
+    int header_length = format_response_headers(headers, "200", "OK", NULL,
+            0, 0, 0);
+    deliver_clay_output(handler, request, headers, header_length);
+}
+
+/* Main loop of a handler's dispatch thread, which waits on the handler's
+ * socket, its queue of requests and its clients' sockets together.
+ */
+void* clay_dispatch_helper(void* args) {
+    signal(SIGPIPE, SIG_IGN);
+    clay_handler* handler = (clay_handler*) args;
+    zmq_pollitem_t items[] = {
+        { handler->socket, 0, ZMQ_POLLIN, 0 },
+        { NULL, handler->queue.event, ZMQ_POLLIN, 0 },
+        { NULL, handler->writers, ZMQ_POLLIN, 0 }
+    };
+    struct epoll_event events[CLAY_MAX_WRITE_EVENTS];
+    time_t last_expired = time(NULL);
+
+    while(1) {
+        /* Wake up each second to check on slow clients, if there are any.
+         * zmq_poll takes microseconds.
+         */
+        long timeout = handler->writing != NULL ? 1000000L : -1;
+        if(zmq_poll(items, 3, timeout) < 0) {
+            continue;
+        }
+        if(items[2].revents & ZMQ_POLLIN) {
+            int ready = epoll_wait(handler->writers, events,
+                    CLAY_MAX_WRITE_EVENTS, 0);
+            for(int i = 0; i < ready; i++) {
+                flush_clay_output(handler, events[i].data.ptr);
+            }
+        }
+        if(handler->writing != NULL && time(NULL) != last_expired) {
+            last_expired = time(NULL);
+            expire_clay_clients(handler);
+        }
+        if(items[1].revents & ZMQ_POLLIN) {
+            acknowledge_clay_queue(&handler->queue);
+            clay_request* request;
+            while((request = pop_clay_request(&handler->queue)) != NULL) {
+                dispatch_clay_request(handler, request);
+            }
+        }
+        if(items[0].revents & ZMQ_POLLIN) {
+            while(!receive_clay_message(handler));
+        }
+    }
+
+    return 0;
+}
+
+int start_clay_dispatcher(clay_handler* handler, pthread_attr_t* attributes) {
+    if(initialize_clay_queue(&handler->queue)) {
+        return -1;
+    }
+    handler->writers = epoll_create1(EPOLL_CLOEXEC);
+    if(handler->writers < 0) {
+        close(handler->queue.event);
+        return -1;
+    }
+    if(pthread_create(&handler->dispatch_thread, attributes,
+                clay_dispatch_helper, handler)) {
+        close(handler->queue.event);
+        close(handler->writers);
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t next_clay_request_id(clay_handler* handler) {
+    return __atomic_add_fetch(&handler->request_ids, 1, __ATOMIC_RELAXED);
+}
+
+int submit_clay_request(clay_handler* handler, int incoming_socket,
+        uint64_t id, void* data, size_t length) {
+    clay_request* request = calloc(1, sizeof(clay_request));
+    if(request == NULL) {
+        return -1;
+    }
+    request->incoming_socket = incoming_socket;
+    request->id = id;
+    request->data = data;
+    request->length = length;
+    push_clay_request(&handler->queue, request);
+    return 0;
 }
@@ -3,46 +3,156 @@
 
 #define _GNU_SOURCE
 
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
 #include <zmq.h>
 
 #include "http.h"
 #include "constants.h"
+#include "clayqueue.h"
+#include "claywire.h"
+
+/**
+ * clay.h/.c, requests passed to long-running backend processes over ZeroMQ.
+ *
+ * Each Clay handler binds a ROUTER socket at its endpoint, and any number
+ * of backends connect to it with DEALER sockets. A backend announces itself
+ * by sending an empty message, and sends another every
+ * CLAY_HEARTBEAT_INTERVAL seconds while it's idle. Each request goes to the
+ * backend with the fewest requests in flight, ties going to the one that
+ * has waited longest, encoded as described in claywire.h.
+ *
+ * The backend answers with any number of messages, each a response header
+ * part with the request's id and a part holding the next chunk of the
+ * response, which may be empty. The server writes each chunk to the client
+ * as it arrives, and closes the connection after the one flagged
+ * CLAY_RESPONSE_END. Separate messages are what let a response stream, as
+ * ZeroMQ only delivers a multipart message once all its parts are sent.
+ *
+ * A backend that's idle but hasn't been heard from in CLAY_BACKEND_TIMEOUT
+ * seconds is passed over, and one that has been silent for
+ * CLAY_BACKEND_EXPIRY seconds is forgotten, so backends can come and go.
+ * Requests it was working on are given up and their connections closed.
+ *
+ * ZeroMQ sockets can't be shared between threads, so each handler's socket
+ * belongs to one dispatch thread. Request threads hand it requests through
+ * a clay_queue, and it sends them on and writes the responses to clients.
+ *
+ * Client sockets are non-blocking. Whatever a client isn't ready for is
+ * queued on its request and written as an epoll descriptor, polled along
+ * with the ZeroMQ socket, reports room for it, so a slow client only holds
+ * up its own response. A backend is free for its next request as soon as
+ * it has sent a response's end. A client with more than
+ * MAX_CLAY_QUEUED_OUTPUT bytes waiting, or that reads nothing for
+ * CLAY_WRITE_TIMEOUT seconds, is disconnected.
+ */
 
 #define MAX_CLAY_PARAMETER_LENGTH 255
+#define CLAY_PENDING_BUCKETS 1024
 #define MAX_ENDPOINT 255
-#define MAX_RESPONSE_SIZE 2048
+/* Longest identity a ROUTER socket gives a peer */
+#define MAX_CLAY_IDENTITY 255
 
-struct spade_server;
+#define CLAY_HEARTBEAT_INTERVAL 1
+#define CLAY_BACKEND_TIMEOUT 3
+#define CLAY_BACKEND_EXPIRY 60
 
-typedef struct {
-    char server_software[MAX_CLAY_PARAMETER_LENGTH];
-    char server_name[MAX_CLAY_PARAMETER_LENGTH];
-    char gateway_interface[MAX_CLAY_PARAMETER_LENGTH];
-    char server_protocol[MAX_CLAY_PARAMETER_LENGTH];
-    char server_port[MAX_CLAY_PARAMETER_LENGTH];
-    char request_method[MAX_CLAY_PARAMETER_LENGTH];
-    char script_name[MAX_CLAY_PARAMETER_LENGTH];
-    char query_string[MAX_CLAY_PARAMETER_LENGTH];
-    char remote_host[MAX_CLAY_PARAMETER_LENGTH];
-    char remote_address[MAX_CLAY_PARAMETER_LENGTH];
-    int incoming_socket;
-} clay_variables;
+#define MAX_CLAY_QUEUED_OUTPUT (8 * 1024 * 1024)
+#define CLAY_WRITE_TIMEOUT 30
+#define CLAY_MAX_WRITE_EVENTS 64
 
+struct spade_server;
+
+/* A backend process connected to a Clay handler's endpoint */
 typedef struct {
-    int response_length;
-    char response[MAX_RESPONSE_SIZE];
-    int incoming_socket;
-} clay_response;
+    unsigned char identity[MAX_CLAY_IDENTITY];
+    size_t identity_length;
+    unsigned int in_flight; /* Requests sent and not yet answered */
+    unsigned long served;   /* Responses received */
+    unsigned long last_sent; /* The handler's dispatch count at its last */
+    time_t last_heard;
+    unsigned long serial;   /* Tells apart backends that reuse an identity */
+} clay_backend;
 
 typedef struct {
     char path[MAX_DYNAMIC_PATH_PREFIX];
     char endpoint[MAX_ENDPOINT];
-    void* socket;
-    pthread_t receive_thread;
+    void* socket; /* Only used by the dispatch thread once it's started */
+    pthread_t dispatch_thread;
+    clay_queue queue;     /* Requests for the dispatch thread */
+    pthread_mutex_t lock; /* Guards the backends */
+    clay_backend* backends;
+    unsigned int backend_count;
+    unsigned int backend_capacity;
+    unsigned long dispatched; /* Requests sent to any backend */
+    unsigned long backend_serials; /* Last serial given to a backend */
+    uint64_t request_ids;          /* Last id given to a request */
+    /* Requests sent and not yet answered, by id, and requests with output
+     * waiting for their clients. Only the dispatch thread uses them.
+     */
+    clay_request* pending[CLAY_PENDING_BUCKETS];
+    clay_request* writing;
+    int writers; /* epoll descriptor watching clients with output */
 } clay_handler;
 
-clay_variables build_clay_variables(struct spade_server* server,
-				http_request* request, clay_handler* handler,
-                int incoming_socket);
+/* Encode a request for a Clay handler's backends, with the route's
+ * parameters formatted as a query string and extra_path, whatever a
+ * trailing "*" matched, as PATH_INFO.
+ *
+ * Returns 0 with the message in encoder, or -1 if out of memory or the
+ * request is too big for the wire format.
+ */
+int encode_clay_variables(struct spade_server* server, http_request* request,
+        clay_handler* handler, const char* path_parameters,
+        const char* extra_path, uint64_t id, clay_encoder* encoder);
+
+/* Record that the backend with this identity is alive and has nothing in
+ * flight, adding it to the handler's backends if it's new. The handler's
+ * lock must be held.
+ *
+ * Returns 0 if successful, or -1 if out of memory.
+ */
+int add_clay_backend(clay_handler* handler, const void* identity,
+        size_t length);
+
+/* Pick the least loaded backend that's alive to send a request to, and
+ * count the request against it. The handler's lock must be held.
+ *
+ * Returns the backend, or NULL if there is none.
+ */
+clay_backend* reserve_clay_backend(clay_handler* handler);
+
+/* Count a request to the backend as finished. The handler's lock must be
+ * held.
+ */
+void release_clay_backend(clay_backend* backend);
+
+/* Returns 1 if any backend has connected to the handler and not been
+ * forgotten since. It may still be too busy or quiet to be sent requests.
+ */
+int clay_backends_connected(clay_handler* handler);
+
+/* Returns a new id for a request to the handler's backends. Safe to call
+ * from any thread.
+ */
+uint64_t next_clay_request_id(clay_handler* handler);
+
+/* Start the thread that owns the handler's bound socket. Nothing else may
+ * use the socket afterwards.
+ *
+ * Returns 0 if successful, or -1 if the thread couldn't be started.
+ */
+int start_clay_dispatcher(clay_handler* handler, pthread_attr_t* attributes);
+
+/* Queue data, a malloced message for a backend with the request id
+ * from next_clay_request_id, to be sent by the
+ * handler's dispatch thread, which then owns data and incoming_socket.
+ * Safe to call from any thread.
+ *
+ * Returns 0 if successful, or -1 if out of memory.
+ */
+int submit_clay_request(clay_handler* handler, int incoming_socket,
+        uint64_t id, void* data, size_t length);
 
 #endif // _CLAY_H_
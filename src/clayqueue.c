@@ -0,0 +1,62 @@
+#include "clayqueue.h"
+
+int initialize_clay_queue(clay_queue* queue) {
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+    queue->signalled = 0;
+    queue->event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    return queue->event < 0 ? -1 : 0;
+}
+
+/* Link a request in at the head without waking the consumer */
+void link_clay_request(clay_queue* queue, clay_request* request) {
+    __atomic_store_n(&request->next, NULL, __ATOMIC_RELAXED);
+    clay_request* previous = __atomic_exchange_n(&queue->head, request,
+            __ATOMIC_ACQ_REL);
+    /* Until this store, the consumer sees the list end at previous */
+    __atomic_store_n(&previous->next, request, __ATOMIC_RELEASE);
+}
+
+void push_clay_request(clay_queue* queue, clay_request* request) {
+    link_clay_request(queue, request);
+    if(!__atomic_exchange_n(&queue->signalled, 1, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        while(write(queue->event, &one, sizeof(one)) < 0 && errno == EINTR);
+    }
+}
+
+clay_request* pop_clay_request(clay_queue* queue) {
+    clay_request* tail = queue->tail;
+    clay_request* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if(tail == &queue->stub) {
+        if(next == NULL) {
+            return NULL;
+        }
+        queue->tail = tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if(next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+
+    if(tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) {
+        /* A producer has swapped the head but not linked it yet */
+        return NULL;
+    }
+    /* Put the stub back behind the last request so it can be taken */
+    link_clay_request(queue, &queue->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if(next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+void acknowledge_clay_queue(clay_queue* queue) {
+    uint64_t count;
+    while(read(queue->event, &count, sizeof(count)) < 0 && errno == EINTR);
+    __atomic_store_n(&queue->signalled, 0, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,83 @@
+#ifndef _CLAYQUEUE_H_
+#define _CLAYQUEUE_H_
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "ring.h"
+
+/**
+ * clayqueue.h/.c, lock-free queue of requests waiting for a Clay handler's
+ * dispatch thread.
+ *
+ * Any number of threads push requests, and only the dispatch thread pops
+ * them, so a push is one atomic exchange of the head and a pop touches no
+ * shared state unless the queue is nearly empty. The first push after the
+ * dispatch thread last looked also writes to an eventfd, which it polls
+ * along with its ZeroMQ socket.
+ */
+
+/* Part of a response waiting for its client to read it */
+typedef struct clay_chunk {
+    struct clay_chunk* next;
+    size_t length;
+    size_t sent;
+    char data[];
+} clay_chunk;
+
+typedef struct clay_request {
+    /* Next in the queue, then in the handler's pending requests */
+    struct clay_request* next;
+    int incoming_socket; /* -1 once the client has been given up on */
+    uint64_t id;
+    void* data; /* Message for the backend, freed once it's sent */
+    size_t length;
+    unsigned long backend; /* Serial of the backend it was sent to */
+    clay_chunk* output_head; /* Response not yet written to the client */
+    clay_chunk* output_tail;
+    size_t output_length;
+    time_t last_written; /* When the client last took some of the output */
+    int finished;        /* The backend has sent the end of the response */
+    struct clay_request* writing_previous; /* Links in the handler's list */
+    struct clay_request* writing_next;     /* of requests with output */
+} clay_request;
+
+typedef struct {
+    clay_request* head; /* Last pushed, swapped by producers */
+    char head_padding[CACHE_LINE_SIZE];
+    clay_request* tail; /* Next to pop, only used by the consumer */
+    clay_request stub;  /* Keeps the list non-empty */
+    int signalled;      /* Set once the eventfd has been written to */
+    int event;          /* eventfd the consumer polls */
+} clay_queue;
+
+/* Set up an empty queue and its eventfd.
+ *
+ * Returns 0 if successful, or -1 if the eventfd couldn't be created.
+ */
+int initialize_clay_queue(clay_queue* queue);
+
+/* Add a request to the queue and wake the consumer if it isn't already
+ * due to look. Safe to call from any thread.
+ */
+void push_clay_request(clay_queue* queue, clay_request* request);
+
+/* Take the oldest request off the queue. Only the consumer may call this.
+ *
+ * Returns the request, or NULL if there is none ready. A NULL may come
+ * while a push is half done, in which case the consumer is woken again.
+ */
+clay_request* pop_clay_request(clay_queue* queue);
+
+/* Clear the consumer's wakeup before it drains the queue, so that pushes
+ * from then on wake it again.
+ */
+void acknowledge_clay_queue(clay_queue* queue);
+
+#endif // _CLAYQUEUE_H_
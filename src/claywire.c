@@ -0,0 +1,201 @@
+#include "claywire.h"
+
+/* Offset of the variable count in a request */
+#define CLAY_REQUEST_COUNT_OFFSET 10
+
+void put_clay_integer(unsigned char* buf, uint64_t value, int bytes) {
+    for(int i = bytes - 1; i >= 0; i--) {
+        buf[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+uint64_t get_clay_integer(const unsigned char* buf, int bytes) {
+    uint64_t value = 0;
+    for(int i = 0; i < bytes; i++) {
+        value = (value << 8) | buf[i];
+    }
+    return value;
+}
+
+/* Returns a pointer to length more bytes at the end of the encoder's
+ * buffer, or NULL if out of memory.
+ */
+unsigned char* extend_clay_encoder(clay_encoder* encoder, size_t length) {
+    if(encoder->failed) {
+        return NULL;
+    }
+    if(encoder->length + length > encoder->capacity) {
+        size_t capacity = encoder->capacity * 2;
+        while(capacity < encoder->length + length) {
+            capacity *= 2;
+        }
+        char* data = realloc(encoder->data, capacity);
+        if(data == NULL) {
+            encoder->failed = 1;
+            return NULL;
+        }
+        encoder->data = data;
+        encoder->capacity = capacity;
+    }
+    unsigned char* end = (unsigned char*) encoder->data + encoder->length;
+    encoder->length += length;
+    return end;
+}
+
+int begin_clay_request(clay_encoder* encoder, uint64_t id) {
+    encoder->capacity = 512;
+    encoder->data = malloc(encoder->capacity);
+    encoder->length = 0;
+    encoder->variable_count = 0;
+    encoder->failed = encoder->data == NULL;
+    unsigned char* header = extend_clay_encoder(encoder,
+            CLAY_REQUEST_COUNT_OFFSET + 2);
+    if(header == NULL) {
+        return -1;
+    }
+    header[0] = CLAY_WIRE_VERSION;
+    header[1] = CLAY_MESSAGE_REQUEST;
+    put_clay_integer(header + 2, id, 8);
+    return 0;
+}
+
+/* Start a variable with a name of name_length bytes and a value of
+ * value_length, returning where the name goes, with the value after it.
+ */
+unsigned char* start_clay_variable(clay_encoder* encoder, size_t name_length,
+        size_t value_length) {
+    if(name_length > MAX_CLAY_VARIABLE_NAME
+            || value_length > MAX_CLAY_VARIABLE_VALUE
+            || encoder->variable_count == MAX_CLAY_VARIABLES) {
+        encoder->failed = 1;
+        return NULL;
+    }
+    unsigned char* variable = extend_clay_encoder(encoder,
+            1 + name_length + 2 + value_length);
+    if(variable == NULL) {
+        return NULL;
+    }
+    encoder->variable_count++;
+    variable[0] = name_length;
+    put_clay_integer(variable + 1 + name_length, value_length, 2);
+    return variable + 1;
+}
+
+void add_clay_variable(clay_encoder* encoder, const char* name,
+        const char* value, size_t value_length) {
+    size_t name_length = strlen(name);
+    unsigned char* variable = start_clay_variable(encoder, name_length,
+            value_length);
+    if(variable != NULL) {
+        memcpy(variable, name, name_length);
+        memcpy(variable + name_length + 2, value, value_length);
+    }
+}
+
+void add_clay_header(clay_encoder* encoder, const char* name,
+        const char* value) {
+    size_t name_length = strlen(name);
+    size_t value_length = strlen(value);
+    unsigned char* variable = start_clay_variable(encoder, name_length + 5,
+            value_length);
+    if(variable != NULL) {
+        memcpy(variable, "HTTP_", 5);
+        for(size_t i = 0; i < name_length; i++) {
+            variable[5 + i] = name[i] == '-' ? '_' : toupper(name[i]);
+        }
+        memcpy(variable + 5 + name_length + 2, value, value_length);
+    }
+}
+
+int finish_clay_request(clay_encoder* encoder, const char* body,
+        size_t body_length) {
+    unsigned char* end = extend_clay_encoder(encoder, 4 + body_length);
+    if(end == NULL) {
+        free(encoder->data);
+        encoder->data = NULL;
+        return -1;
+    }
+    put_clay_integer(end, body_length, 4);
+    if(body_length > 0) {
+        memcpy(end + 4, body, body_length);
+    }
+    put_clay_integer((unsigned char*) encoder->data
+            + CLAY_REQUEST_COUNT_OFFSET, encoder->variable_count, 2);
+    return 0;
+}
+
+int decode_clay_request(const void* data, size_t length,
+        clay_message* message) {
+    const unsigned char* buf = data;
+    if(length < CLAY_REQUEST_COUNT_OFFSET + 2 || buf[0] != CLAY_WIRE_VERSION
+            || buf[1] != CLAY_MESSAGE_REQUEST) {
+        return -1;
+    }
+    message->id = get_clay_integer(buf + 2, 8);
+    message->variable_count = get_clay_integer(
+            buf + CLAY_REQUEST_COUNT_OFFSET, 2);
+    if(message->variable_count > MAX_CLAY_VARIABLES) {
+        return -1;
+    }
+
+    size_t offset = CLAY_REQUEST_COUNT_OFFSET + 2;
+    for(unsigned int i = 0; i < message->variable_count; i++) {
+        clay_variable* variable = &message->variables[i];
+        if(offset + 1 > length) {
+            return -1;
+        }
+        variable->name_length = buf[offset++];
+        variable->name = (const char*) buf + offset;
+        offset += variable->name_length;
+        if(offset + 2 > length) {
+            return -1;
+        }
+        variable->value_length = get_clay_integer(buf + offset, 2);
+        offset += 2;
+        variable->value = (const char*) buf + offset;
+        offset += variable->value_length;
+    }
+
+    if(offset + 4 > length) {
+        return -1;
+    }
+    message->body_length = get_clay_integer(buf + offset, 4);
+    message->body = (const char*) buf + offset + 4;
+    return offset + 4 + message->body_length == length ? 0 : -1;
+}
+
+const char* find_clay_variable(clay_message* message, const char* name,
+        size_t* length) {
+    size_t name_length = strlen(name);
+    for(unsigned int i = 0; i < message->variable_count; i++) {
+        clay_variable* variable = &message->variables[i];
+        if(variable->name_length == name_length
+                && !memcmp(variable->name, name, name_length)) {
+            *length = variable->value_length;
+            return variable->value;
+        }
+    }
+    return NULL;
+}
+
+void encode_clay_response_header(void* buf, uint64_t id, int flags) {
+    unsigned char* header = buf;
+    header[0] = CLAY_WIRE_VERSION;
+    header[1] = CLAY_MESSAGE_RESPONSE;
+    header[2] = flags;
+    put_clay_integer(header + 3, id, 8);
+}
+
+int decode_clay_response_header(const void* data, size_t length,
+        uint64_t* id, int* flags) {
+    const unsigned char* header = data;
+    if(length != CLAY_RESPONSE_HEADER_LENGTH
+            || header[0] != CLAY_WIRE_VERSION
+            || header[1] != CLAY_MESSAGE_RESPONSE) {
+        return -1;
+    }
+    *flags = header[2];
+    *id = get_clay_integer(header + 3, 8);
+    return 0;
+}
@@ -0,0 +1,127 @@
+#ifndef _CLAYWIRE_H_
+#define _CLAYWIRE_H_
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * claywire.h/.c, encoding of the messages Spade and Clay backends send
+ * each other, kept simple enough to implement in any language (see
+ * tests/clay/claywire.py). Integers are unsigned and big-endian.
+ *
+ * A request is one message:
+ *
+ *   u8 version, u8 type (CLAY_MESSAGE_REQUEST), u64 request id,
+ *   u16 variable count, then for each variable:
+ *     u8 name length, name, u16 value length, value
+ *   u32 body length, body
+ *
+ * The variables are the CGI ones, such as QUERY_STRING, with the request's
+ * headers as HTTP_ followed by the header's name in upper case with '-'
+ * as '_', and the route's parameters as PATH_PARAMETERS. Names and values
+ * aren't NUL terminated.
+ *
+ * Each chunk of a response starts with a header part of
+ * CLAY_RESPONSE_HEADER_LENGTH bytes:
+ *
+ *   u8 version, u8 type (CLAY_MESSAGE_RESPONSE), u8 flags, u64 request id
+ *
+ * A receiver drops messages of a version it doesn't know.
+ */
+
+#define CLAY_WIRE_VERSION 1
+
+#define CLAY_MESSAGE_REQUEST 1
+#define CLAY_MESSAGE_RESPONSE 2
+
+/* Flags of a response chunk */
+#define CLAY_RESPONSE_END 1 /* The last chunk of the response */
+
+#define CLAY_RESPONSE_HEADER_LENGTH 11
+#define MAX_CLAY_VARIABLES 128
+#define MAX_CLAY_VARIABLE_NAME 255
+#define MAX_CLAY_VARIABLE_VALUE 65535
+
+typedef struct {
+    const char* name;
+    size_t name_length;
+    const char* value;
+    size_t value_length;
+} clay_variable;
+
+/* A decoded request, pointing into the message it came from */
+typedef struct {
+    uint64_t id;
+    unsigned int variable_count;
+    clay_variable variables[MAX_CLAY_VARIABLES];
+    const char* body;
+    size_t body_length;
+} clay_message;
+
+/* A request being encoded into a growing buffer */
+typedef struct {
+    char* data;       /* malloced, and the caller's once finished */
+    size_t length;
+    size_t capacity;
+    unsigned int variable_count;
+    int failed;       /* Set if memory ran out or a variable was too long */
+} clay_encoder;
+
+/* Start encoding a request with the given id.
+ *
+ * Returns 0 if successful, or -1 if out of memory.
+ */
+int begin_clay_request(clay_encoder* encoder, uint64_t id);
+
+/* Add a variable with a NUL terminated name. Errors are held until
+ * finish_clay_request.
+ */
+void add_clay_variable(clay_encoder* encoder, const char* name,
+        const char* value, size_t value_length);
+
+/* Add a request header as an HTTP_ variable. */
+void add_clay_header(clay_encoder* encoder, const char* name,
+        const char* value);
+
+/* Add the body and fill in the variable count.
+ *
+ * Returns 0 with the message in encoder->data and encoder->length, or -1
+ * if anything failed, in which case the buffer has been freed.
+ */
+int finish_clay_request(clay_encoder* encoder, const char* body,
+        size_t body_length);
+
+/* Decode a request message of length bytes.
+ *
+ * Modifies message.
+ * Returns 0 if successful, or -1 if it's malformed, of another version or
+ * has more than MAX_CLAY_VARIABLES variables.
+ */
+int decode_clay_request(const void* data, size_t length,
+        clay_message* message);
+
+/* Returns the value of the named variable in a decoded request, with its
+ * length in *length, or NULL if it has none.
+ */
+const char* find_clay_variable(clay_message* message, const char* name,
+        size_t* length);
+
+/* Write the header part of a response chunk to buf, which holds
+ * CLAY_RESPONSE_HEADER_LENGTH bytes.
+ */
+void encode_clay_response_header(void* buf, uint64_t id, int flags);
+
+/* Decode the header part of a response chunk.
+ *
+ * Modifies id, flags.
+ * Returns 0 if successful, or -1 if it's malformed or of another version.
+ */
+int decode_clay_response_header(const void* data, size_t length,
+        uint64_t* id, int* flags);
+
+#endif // _CLAYWIRE_H_
@@ -0,0 +1,62 @@
+#include "compress.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+
+ssize_t gzip_buffer(char* data, size_t length, char** output) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    /* 16 more window bits asks for a gzip wrapper rather than zlib's */
+    if(deflateInit2(&stream, GZIP_COMPRESSION_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+
+    size_t bound = deflateBound(&stream, length);
+    *output = malloc(bound);
+    if(*output == NULL) {
+        deflateEnd(&stream);
+        return -1;
+    }
+    stream.next_in = (unsigned char*) data;
+    stream.avail_in = length;
+    stream.next_out = (unsigned char*) *output;
+    stream.avail_out = bound;
+    int result = deflate(&stream, Z_FINISH);
+    size_t compressed_length = stream.total_out;
+    deflateEnd(&stream);
+    if(result != Z_STREAM_END) {
+        free(*output);
+        *output = NULL;
+        return -1;
+    }
+    return compressed_length;
+}
+
+ssize_t brotli_buffer(char* data, size_t length, char** output) {
+    size_t compressed_length = BrotliEncoderMaxCompressedSize(length);
+    *output = malloc(compressed_length ? compressed_length : 1);
+    if(*output == NULL) {
+        return -1;
+    }
+    if(!BrotliEncoderCompress(BROTLI_COMPRESSION_QUALITY,
+                BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, length,
+                (uint8_t*) data, &compressed_length, (uint8_t*) *output)) {
+        free(*output);
+        *output = NULL;
+        return -1;
+    }
+    return compressed_length;
+}
+
+ssize_t compress_buffer(content_encoding encoding, char* data, size_t length,
+        char** output) {
+    if(encoding == CONTENT_ENCODING_GZIP) {
+        return gzip_buffer(data, length, output);
+    } else if(encoding == CONTENT_ENCODING_BROTLI) {
+        return brotli_buffer(data, length, output);
+    }
+    return -1;
+}
@@ -0,0 +1,24 @@
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include <sys/types.h>
+
+#include "http.h"
+
+/**
+ * compress.h/.c, gzip and brotli compression of in-memory buffers.
+ */
+
+#define GZIP_COMPRESSION_LEVEL 9
+#define BROTLI_COMPRESSION_QUALITY 9
+
+/* Compress length bytes of data with a content coding.
+ *
+ * Modifies *output to a malloc'd buffer holding the compressed bytes, which
+ * the caller must free.
+ * Returns the length of the compressed bytes, or -1 on error.
+ */
+ssize_t compress_buffer(content_encoding encoding, char* data, size_t length,
+        char** output);
+
+#endif // _COMPRESS_H_
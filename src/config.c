@@ -4,15 +4,23 @@ void configure_hostname(spade_server* server, config_t* configuration);
 void configure_port(spade_server* server, unsigned int override_port,
         config_t* configuration);
 void configure_static_file_path(spade_server* server, config_t* configuration);
+void configure_static_cache(spade_server* server, config_t* configuration);
 void configure_dynamic_file_paths(spade_server* server,
         config_t* configuration);
 void configure_cgi_file_path(spade_server* server, config_t* configuration);
 void configure_dirt_file_path(spade_server* server, config_t* configuration);
 void configure_dynamic_handlers(spade_server* server, config_t* configuration);
 void configure_cgi_handlers(spade_server* server, config_t* configuration);
+void configure_cgi_workers(spade_server* server, config_t* configuration);
 void configure_dirt_handlers(spade_server* server, config_t* configuration);
 void configure_clay_handlers(spade_server* server, config_t* configuration);
 void configure_reverse_lookups(spade_server* server, config_t* configuration);
+void configure_concurrency_model(spade_server* server,
+        config_t* configuration);
+void configure_worker_pool(spade_server* server, config_t* configuration);
+void configure_stats_interval(spade_server* server, config_t* configuration);
+void configure_listeners(spade_server* server, config_t* configuration);
+void configure_keep_alive(spade_server* server, config_t* configuration);
 
 int configure_server(spade_server* server, char* configuration_path,
         unsigned int override_port) {
@@ -33,7 +41,13 @@ int configure_server(spade_server* server, char* configuration_path,
     configure_hostname(server, configuration);
     configure_port(server, override_port, configuration);
     configure_reverse_lookups(server, configuration);
+    configure_concurrency_model(server, configuration);
+    configure_worker_pool(server, configuration);
+    configure_stats_interval(server, configuration);
+    configure_listeners(server, configuration);
+    configure_keep_alive(server, configuration);
     configure_static_file_path(server, configuration);
+    configure_static_cache(server, configuration);
     configure_dynamic_file_paths(server, configuration);
     configure_dynamic_handlers(server, configuration);
 
@@ -130,7 +144,32 @@ void configure_dynamic_handlers(spade_server* server, config_t* configuration) {
     configure_clay_handlers(server, configuration);
 }
 
+void configure_cgi_workers(spade_server* server, config_t* configuration) {
+    long int workers = 0;
+    config_lookup_int(configuration, "cgi.workers", &workers);
+    server->cgi_workers = workers > 0 ? workers : 0;
+
+    long int spawn_rate = DEFAULT_CGI_WORKER_SPAWN_RATE;
+    config_lookup_int(configuration, "cgi.worker_spawn_rate", &spawn_rate);
+    server->cgi_worker_spawn_rate = spawn_rate > 0 ? spawn_rate : 1;
+
+    long int max_requests = 0;
+    config_lookup_int(configuration, "cgi.worker_max_requests",
+            &max_requests);
+    server->cgi_worker_max_requests = max_requests > 0 ? max_requests : 0;
+
+    if(server->cgi_workers > 0) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+                "Running CGI programs in %u workers per handler, started at "
+                "most %u a second and replaced after %u requests (0 for "
+                "never)", server->cgi_workers, server->cgi_worker_spawn_rate,
+                server->cgi_worker_max_requests);
+    }
+}
+
 void configure_cgi_handlers(spade_server* server, config_t* configuration) {
+    configure_cgi_workers(server, configuration);
+
     config_setting_t* handler_settings = config_lookup(configuration,
             "cgi.handlers");
     int cgi_handler_count = config_setting_length(handler_settings);
@@ -146,7 +185,7 @@ void configure_cgi_handlers(spade_server* server, config_t* configuration) {
 
         if(!register_cgi_handler(server, url, handler)) {
             log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
-                    "Registered CGI handler '%s' for URL prefix '%s'",
+                    "Registered CGI handler '%s' for URL pattern '%s'",
                     handler, url);
         }
     }
@@ -161,6 +200,14 @@ void configure_cgi_handlers(spade_server* server, config_t* configuration) {
 }
 
 void configure_dirt_handlers(spade_server* server, config_t* configuration) {
+    long int reload = 0;
+    config_lookup_int(configuration, "dirt.reload", &reload);
+    server->dirt_reload = reload != 0;
+    if(server->dirt_reload) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+                "Reloading Dirt libraries when they change");
+    }
+
     config_setting_t* handler_settings = config_lookup(configuration,
             "dirt.handlers");
     if (!handler_settings) {
@@ -184,7 +231,7 @@ void configure_dirt_handlers(spade_server* server, config_t* configuration) {
 
         if(!register_dirt_handler(server, url, handler, library)) {
             log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
-                    "Registered Dirt handler '%s' for URL prefix '%s'",
+                    "Registered Dirt handler '%s' for URL pattern '%s'",
                     handler, url);
         }
     }
@@ -219,7 +266,7 @@ void configure_clay_handlers(spade_server* server, config_t* configuration) {
 
         if(!register_clay_handler(server, url, endpoint)) {
             log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
-                    "Registered Clay handler for URL prefix '%s' at endpoint %s",
+                    "Registered Clay handler for URL pattern '%s' at endpoint %s",
                     url, endpoint);
         }
     }
@@ -250,3 +297,133 @@ void configure_reverse_lookups(spade_server* server, config_t* configuration) {
                 "Will not perform reverse lookups for client hostnames");
     }
 }
+
+void configure_concurrency_model(spade_server* server,
+        config_t* configuration) {
+    const char* model = NULL;
+    server->concurrency_model = CONCURRENCY_MODEL_THREAD;
+    if(config_lookup_string(configuration, "concurrency_model", &model)) {
+        if(!strcmp(model, "epoll")) {
+            server->concurrency_model = CONCURRENCY_MODEL_EPOLL;
+        } else if(!strcmp(model, "pool")) {
+            server->concurrency_model = CONCURRENCY_MODEL_POOL;
+        } else if(!strcmp(model, "io_uring")) {
+            server->concurrency_model = CONCURRENCY_MODEL_URING;
+        } else if(strcmp(model, "thread")) {
+            log4c_category_log(log4c_category_get("spade"),
+                    LOG4C_PRIORITY_WARN,
+                    "Unknown concurrency model '%s', using 'thread'", model);
+            model = "thread";
+        }
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+                "Using concurrency model '%s' from configuration file",
+                model);
+    } else {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+                "Using default concurrency model 'thread'");
+    }
+}
+
+void configure_worker_pool(spade_server* server, config_t* configuration) {
+    long int threads = DEFAULT_WORKER_THREADS;
+    long int queue_length = DEFAULT_WORKER_QUEUE_LENGTH;
+    config_lookup_int(configuration, "workers.threads", &threads);
+    config_lookup_int(configuration, "workers.queue_length", &queue_length);
+    server->worker_threads = threads > 0 ? threads : DEFAULT_WORKER_THREADS;
+    server->worker_queue_length = queue_length > 0 ? queue_length
+            : DEFAULT_WORKER_QUEUE_LENGTH;
+    server->pool = NULL;
+
+    if(server->concurrency_model == CONCURRENCY_MODEL_POOL) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+                "Using %d worker threads with a queue length of %d",
+                server->worker_threads, server->worker_queue_length);
+    }
+}
+
+void configure_stats_interval(spade_server* server, config_t* configuration) {
+    long int stats_interval = 0;
+    config_lookup_int(configuration, "stats_interval", &stats_interval);
+    server->stats_interval = stats_interval > 0 ? stats_interval : 0;
+
+    if(server->stats_interval) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+                "Logging server stats every %d seconds",
+                server->stats_interval);
+    }
+}
+
+void configure_listeners(spade_server* server, config_t* configuration) {
+    long int listeners = 1;
+    config_lookup_int(configuration, "listeners", &listeners);
+    if(listeners == 0) {
+        listeners = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    server->listener_count = MAX(1, MIN(listeners, MAX_LISTENERS));
+
+    if(server->listener_count > 1) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+                "Using %d SO_REUSEPORT listeners with their own accept loops",
+                server->listener_count);
+    }
+}
+
+void configure_keep_alive(spade_server* server, config_t* configuration) {
+    long int timeout = DEFAULT_KEEP_ALIVE_TIMEOUT;
+    long int max_requests = DEFAULT_KEEP_ALIVE_MAX_REQUESTS;
+    config_lookup_int(configuration, "keep_alive.timeout", &timeout);
+    config_lookup_int(configuration, "keep_alive.max_requests",
+            &max_requests);
+    server->keep_alive_timeout = timeout > 0 ? timeout : 0;
+    /* Clients that never send a request are dropped even without
+     * keep-alive
+     */
+    server->idle_timeout = server->keep_alive_timeout
+        ? server->keep_alive_timeout : DEFAULT_KEEP_ALIVE_TIMEOUT;
+    server->keep_alive_max_requests = max_requests > 0 ? max_requests : 1;
+
+    if(server->keep_alive_timeout) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+                "Keeping connections alive for %d idle seconds and up to %d "
+                "requests", server->keep_alive_timeout,
+                server->keep_alive_max_requests);
+    } else {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+                "Closing connections after every request");
+    }
+}
+
+void configure_static_cache(spade_server* server, config_t* configuration) {
+    long int cache_size = DEFAULT_CACHE_SIZE;
+    long int max_file_size = DEFAULT_CACHE_MAX_FILE_SIZE;
+    config_lookup_int(configuration, "static.cache_size", &cache_size);
+    config_lookup_int(configuration, "static.cache_max_file_size",
+            &max_file_size);
+    server->cache_size = cache_size > 0 ? cache_size : 0;
+    server->cache_max_file_size = max_file_size > 0 ? max_file_size : 0;
+    server->cache = NULL;
+
+    long int precompressed = 0;
+    long int compress = 0;
+    config_lookup_int(configuration, "static.precompressed", &precompressed);
+    config_lookup_int(configuration, "static.compress", &compress);
+    server->precompressed = precompressed != 0;
+    server->compress = compress != 0 && server->cache_size > 0;
+
+    if(server->cache_size) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+                "Caching up to %zu bytes of static files no larger than %zu "
+                "bytes", server->cache_size, server->cache_max_file_size);
+    } else {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+                "Static file cache is disabled");
+    }
+    if(server->precompressed) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+                "Sending precompressed .br and .gz static files");
+    }
+    if(server->compress) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+                "Compressing cached text files");
+    }
+}
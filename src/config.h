@@ -4,12 +4,16 @@
 #include <libconfig.h>
 
 #include "server.h"
+#include "pool.h"
+#include "cgipool.h"
 
 #define DEFAULT_PORT 8080
 #define DEFAULT_STATIC_FILE_PATH "static"
 #define DEFAULT_CGI_FILE_PATH "static"
 #define DEFAULT_DIRT_FILE_PATH "static"
 #define DEFAULT_HOSTNAME "spade"
+#define DEFAULT_KEEP_ALIVE_TIMEOUT 5
+#define DEFAULT_KEEP_ALIVE_MAX_REQUESTS 100
 
 int configure_server(spade_server* server, char* configuration_path,
         unsigned int override_port);
@@ -0,0 +1,533 @@
+#include "connection.h"
+#include "server.h"
+
+void initialize_connection(spade_connection* connection,
+        spade_server* server, int socket,
+        struct sockaddr_in* client_address) {
+    connection->server = server;
+    connection->socket = socket;
+    connection->client_address = *client_address;
+    connection->state = CONNECTION_READING;
+    rio_readinitb(&connection->rio, socket);
+    init_http_parser(&connection->parser, &connection->request);
+    connection->output_length = 0;
+    connection->response_count = 0;
+    connection->sent = 0;
+    connection->deferred = NULL;
+    connection->send_files = 1;
+    connection->corked = 0;
+    connection->keep_alive = 0;
+    connection->requests_served = 0;
+    connection->idle_since = 0;
+    connection->idle_previous = NULL;
+    connection->idle_next = NULL;
+}
+
+spade_connection* create_connection(spade_server* server, int socket,
+        struct sockaddr_in* client_address) {
+    spade_connection* connection = malloc(sizeof(spade_connection));
+    if(connection == NULL) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Unable to malloc space for a connection: %s",
+                strerror(errno));
+        return NULL;
+    }
+    initialize_connection(connection, server, socket, client_address);
+    return connection;
+}
+
+/* Release, close or unmap the static file bodies of the queued responses
+ * and empty the queue.
+ */
+void release_connection_responses(spade_connection* connection) {
+    for(unsigned int i = 0; i < connection->response_count; i++) {
+        queued_response* response = &connection->responses[i];
+        if(response->cached) {
+            cache_release(connection->server->cache, response->cached);
+        } else if(response->body) {
+            munmap(response->body, response->offset + response->body_length);
+        }
+        if(response->file >= 0) {
+            close(response->file);
+        }
+    }
+    if(connection->corked) {
+        set_cork(connection->socket, 0);
+        connection->corked = 0;
+    }
+    connection->response_count = 0;
+    connection->output_length = 0;
+    connection->sent = 0;
+}
+
+void close_connection(spade_connection* connection) {
+    log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_TRACE,
+            "closing socket %d", connection->socket);
+    release_connection_responses(connection);
+    free(connection->deferred);
+    connection->deferred = NULL;
+    close(connection->socket);
+    connection->state = CONNECTION_CLOSED;
+}
+
+void free_connection(spade_connection* connection) {
+    close_connection(connection);
+    free(connection);
+}
+
+/* Helper function for threads serving a detached dynamic request. The
+ * handler writes to the socket with blocking I/O, so it's switched back to
+ * blocking mode first. If the response, such as a version 2 Dirt handler's
+ * with its Content-Length, leaves the connection open, the thread goes on
+ * serving it the way the thread model would, starting with whatever the
+ * client pipelined after the request.
+ */
+void* detached_request_helper(void* args) {
+    signal(SIGPIPE, SIG_IGN);
+    detached_request* detached = (detached_request*) args;
+    spade_connection* connection = detached->connection;
+
+    set_nonblocking(connection->socket, 0);
+    if(!handle_get(connection->server, connection->socket,
+                detached->request)) {
+        /* The Clay response thread owns the socket now */
+        free(connection);
+    } else if(detached->request->keep_alive) {
+        serve_connection_requests(connection->server, &connection->rio,
+                &connection->client_address, connection->requests_served);
+        free(connection);
+    } else {
+        free_connection(connection);
+    }
+    free(detached->request);
+    free(detached);
+    return 0;
+}
+
+void detach_connection(spade_connection* connection) {
+    detached_request* detached = malloc(sizeof(detached_request));
+    if(detached == NULL) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Unable to malloc space for a detached request: %s",
+                strerror(errno));
+        free_connection(connection);
+        return;
+    }
+    detached->connection = connection;
+    detached->request = connection->deferred;
+    connection->deferred = NULL;
+
+    pthread_t thread;
+    if(pthread_create(&thread, &connection->server->thread_attr,
+                detached_request_helper, detached)) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Unable to create a thread for a dynamic request");
+        free(detached->request);
+        free(detached);
+        free_connection(connection);
+    }
+}
+
+int connection_read(spade_connection* connection) {
+    rio_t* rio = &connection->rio;
+    /* Slide any unparsed bytes to the front to make room for more */
+    if(rio->rio_bufptr != rio->rio_buf) {
+        memmove(rio->rio_buf, rio->rio_bufptr, rio->rio_cnt);
+        rio->rio_bufptr = rio->rio_buf;
+    }
+
+    while(1) {
+        if(rio->rio_cnt == RIO_BUFSIZE) {
+            if(!connection_has_request(connection)) {
+                log4c_category_log(log4c_category_get("spade"),
+                        LOG4C_PRIORITY_WARN,
+                        "Request headers on socket %d longer than %d bytes",
+                        connection->socket, RIO_BUFSIZE);
+                return -1;
+            }
+            return 0;
+        }
+
+        ssize_t bytes_read = read(connection->socket,
+                rio->rio_buf + rio->rio_cnt, RIO_BUFSIZE - rio->rio_cnt);
+        if(bytes_read > 0) {
+            rio->rio_cnt += bytes_read;
+        } else if(bytes_read == 0) {
+            return -1;
+        } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else if(errno != EINTR) {
+            check_error(bytes_read, "connection_read");
+            return -1;
+        }
+    }
+}
+
+int connection_has_request(spade_connection* connection) {
+    rio_t* rio = &connection->rio;
+    return parse_http_request(&connection->parser, &connection->request,
+            rio->rio_bufptr, rio->rio_cnt);
+}
+
+/* Add a response to the back of the queue. Its headers, and any body small
+ * enough to be copied, must already be at the end of the output buffer. The
+ * queue takes ownership of a mapped body or file.
+ *
+ * Returns the queued response.
+ */
+queued_response* queue_response(spade_connection* connection,
+        size_t output_length, char* body, int file, size_t body_length) {
+    queued_response* response =
+        &connection->responses[connection->response_count++];
+    response->output_length = output_length;
+    response->body = body;
+    response->file = file;
+    response->offset = 0;
+    response->body_length = body_length;
+    response->cached = NULL;
+    if(file >= 0 && !connection->corked) {
+        /* Hold back the headers so they share a packet with the body */
+        connection->corked = set_cork(connection->socket, 1) == 0;
+    }
+    connection->output_length += output_length;
+    connection->state = CONNECTION_WRITING;
+    return response;
+}
+
+void connection_client_error(spade_connection* connection, char* cause,
+        char* status_code, char* short_message, char* long_message) {
+    char body[MAXBUF];
+    build_client_error_body(body, cause, status_code, short_message,
+            long_message);
+    size_t body_length = strlen(body);
+    char* output = connection->output + connection->output_length;
+    size_t room = MAXBUF - connection->output_length;
+
+    connection->keep_alive = 0;
+    size_t header_length = format_response_headers(output, status_code,
+            short_message, "text/html", body_length, 0, 1);
+    memcpy(output + header_length, body,
+            MIN(body_length, room - header_length));
+    queue_response(connection, MIN(header_length + body_length, room), NULL,
+            -1, 0);
+}
+
+/* Queue headers already at the end of the output buffer followed by one
+ * range of a static file's body, either from the static cache, sent
+ * straight from the open file or memory mapped. The queue takes over the
+ * caller's reference to entry, or the file descriptor. A NULL range means
+ * an empty body.
+ *
+ * Returns 0 if successful, or -1 if the range couldn't be mapped.
+ */
+int queue_static_range(spade_connection* connection, size_t header_length,
+        cache_entry* entry, int file, byte_range* range) {
+    size_t length = range ? range->last - range->first + 1 : 0;
+    if(entry) {
+        queued_response* response = queue_response(connection,
+                header_length, entry->data, -1, length);
+        response->offset = range ? range->first : 0;
+        response->cached = entry;
+        return 0;
+    }
+
+    if(length == 0) {
+        close(file);
+        queue_response(connection, header_length, NULL, -1, 0);
+        return 0;
+    } else if(connection->send_files) {
+        queue_response(connection, header_length, NULL, file,
+                length)->offset = range->first;
+        return 0;
+    }
+
+    /* A mapping has to start on a page boundary */
+    size_t page_offset = range->first % sysconf(_SC_PAGESIZE);
+    char* body = mmap(0, page_offset + length, PROT_READ, MAP_PRIVATE, file,
+            range->first - page_offset);
+    close(file);
+    if(body == MAP_FAILED) {
+        return -1;
+    }
+    queue_response(connection, header_length, body, -1, length)->offset =
+        page_offset;
+    return 0;
+}
+
+/* Queue a 206 response for ranges of a static file, one queued response per
+ * range. The queue takes over the caller's reference to entry, or the file
+ * descriptor.
+ */
+void queue_static_ranges(spade_connection* connection, static_file* file,
+        cache_entry* entry, int file_descriptor, size_t length,
+        byte_range* ranges, int range_count) {
+    char* output = connection->output + connection->output_length;
+    size_t header_length = format_partial_response_headers(output, file,
+            length, ranges, range_count, connection->keep_alive);
+    for(int i = 0; i < range_count; i++) {
+        if(range_count > 1) {
+            header_length += format_part_header(output + header_length, file,
+                    length, &ranges[i]);
+        }
+        /* Every range but the last gets its own reference or descriptor */
+        int last = i + 1 == range_count;
+        if(entry && !last) {
+            cache_retain(connection->server->cache, entry);
+        }
+        int descriptor = entry || last ? file_descriptor
+            : dup(file_descriptor);
+        if((entry == NULL && descriptor < 0)
+                || queue_static_range(connection, header_length, entry,
+                    descriptor, &ranges[i])) {
+            if(i == 0) {
+                connection_client_error(connection, strerror(errno), "500",
+                        "Internal Server Error", "Spade crashed and burned.");
+            } else {
+                /* Part of the body is already queued, so all that can be
+                 * done is to cut the response short.
+                 */
+                connection->keep_alive = 0;
+            }
+            if(!last && file_descriptor >= 0) {
+                close(file_descriptor);
+            }
+            return;
+        }
+        output = connection->output + connection->output_length;
+        header_length = 0;
+    }
+
+    if(range_count > 1) {
+        memcpy(output, BYTERANGES_END, strlen(BYTERANGES_END));
+        queue_response(connection, strlen(BYTERANGES_END), NULL, -1, 0);
+    }
+}
+
+void connection_respond_static(spade_connection* connection,
+        http_request* request) {
+    static_file file;
+    int status = resolve_static_file(connection->server, request, &file);
+    if(status == 404) {
+        connection_client_error(connection,
+                http_request_string(request, request->uri.path), "404",
+                "Not found", "Spade couldn't find this file");
+        return;
+    } else if(status == 403) {
+        connection_client_error(connection,
+                http_request_string(request, request->uri.path), "403",
+                "Forbidden", "Spade couldn't read the file");
+        return;
+    }
+
+    char* output = connection->output + connection->output_length;
+    cache_entry* entry;
+    if(prepare_static_file(connection->server, request, &file, 1, &entry)) {
+        queue_response(connection, format_not_modified_response_headers(
+                    output, &file, connection->keep_alive), NULL, -1, 0);
+        return;
+    }
+
+    int file_descriptor = -1;
+    if(entry == NULL) {
+        file_descriptor = open(file.path, O_RDONLY, 0);
+        if(check_error(file_descriptor, "connection_respond_static")) {
+            connection_client_error(connection, strerror(errno), "500",
+                    "Internal Server Error", "Spade crashed and burned.");
+            return;
+        }
+    }
+
+    size_t length = entry ? entry->length : (size_t) file.sbuf.st_size;
+    byte_range ranges[MAX_BYTE_RANGES];
+    int range_count = find_static_ranges(request, &file, length, ranges);
+    if(range_count > 1 && MAXBUF - connection->output_length
+            < MAX_RESPONSE_HEADER_LENGTH + strlen(BYTERANGES_END)
+                + range_count * MAX_PART_HEADER_LENGTH) {
+        /* No room for the part headers, so send the whole body */
+        range_count = 0;
+    }
+
+    if(range_count > 0) {
+        queue_static_ranges(connection, &file, entry, file_descriptor,
+                length, ranges, range_count);
+        return;
+    }
+
+    size_t header_length;
+    if(range_count < 0) {
+        header_length = format_range_not_satisfiable_headers(output, &file,
+                length, connection->keep_alive);
+        length = 0;
+    } else if(entry) {
+        header_length = format_cached_response_headers(output, entry,
+                connection->keep_alive);
+    } else {
+        header_length = format_static_response_headers(output, &file,
+                length, connection->keep_alive);
+    }
+    byte_range whole = {0, length - 1};
+    if(queue_static_range(connection, header_length, entry, file_descriptor,
+                length ? &whole : NULL)) {
+        connection_client_error(connection, strerror(errno), "500",
+                "Internal Server Error", "Spade crashed and burned.");
+    }
+}
+
+/* Queue the response to one request, or defer it if it's for a dynamic
+ * handler.
+ */
+void connection_respond_request(spade_connection* connection,
+        http_request* request) {
+    request->keep_alive = should_keep_alive(connection->server, request,
+            ++connection->requests_served);
+    connection->keep_alive = request->keep_alive;
+    if(!request->message.valid) {
+        connection_client_error(connection, "", "400", "Bad Request",
+                "Spade couldn't parse the request");
+    } else if(request->method != HTTP_METHOD_GET) {
+        connection_client_error(connection,
+                http_method_to_string(request->method), "501",
+                "Not Implemented", "Spade does not implement this method");
+    } else if(find_route(connection->server, request).type != ROUTE_STATIC) {
+        /* The handler thread takes the connection from here. The rio
+         * buffer will be reused, so take the request's bytes.
+         */
+        connection->deferred = copy_http_request(request);
+        if(connection->deferred == NULL) {
+            connection_client_error(connection, strerror(errno), "500",
+                    "Internal Server Error", "Spade crashed and burned.");
+        }
+    } else {
+        connection_respond_static(connection, request);
+    }
+}
+
+void connection_respond(spade_connection* connection) {
+    while(connection_has_request(connection)
+            && connection->response_count < PIPELINE_DEPTH
+            && MAXBUF - connection->output_length
+                >= MAX_RESPONSE_HEADER_LENGTH) {
+        http_request* request = &connection->request;
+        connection->rio.rio_bufptr += request->length;
+        connection->rio.rio_cnt -= request->length;
+        log_http_request(request);
+        request->remote_host[0] = '\0';
+        request->remote_address[0] = '\0';
+        connection_respond_request(connection, request);
+        init_http_parser(&connection->parser, request);
+        if(connection->deferred || !connection->keep_alive) {
+            break;
+        }
+    }
+
+    if(connection->deferred && connection->response_count == 0) {
+        connection->state = CONNECTION_DETACHED;
+    }
+}
+
+/* Point iovec at what's left of buf once skip bytes have been sent.
+ *
+ * Modifies *skip.
+ * Returns 1 if any of buf is left to send, otherwise 0.
+ */
+int fill_iovec(struct iovec* iovec, char* buf, size_t length, size_t* skip) {
+    if(*skip >= length) {
+        *skip -= length;
+        return 0;
+    }
+    iovec->iov_base = buf + *skip;
+    iovec->iov_len = length - *skip;
+    *skip = 0;
+    return 1;
+}
+
+int connection_pending_iovecs(spade_connection* connection,
+        struct iovec* iovecs) {
+    int count = 0;
+    size_t skip = connection->sent;
+    char* output = connection->output;
+    for(unsigned int i = 0; i < connection->response_count; i++) {
+        queued_response* response = &connection->responses[i];
+        count += fill_iovec(&iovecs[count], output, response->output_length,
+                &skip);
+        output += response->output_length;
+        if(response->file >= 0) {
+            if(skip < response->body_length) {
+                break;
+            }
+            skip -= response->body_length;
+        } else {
+            count += fill_iovec(&iovecs[count],
+                    response->body + response->offset, response->body_length,
+                    &skip);
+        }
+    }
+    return count;
+}
+
+queued_response* connection_pending_file(spade_connection* connection,
+        off_t* offset) {
+    size_t skip = connection->sent;
+    for(unsigned int i = 0; i < connection->response_count; i++) {
+        queued_response* response = &connection->responses[i];
+        if(skip < response->output_length) {
+            return NULL;
+        }
+        skip -= response->output_length;
+        if(skip < response->body_length) {
+            *offset = response->offset + skip;
+            return response->file >= 0 ? response : NULL;
+        }
+        skip -= response->body_length;
+    }
+    return NULL;
+}
+
+int connection_write(spade_connection* connection) {
+    struct iovec iovecs[MAX_RESPONSE_IOVECS];
+    while(1) {
+        ssize_t written;
+        int count = connection_pending_iovecs(connection, iovecs);
+        if(count > 0) {
+            written = writev(connection->socket, iovecs, count);
+        } else {
+            off_t offset;
+            queued_response* response = connection_pending_file(connection,
+                    &offset);
+            if(response == NULL) {
+                return 1;
+            }
+            written = send_file(connection->socket, response->file, &offset,
+                    response->offset + response->body_length - offset);
+            if(written == 0) {
+                /* The file was truncated after it was opened */
+                errno = EIO;
+                written = -1;
+            }
+        }
+
+        if(written > 0) {
+            connection->sent += written;
+        } else if(written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else if(written < 0 && errno == EINTR) {
+            continue;
+        } else {
+            check_error(written, "connection_write");
+            return -1;
+        }
+    }
+}
+
+int connection_finish_response(spade_connection* connection) {
+    release_connection_responses(connection);
+    if(connection->deferred) {
+        connection->state = CONNECTION_DETACHED;
+        return 1;
+    }
+    if(!connection->keep_alive) {
+        return 0;
+    }
+    connection->state = CONNECTION_READING;
+    return 1;
+}
@@ -0,0 +1,170 @@
+#ifndef _CONNECTION_H_
+#define _CONNECTION_H_
+
+#define _GNU_SOURCE
+
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+#include "csapp.h"
+#include "http.h"
+#include "cache.h"
+
+/**
+ * connection.h/.c, per-connection state for the event driven server models.
+ *
+ * A connection moves between reading requests into its rio buffer, writing
+ * the prepared responses from its output buffer and bodies, and being
+ * detached to a thread when a dynamic handler needs to own the socket. A
+ * detached connection stays with its thread until it's closed.
+ *
+ * Every complete request a client has pipelined is answered before anything
+ * is written, and the responses are queued so they go out in order in as
+ * few writes as possible.
+ */
+
+/* Most responses queued on one connection at a time */
+#define PIPELINE_DEPTH 16
+/* Each range of a multipart response is queued on its own, so the last
+ * response may take up more than one place in the queue.
+ */
+#define MAX_QUEUED_RESPONSES (PIPELINE_DEPTH + MAX_BYTE_RANGES)
+/* Space kept free in the output buffer for the next response's headers */
+#define MAX_RESPONSE_HEADER_LENGTH 1024
+/* Each queued response is written from its headers and its body */
+#define MAX_RESPONSE_IOVECS (MAX_QUEUED_RESPONSES * 2)
+
+struct spade_server;
+
+typedef enum {
+    CONNECTION_READING,
+    CONNECTION_WRITING,
+    CONNECTION_DETACHED,
+    CONNECTION_CLOSED
+} connection_state;
+
+/* A response waiting its turn in a connection's queue. A static file body
+ * is sent from the static cache, straight from its file or memory mapped.
+ */
+typedef struct {
+    size_t output_length; /* Bytes of headers and small body in output */
+    char* body;           /* Memory mapped or cached static file, or NULL */
+    int file;             /* Static file to send, or -1 */
+    size_t offset;        /* Where the body starts in body or file */
+    size_t body_length;
+    cache_entry* cached;  /* Cache entry holding body, or NULL */
+} queued_response;
+
+typedef struct spade_connection {
+    struct spade_server* server;
+    int socket;
+    struct sockaddr_in client_address;
+    connection_state state;
+    rio_t rio;
+    http_parser parser;   /* Progress through the request being read */
+    http_request request; /* Refers to the request's bytes in rio */
+    char output[MAXBUF];  /* Headers and small bodies of queued responses */
+    size_t output_length;
+    queued_response responses[MAX_QUEUED_RESPONSES];
+    unsigned int response_count;
+    size_t sent;          /* Bytes of the queued responses already written */
+    http_request* deferred; /* Dynamic request waiting for the queue */
+    int send_files;       /* Send static bodies with sendfile, not mmap */
+    int corked;           /* TCP_CORK is set while a file body is queued */
+    int keep_alive;       /* Read another request after these responses */
+    unsigned int requests_served;
+    time_t idle_since;    /* When the connection last finished a response */
+    struct spade_connection* idle_previous; /* Links in an event loop's */
+    struct spade_connection* idle_next;     /* list of idle connections */
+} spade_connection;
+
+/* Arguments for threads serving a dynamic request detached from an event
+ * loop.
+ */
+typedef struct {
+    spade_connection* connection;
+    http_request* request;
+} detached_request;
+
+/* Reset connection to start reading a request from socket. */
+void initialize_connection(spade_connection* connection,
+        struct spade_server* server, int socket,
+        struct sockaddr_in* client_address);
+
+/* Allocate a connection for an accepted, non-blocking socket.
+ *
+ * Returns the new connection, or NULL if it couldn't be allocated.
+ */
+spade_connection* create_connection(struct spade_server* server, int socket,
+        struct sockaddr_in* client_address);
+
+/* Release any response body and close the socket. */
+void close_connection(spade_connection* connection);
+
+/* Close the connection and free it. */
+void free_connection(spade_connection* connection);
+
+/* Serve the connection's deferred request for a dynamic handler on a new
+ * thread, which takes ownership of the heap allocated connection. The caller
+ * must have stopped watching the socket.
+ */
+void detach_connection(spade_connection* connection);
+
+/* Read everything currently available on the socket into the rio buffer.
+ *
+ * Returns 0 if the socket is still open, or -1 if the client closed it, it
+ * failed or the buffer filled up without a complete request.
+ */
+int connection_read(spade_connection* connection);
+
+/* Parse as much of the next request as the rio buffer holds.
+ *
+ * Returns 1 if connection->request has a complete request line and
+ * headers.
+ */
+int connection_has_request(spade_connection* connection);
+
+/* Queue responses for the complete requests in the rio buffer, moving the
+ * connection to CONNECTION_WRITING. A request for a dynamic handler ends the
+ * queue and is kept as the deferred request; if nothing was queued ahead of
+ * it the connection moves straight to CONNECTION_DETACHED, and the caller
+ * should detach it.
+ */
+void connection_respond(spade_connection* connection);
+
+/* Queue an error page in the connection's output buffer. */
+void connection_client_error(spade_connection* connection, char* cause,
+        char* status_code, char* short_message, char* long_message);
+
+/* Release the queued responses once they have all been sent.
+ *
+ * Returns 1 if the connection has moved back to CONNECTION_READING for more
+ * requests, or to CONNECTION_DETACHED for its deferred request, or 0 if it
+ * should be closed.
+ */
+int connection_finish_response(spade_connection* connection);
+
+/* Fill iovecs with the parts of the queued responses not yet sent, up to
+ * the first body that has to be sent from its file.
+ *
+ * Returns the number of iovecs used, at most MAX_RESPONSE_IOVECS.
+ */
+int connection_pending_iovecs(spade_connection* connection,
+        struct iovec* iovecs);
+
+/* Find the file body at the front of the unsent responses.
+ *
+ * Modifies *offset to where sending should resume in the file.
+ * Returns the response, or NULL if the next part to send isn't a file body.
+ */
+queued_response* connection_pending_file(spade_connection* connection,
+        off_t* offset);
+
+/* Write as much of the queued responses as the socket will take.
+ *
+ * Returns 1 once every response has been sent, 0 if the socket would block
+ * or -1 if the write failed.
+ */
+int connection_write(spade_connection* connection);
+
+#endif // _CONNECTION_H_
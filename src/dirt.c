@@ -1,6 +1,23 @@
 #include "dirt.h"
 #include "server.h"
 
+#include <libgen.h>
+#include <stdarg.h>
+#include <sys/inotify.h>
+
+/* Number of links made to reload libraries through, to keep names unique */
+unsigned int dirt_reload_links;
+
+/* Guards every library's list of thread states */
+pthread_mutex_t dirt_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t dirt_thread_key;
+pthread_once_t dirt_thread_key_once = PTHREAD_ONCE_INIT;
+
+/* Libraries loaded and not yet unloaded, so shutdown can wait for them */
+unsigned int dirt_libraries_loaded;
+pthread_mutex_t dirt_unload_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t dirt_unloaded = PTHREAD_COND_INITIALIZER;
+
 dirt_variables build_dirt_variables(spade_server* server, http_request* request,
         dirt_handler* handler) {
     dirt_variables variables;
@@ -16,7 +33,8 @@ dirt_variables build_dirt_variables(spade_server* server, http_request* request,
     strcpy(variables.request_method, http_method_to_string(request->method));
 
     strcpy(variables.script_name, handler->path);
-    strcpy(variables.query_string, request->uri.query_string);
+    strcpy(variables.query_string,
+            http_request_string(request, request->uri.query_string));
     if(request->remote_host[0] != '\0') {
         strcpy(variables.remote_host, request->remote_host);
     }
@@ -24,3 +42,557 @@ dirt_variables build_dirt_variables(spade_server* server, http_request* request,
 
     return variables;
 }
+
+void build_dirt_request(spade_server* server, http_request* request,
+        dirt_handler* handler, const char* path_parameters,
+        dirt_request* view, dirt_header* headers) {
+    view->method = http_method_to_string(request->method);
+    view->path = http_request_string(request, request->uri.path);
+    view->query_string = http_request_string(request,
+            request->uri.query_string);
+    view->path_parameters = path_parameters;
+    view->script_name = handler->path;
+    view->remote_host = request->remote_host;
+    view->remote_address = request->remote_address;
+    view->server_name = server->hostname;
+    view->server_port = server->port;
+
+    for(unsigned int i = 0; i < request->message.header_count; i++) {
+        headers[i].name = http_request_string(request,
+                request->message.headers[i].key);
+        headers[i].value = http_request_string(request,
+                request->message.headers[i].value);
+    }
+    view->headers = headers;
+    view->header_count = request->message.header_count;
+    view->body = NULL;
+    view->body_length = 0;
+}
+
+int set_dirt_response_status(dirt_response* response,
+        const char* status_code, const char* message) {
+    if(strlen(status_code) != MAX_STATUS_LENGTH
+            || strlen(message) >= MAX_STATUS_MESSAGE_LENGTH
+            || strpbrk(message, "\r\n")) {
+        response->failed = 1;
+        return -1;
+    }
+    strcpy(response->status_code, status_code);
+    strcpy(response->message, message);
+    return 0;
+}
+
+int add_dirt_response_header(dirt_response* response, const char* name,
+        const char* value) {
+    size_t available = MAX_DIRT_RESPONSE_HEADER_LENGTH
+        - response->headers_length;
+    int length = snprintf(response->headers + response->headers_length,
+            available, "%s: %s\r\n", name, value);
+    if(length < 0 || (size_t) length >= available || strpbrk(name, "\r\n:")
+            || strpbrk(value, "\r\n")) {
+        response->headers[response->headers_length] = '\0';
+        response->failed = 1;
+        return -1;
+    }
+    response->headers_length += length;
+    return 0;
+}
+
+/* Make room for at least length more bytes of body.
+ *
+ * Returns 0 if successful, or -1 if out of memory.
+ */
+int reserve_dirt_response_body(dirt_response* response, size_t length) {
+    if(response->body_capacity - response->body_length > length) {
+        return 0;
+    }
+
+    size_t capacity = response->body_capacity;
+    while(capacity - response->body_length <= length) {
+        capacity *= 2;
+    }
+    char* body = response->body == response->inline_body
+        ? malloc(capacity) : realloc(response->body, capacity);
+    if(body == NULL) {
+        response->failed = 1;
+        return -1;
+    }
+    if(response->body == response->inline_body) {
+        memcpy(body, response->inline_body, response->body_length);
+    }
+    response->body = body;
+    response->body_capacity = capacity;
+    return 0;
+}
+
+int write_dirt_response(dirt_response* response, const char* data,
+        size_t length) {
+    if(reserve_dirt_response_body(response, length)) {
+        return -1;
+    }
+    memcpy(response->body + response->body_length, data, length);
+    response->body_length += length;
+    return 0;
+}
+
+int printf_dirt_response(dirt_response* response, const char* format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(response->body + response->body_length,
+            response->body_capacity - response->body_length, format,
+            arguments);
+    va_end(arguments);
+    if(length < 0) {
+        response->failed = 1;
+        return -1;
+    }
+
+    /* Didn't fit, so try again with enough room */
+    if((size_t) length >= response->body_capacity - response->body_length) {
+        if(reserve_dirt_response_body(response, length)) {
+            return -1;
+        }
+        va_start(arguments, format);
+        vsnprintf(response->body + response->body_length,
+                response->body_capacity - response->body_length, format,
+                arguments);
+        va_end(arguments);
+    }
+    response->body_length += length;
+    return 0;
+}
+
+void init_dirt_response(dirt_response* response) {
+    response->set_status = set_dirt_response_status;
+    response->add_header = add_dirt_response_header;
+    response->write = write_dirt_response;
+    response->printf = printf_dirt_response;
+    strcpy(response->status_code, "200");
+    strcpy(response->message, "OK");
+    response->headers[0] = '\0';
+    response->headers_length = 0;
+    response->body = response->inline_body;
+    response->body_length = 0;
+    response->body_capacity = DIRT_RESPONSE_INLINE_LENGTH;
+    response->failed = 0;
+}
+
+void free_dirt_response(dirt_response* response) {
+    if(response->body != response->inline_body) {
+        free(response->body);
+    }
+}
+
+int send_dirt_response(int incoming_socket, dirt_response* response,
+        int keep_alive) {
+    if(response->failed) {
+        return_client_error(incoming_socket, "Dirt handler", "500",
+                "Internal Server Error",
+                "The handler's response couldn't be built");
+        return -1;
+    }
+
+    char headers[MAXLINE + MAX_DIRT_RESPONSE_HEADER_LENGTH];
+    int header_length = format_response_headers(headers,
+            response->status_code, response->message, NULL, 0, keep_alive,
+            0);
+    header_length += sprintf(headers + header_length,
+            "Content-Length: %zu\r\n%s\r\n", response->body_length,
+            response->headers);
+    return write_response(incoming_socket, headers, header_length,
+            response->body, response->body_length);
+}
+
+/* Returns the address of the symbol named function followed by suffix in
+ * the library, or NULL if it doesn't have one.
+ */
+void* find_dirt_symbol(void* library_handle, const char* function,
+        const char* suffix) {
+    char symbol[MAX_DIRT_FUNCTION_LENGTH + MAX_DIRT_SYMBOL_SUFFIX_LENGTH];
+    snprintf(symbol, sizeof(symbol), "%s%s", function, suffix);
+    return dlsym(library_handle, symbol);
+}
+
+/* Load function from the shared library at file_path.
+ *
+ * Returns the library with one reference, or NULL if it couldn't be loaded.
+ */
+dirt_library* load_dirt_library(const char* file_path, const char* function) {
+    dirt_library* library = malloc(sizeof(dirt_library));
+    if(library == NULL) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Unable to allocate the shared library '%s': %s", file_path,
+                strerror(errno));
+        return NULL;
+    }
+
+    library->library_handle = dlopen(file_path, RTLD_NOW);
+    if(!library->library_handle) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Couldn't load the shared library '%s': %s", file_path,
+                dlerror());
+        free(library);
+        return NULL;
+    }
+
+    dlerror();
+    void* symbol = dlsym(library->library_handle, function);
+    char* error;
+    if((error = dlerror()) != NULL || symbol == NULL) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Couldn't find the function '%s' in the shared library "
+                "'%s': %s", function, file_path, error ? error : "NULL");
+        dlclose(library->library_handle);
+        free(library);
+        return NULL;
+    }
+
+    /* Handlers without a version symbol predate it, so they're version 1 */
+    unsigned int* version = find_dirt_symbol(library->library_handle,
+            function, DIRT_VERSION_SYMBOL_SUFFIX);
+    library->version = version ? *version : 1;
+    if(library->version == 1) {
+        library->handler = (dirt_function) symbol;
+    } else if(library->version == 2) {
+        library->handler_v2 = (dirt_function_v2) symbol;
+    } else {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Function '%s' in the shared library '%s' is for unknown "
+                "Dirt version %u", function, file_path, library->version);
+        dlclose(library->library_handle);
+        free(library);
+        return NULL;
+    }
+
+    dirt_init_function init = (dirt_init_function) find_dirt_symbol(
+            library->library_handle, function, DIRT_INIT_SYMBOL_SUFFIX);
+    library->thread_init = (dirt_thread_init_function) find_dirt_symbol(
+            library->library_handle, function,
+            DIRT_THREAD_INIT_SYMBOL_SUFFIX);
+    library->thread_shutdown = (dirt_thread_shutdown_function)
+        find_dirt_symbol(library->library_handle, function,
+                DIRT_THREAD_SHUTDOWN_SYMBOL_SUFFIX);
+    library->shutdown = (dirt_shutdown_function) find_dirt_symbol(
+            library->library_handle, function, DIRT_SHUTDOWN_SYMBOL_SUFFIX);
+    library->context = NULL;
+    library->threads = NULL;
+    if(init && (*init)(&library->context)) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Initializing '%s' in the shared library '%s' failed",
+                function, file_path);
+        dlclose(library->library_handle);
+        free(library);
+        return NULL;
+    }
+    library->references = 1;
+    pthread_mutex_lock(&dirt_unload_lock);
+    dirt_libraries_loaded++;
+    pthread_mutex_unlock(&dirt_unload_lock);
+    return library;
+}
+
+int open_dirt_handler(dirt_handler* handler, const char* library_path,
+        const char* function) {
+    struct stat sbuf;
+    if(strlen(library_path) >= MAX_PATH_LENGTH
+            || strlen(function) >= MAX_DIRT_FUNCTION_LENGTH) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Name of the shared library '%s' or function '%s' is too long",
+                library_path, function);
+        return -1;
+    }
+    if(stat(library_path, &sbuf) < 0) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Couldn't find the shared library '%s'", library_path);
+        return -1;
+    }
+
+    handler->library = load_dirt_library(library_path, function);
+    if(handler->library == NULL) {
+        return -1;
+    }
+    strcpy(handler->library_path, library_path);
+    strcpy(handler->function, function);
+    handler->device = sbuf.st_dev;
+    handler->inode = sbuf.st_ino;
+    handler->modified = sbuf.st_mtime;
+    handler->generation = 0;
+    pthread_mutex_init(&handler->lock, NULL);
+    return 0;
+}
+
+dirt_library* acquire_dirt_library(dirt_handler* handler) {
+    pthread_mutex_lock(&handler->lock);
+    dirt_library* library = handler->library;
+    if(library != NULL) {
+        __atomic_add_fetch(&library->references, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&handler->lock);
+    return library;
+}
+
+/* Free the calling thread's Dirt thread states as it exits, shutting down
+ * those whose libraries are still loaded.
+ */
+void free_dirt_thread_states(void* states) {
+    pthread_mutex_lock(&dirt_thread_lock);
+    dirt_thread_state* state = states;
+    while(state != NULL) {
+        dirt_library* library = state->library;
+        if(library != NULL) {
+            if(library->thread_shutdown) {
+                (*library->thread_shutdown)(library->context,
+                        state->thread_context);
+            }
+            if(state->library_previous) {
+                state->library_previous->library_next = state->library_next;
+            } else {
+                library->threads = state->library_next;
+            }
+            if(state->library_next) {
+                state->library_next->library_previous =
+                    state->library_previous;
+            }
+        }
+        dirt_thread_state* next = state->next;
+        free(state);
+        state = next;
+    }
+    pthread_mutex_unlock(&dirt_thread_lock);
+}
+
+void create_dirt_thread_key() {
+    pthread_key_create(&dirt_thread_key, free_dirt_thread_states);
+}
+
+int get_dirt_thread_context(dirt_library* library, void** thread_context) {
+    *thread_context = NULL;
+    if(library->thread_init == NULL) {
+        return 0;
+    }
+
+    pthread_once(&dirt_thread_key_once, create_dirt_thread_key);
+    dirt_thread_state* states = pthread_getspecific(dirt_thread_key);
+    dirt_thread_state** link = &states;
+    while(*link != NULL) {
+        dirt_thread_state* state = *link;
+        dirt_library* state_library = __atomic_load_n(&state->library,
+                __ATOMIC_ACQUIRE);
+        if(state_library == library) {
+            *thread_context = state->thread_context;
+            return 0;
+        } else if(state_library == NULL) {
+            /* Its library has been unloaded, so nothing else refers to it */
+            *link = state->next;
+            free(state);
+        } else {
+            link = &state->next;
+        }
+    }
+
+    dirt_thread_state* state = malloc(sizeof(dirt_thread_state));
+    if(state == NULL || (*library->thread_init)(library->context,
+                &state->thread_context)) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Initializing a thread for a Dirt handler failed");
+        free(state);
+        pthread_setspecific(dirt_thread_key, states);
+        return -1;
+    }
+
+    pthread_mutex_lock(&dirt_thread_lock);
+    state->library = library;
+    state->library_previous = NULL;
+    state->library_next = library->threads;
+    if(library->threads) {
+        library->threads->library_previous = state;
+    }
+    library->threads = state;
+    pthread_mutex_unlock(&dirt_thread_lock);
+
+    state->next = states;
+    pthread_setspecific(dirt_thread_key, state);
+    *thread_context = state->thread_context;
+    return 0;
+}
+
+void release_dirt_library(dirt_library* library) {
+    if(__atomic_sub_fetch(&library->references, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+
+    /* No requests are running in it, so shut down every thread's state
+     * here. The threads free them the next time they look, or as they exit.
+     */
+    pthread_mutex_lock(&dirt_thread_lock);
+    dirt_thread_state* state = library->threads;
+    while(state != NULL) {
+        if(library->thread_shutdown) {
+            (*library->thread_shutdown)(library->context,
+                    state->thread_context);
+        }
+        /* Once it's marked, its thread may free it at any time */
+        dirt_thread_state* next = state->library_next;
+        __atomic_store_n(&state->library, NULL, __ATOMIC_RELEASE);
+        state = next;
+    }
+    pthread_mutex_unlock(&dirt_thread_lock);
+
+    if(library->shutdown) {
+        (*library->shutdown)(library->context);
+    }
+    dlclose(library->library_handle);
+    free(library);
+
+    pthread_mutex_lock(&dirt_unload_lock);
+    dirt_libraries_loaded--;
+    pthread_cond_broadcast(&dirt_unloaded);
+    pthread_mutex_unlock(&dirt_unload_lock);
+}
+
+int wait_for_dirt_libraries(unsigned int seconds) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += seconds;
+    pthread_mutex_lock(&dirt_unload_lock);
+    while(dirt_libraries_loaded > 0 && pthread_cond_timedwait(
+                &dirt_unloaded, &dirt_unload_lock, &until) == 0);
+    unsigned int remaining = dirt_libraries_loaded;
+    pthread_mutex_unlock(&dirt_unload_lock);
+    return remaining > 0 ? -1 : 0;
+}
+
+void close_dirt_handler(dirt_handler* handler) {
+    pthread_mutex_lock(&handler->lock);
+    dirt_library* library = handler->library;
+    handler->library = NULL;
+    pthread_mutex_unlock(&handler->lock);
+    if(library != NULL) {
+        release_dirt_library(library);
+    }
+}
+
+int reload_dirt_handler(dirt_handler* handler) {
+    struct stat sbuf;
+    if(stat(handler->library_path, &sbuf) < 0) {
+        return 0;
+    }
+    /* The link below would point at the inode already loaded, and dlopen
+     * would hand back the old version, so only a file moved over counts.
+     */
+    if(sbuf.st_dev == handler->device && sbuf.st_ino == handler->inode) {
+        if(sbuf.st_mtime != handler->modified) {
+            handler->modified = sbuf.st_mtime;
+            log4c_category_log(log4c_category_get("spade"),
+                    LOG4C_PRIORITY_WARN, "'%s' was written in place, which "
+                    "can't be reloaded -- move the new version over it "
+                    "instead", handler->library_path);
+        }
+        return 0;
+    }
+
+    /* dlopen hands back the library already loaded from the same path, so
+     * load the new version through a link with a name of its own. The link
+     * can go as soon as it's open.
+     */
+    char link_path[MAX_PATH_LENGTH];
+    if(snprintf(link_path, MAX_PATH_LENGTH, "%s.%d.%u", handler->library_path,
+                getpid(), ++dirt_reload_links) >= MAX_PATH_LENGTH
+            || link(handler->library_path, link_path) < 0) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Couldn't link '%s' to reload it -- keeping the old version: "
+                "%s", handler->library_path, strerror(errno));
+        return -1;
+    }
+    dirt_library* library = load_dirt_library(link_path, handler->function);
+    unlink(link_path);
+    if(library == NULL) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Keeping the old version of '%s'", handler->library_path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&handler->lock);
+    dirt_library* old_library = handler->library;
+    if(old_library == NULL) {
+        /* Closed by shutdown while this version was loading */
+        pthread_mutex_unlock(&handler->lock);
+        release_dirt_library(library);
+        return 0;
+    }
+    handler->library = library;
+    pthread_mutex_unlock(&handler->lock);
+
+    handler->device = sbuf.st_dev;
+    handler->inode = sbuf.st_ino;
+    handler->modified = sbuf.st_mtime;
+    handler->generation++;
+    log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+            "Reloaded Dirt handler '%s' for URL pattern '%s' from '%s', "
+            "version %u", handler->function, handler->path,
+            handler->library_path, handler->generation);
+
+    /* Unloaded now, or when the last request running in it returns */
+    release_dirt_library(old_library);
+    return 1;
+}
+
+/* Helper function for the Dirt watcher thread */
+void* dirt_watcher_helper(void* args) {
+    spade_server* server = (spade_server*) args;
+    char events[4096] __attribute__((aligned(__alignof__(
+                        struct inotify_event))));
+    while(1) {
+        ssize_t length = read(server->dirt_watcher, events, sizeof(events));
+        if(length < 0 && errno != EINTR) {
+            log4c_category_log(log4c_category_get("spade"),
+                    LOG4C_PRIORITY_ERROR,
+                    "Stopped watching Dirt libraries: %s", strerror(errno));
+            return 0;
+        }
+        if(__atomic_load_n(&server->stopping, __ATOMIC_ACQUIRE)) {
+            /* The handlers are being closed, leave them be */
+            close(server->dirt_watcher);
+            return 0;
+        }
+        /* Events only name a file, and checking every handler's is cheap */
+        for(unsigned int i = 0; length > 0 && i < server->dirt_handler_count;
+                i++) {
+            reload_dirt_handler(&server->dirt_handlers[i]);
+        }
+    }
+    return 0;
+}
+
+void start_dirt_watcher(spade_server* server) {
+    if(!server->dirt_reload || server->dirt_handler_count == 0) {
+        return;
+    }
+
+    server->dirt_watcher = inotify_init1(IN_CLOEXEC);
+    if(server->dirt_watcher < 0) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_WARN,
+                "Unable to watch Dirt libraries for changes: %s",
+                strerror(errno));
+        return;
+    }
+    for(unsigned int i = 0; i < server->dirt_handler_count; i++) {
+        /* Only a file moved over the library can be reloaded */
+        char directory[MAX_PATH_LENGTH];
+        strcpy(directory, server->dirt_handlers[i].library_path);
+        if(inotify_add_watch(server->dirt_watcher, dirname(directory),
+                    IN_MOVED_TO) < 0) {
+            log4c_category_log(log4c_category_get("spade"),
+                    LOG4C_PRIORITY_WARN,
+                    "Unable to watch '%s' for changes: %s", directory,
+                    strerror(errno));
+        }
+    }
+
+    pthread_t watcher_thread;
+    if(pthread_create(&watcher_thread, &server->thread_attr,
+                dirt_watcher_helper, server)) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_WARN,
+                "Unable to start the Dirt watcher thread");
+    }
+}
@@ -3,10 +3,70 @@
 
 #define _GNU_SOURCE
 
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
 #include "http.h"
 #include "constants.h"
 
+/**
+ * dirt.h/.c, handlers loaded from shared libraries into the server.
+ *
+ * With reloading turned on, a thread watches the directories the libraries
+ * were loaded from. When a library file is replaced, the new version is
+ * loaded next to the old one and new requests switch to it, while requests
+ * already running in the old version finish there. The old version is
+ * unloaded once the last of them has returned.
+ *
+ * Handlers come in two versions. A version 1 handler is passed the client's
+ * socket and a copy of the CGI-style variables, and writes everything after
+ * the status line itself. A version 2 handler, marked with
+ * DIRT_HANDLER_VERSION, is passed a read-only view of the request, with its
+ * headers, and a response it writes into. The server buffers the response
+ * and sends it, with its Content-Length, in one writev once the handler
+ * returns, so the connection can stay open for another request.
+ *
+ * A library can also export hooks named after the handler, all optional:
+ *
+ *   int <handler>_init(void** context)
+ *       Called once as the library is loaded, before any request. A
+ *       non-zero return stops the library from being used.
+ *   int <handler>_thread_init(void* context, void** thread_context)
+ *       Called the first time each thread runs the handler. A non-zero
+ *       return fails the request, and the next one tries again.
+ *   void <handler>_thread_shutdown(void* context, void* thread_context)
+ *       Called when the thread exits, or the library is unloaded, which
+ *       can happen from another thread once no requests are running in it.
+ *   void <handler>_shutdown(void* context)
+ *       Called as the library is unloaded, after a reload or when the
+ *       server stops.
+ *
+ * Version 2 handlers are passed both contexts with each request. Every
+ * loaded version of a library has contexts of its own, so a reloaded
+ * library is initialized before it takes over.
+ */
+
 #define MAX_DIRT_PARAMETER_LENGTH 255
+#define MAX_DIRT_FUNCTION_LENGTH 255
+#define MAX_DIRT_RESPONSE_HEADER_LENGTH 2048
+#define DIRT_RESPONSE_INLINE_LENGTH 4096
+
+/* Suffix of the symbol a library exports to give a handler's version */
+#define DIRT_VERSION_SYMBOL_SUFFIX "_dirt_version"
+
+#define DIRT_INIT_SYMBOL_SUFFIX "_init"
+#define DIRT_THREAD_INIT_SYMBOL_SUFFIX "_thread_init"
+#define DIRT_THREAD_SHUTDOWN_SYMBOL_SUFFIX "_thread_shutdown"
+#define DIRT_SHUTDOWN_SYMBOL_SUFFIX "_shutdown"
+#define MAX_DIRT_SYMBOL_SUFFIX_LENGTH 32
+/* Longest shutdown waits for requests still running in Dirt handlers */
+#define DIRT_SHUTDOWN_WAIT 10
+
+/* Mark function, in the library that defines it, as a handler of version */
+#define DIRT_HANDLER_VERSION(function, version) \
+    const unsigned int function##_dirt_version = version
 
 struct spade_server;
 
@@ -21,14 +81,195 @@ typedef struct {
     char query_string[MAX_DIRT_PARAMETER_LENGTH];
     char remote_host[MAX_DIRT_PARAMETER_LENGTH];
     char remote_address[MAX_DIRT_PARAMETER_LENGTH];
+    /* The route's ":name" segments, as "name=value&..." */
+    char path_parameters[MAX_DIRT_PARAMETER_LENGTH];
 } dirt_variables;
 
 typedef struct {
-    void (*handler)(int incoming_socket, dirt_variables environment);
+    const char* name;
+    const char* value;
+} dirt_header;
+
+/* What a version 2 handler is told about a request. The strings point into
+ * the server's copy of the request and are only good until the handler
+ * returns.
+ */
+typedef struct {
+    const char* method;
+    const char* path;            /* Without its leading slash */
+    const char* query_string;
+    const char* path_parameters; /* The route's ":name" segments */
+    const char* script_name;     /* The handler's URL pattern */
+    const char* remote_host;
+    const char* remote_address;
+    const char* server_name;
+    unsigned int server_port;
+    const dirt_header* headers;
+    unsigned int header_count;
+    const char* body; /* NULL, as only GET requests reach handlers */
+    size_t body_length;
+    void* context;        /* From <handler>_init */
+    void* thread_context; /* From <handler>_thread_init on this thread */
+} dirt_request;
+
+/* A version 2 handler's response, sent when the handler returns. Handlers
+ * only call the functions, which return 0 if successful or -1 if the
+ * response couldn't be added to. The rest belongs to the server.
+ */
+typedef struct dirt_response {
+    /* Set the status, "200 OK" unless changed */
+    int (*set_status)(struct dirt_response* response,
+            const char* status_code, const char* message);
+    /* Add a header line, which can't contain CR or LF */
+    int (*add_header)(struct dirt_response* response, const char* name,
+            const char* value);
+    int (*write)(struct dirt_response* response, const char* data,
+            size_t length);
+    int (*printf)(struct dirt_response* response, const char* format, ...)
+        __attribute__((format(printf, 2, 3)));
+
+    char status_code[MAX_STATUS_LENGTH + 1];
+    char message[MAX_STATUS_MESSAGE_LENGTH];
+    char headers[MAX_DIRT_RESPONSE_HEADER_LENGTH];
+    size_t headers_length;
+    char* body; /* inline_body until the body outgrows it */
+    size_t body_length;
+    size_t body_capacity;
+    int failed; /* Something couldn't be added, so send a 500 instead */
+    char inline_body[DIRT_RESPONSE_INLINE_LENGTH];
+} dirt_response;
+
+typedef void (*dirt_function)(int incoming_socket,
+        dirt_variables environment);
+typedef void (*dirt_function_v2)(const dirt_request* request,
+        dirt_response* response);
+
+typedef int (*dirt_init_function)(void** context);
+typedef int (*dirt_thread_init_function)(void* context,
+        void** thread_context);
+typedef void (*dirt_thread_shutdown_function)(void* context,
+        void* thread_context);
+typedef void (*dirt_shutdown_function)(void* context);
+
+struct dirt_library;
+
+/* One thread's context for one loaded version of a library. Each is in a
+ * list of the thread's and, until it's shut down, one of the library's.
+ */
+typedef struct dirt_thread_state {
+    struct dirt_library* library; /* NULL once it has been shut down */
+    void* thread_context;
+    struct dirt_thread_state* next; /* In the thread's list */
+    struct dirt_thread_state* library_previous;
+    struct dirt_thread_state* library_next;
+} dirt_thread_state;
+
+/* One loaded version of a handler's library */
+typedef struct dirt_library {
+    void* library_handle;
+    unsigned int version; /* Of the handler's interface, 1 or 2 */
+    dirt_function handler;
+    dirt_function_v2 handler_v2;
+    dirt_thread_init_function thread_init;
+    dirt_thread_shutdown_function thread_shutdown;
+    dirt_shutdown_function shutdown;
+    void* context;
+    dirt_thread_state* threads; /* Guarded by dirt_thread_lock */
+    unsigned int references; /* Requests running in it, +1 while current */
+} dirt_library;
+
+typedef struct {
     char path[MAX_DYNAMIC_PATH_PREFIX];
+    char library_path[MAX_PATH_LENGTH];
+    char function[MAX_DIRT_FUNCTION_LENGTH];
+    pthread_mutex_t lock; /* Guards swapping library */
+    dirt_library* library;
+    dev_t device; /* Identity of the file library was loaded from */
+    ino_t inode;
+    time_t modified;
+    unsigned int generation; /* Number of times the library was reloaded */
 } dirt_handler;
 
 dirt_variables build_dirt_variables(struct spade_server* server,
 				http_request* request, dirt_handler* handler);
 
+/* Fill in the view of request a version 2 handler is passed, pointing at
+ * the request itself rather than copying it.
+ *
+ * Modifies *view, headers, which must hold HTTP_HEADER_LIST_LENGTH.
+ */
+void build_dirt_request(struct spade_server* server, http_request* request,
+        dirt_handler* handler, const char* path_parameters,
+        dirt_request* view, dirt_header* headers);
+
+/* Start an empty 200 response for a version 2 handler. */
+void init_dirt_response(dirt_response* response);
+
+/* Free what a response allocated as its body grew. */
+void free_dirt_response(dirt_response* response);
+
+/* Send a version 2 handler's response: the status line, common headers,
+ * Content-Length and the handler's headers, then the body, in one writev.
+ *
+ * Returns 0 if successful, or -1 if the write failed.
+ */
+int send_dirt_response(int incoming_socket, dirt_response* response,
+        int keep_alive);
+
+/* Load function from the shared library at library_path into handler,
+ * which must not be copied afterwards.
+ *
+ * Modifies *handler.
+ * Returns 0 if successful, or -1 if the library or function couldn't be
+ * loaded.
+ */
+int open_dirt_handler(dirt_handler* handler, const char* library_path,
+        const char* function);
+
+/* Take a reference to the current version of a handler's library, which
+ * stays loaded until it's released.
+ *
+ * Returns the library, or NULL if the handler has been closed.
+ */
+dirt_library* acquire_dirt_library(dirt_handler* handler);
+
+/* Drop a reference taken by acquire_dirt_library, shutting the library
+ * down and unloading it if it has been replaced and this was the last one.
+ */
+void release_dirt_library(dirt_library* library);
+
+/* Find the calling thread's context for library, running the library's
+ * thread init hook the first time this thread asks.
+ *
+ * Modifies *thread_context.
+ * Returns 0 if successful, or -1 if the hook failed.
+ */
+int get_dirt_thread_context(dirt_library* library, void** thread_context);
+
+/* Stop using a handler's library as the server shuts down, unloading it
+ * once requests still running in it have returned.
+ */
+void close_dirt_handler(dirt_handler* handler);
+
+/* Wait up to seconds for every closed handler's library to be unloaded,
+ * once the requests still running in it return.
+ *
+ * Returns 0 if they all were, or -1 if some are still loaded.
+ */
+int wait_for_dirt_libraries(unsigned int seconds);
+
+/* Load the handler's library again if the file has been replaced since it
+ * was last loaded, and switch new requests over to it.
+ *
+ * Returns 1 if the library was reloaded, 0 if the file hasn't changed, or
+ * -1 if the new version couldn't be loaded, in which case the old one stays
+ * in use.
+ */
+int reload_dirt_handler(dirt_handler* handler);
+
+/* Start a thread that reloads Dirt handlers whose library files change.
+ * Does nothing unless server->dirt_reload is set.
+ */
+void start_dirt_watcher(struct spade_server* server);
+
 #endif // _DIRT_H_
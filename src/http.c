@@ -1,106 +1,5 @@
 #include "http.h"
 
-void free_http_response(http_response* response) {
-    if(response->message.length && response->data) {
-        free(response->data);
-    }
-}
-
-int equal_http_headers(http_header* first, int first_count,
-        http_header* second, int second_count) {
-    int i, j;
-    for(i = 0; i < first_count; i++) {
-        for(j = 0; j < second_count; j++) {
-            if(!strncmp(first[i].key, second[j].key, MAX_HEADER_KEY_LENGTH)) {
-                if(strncmp(first[i].value, second[j].value,
-                            MAX_HEADER_VALUE_LENGTH)) {
-                    return 0;
-                }
-            }
-        }
-    }
-
-    for(i = 0; i < second_count; i++) {
-        for(j = 0; j < first_count; j++) {
-            if(!strncmp(second[i].key, first[j].key, MAX_HEADER_KEY_LENGTH)) {
-                if(strncmp(second[i].value, first[j].value,
-                            MAX_HEADER_VALUE_LENGTH)) {
-                    return 0;
-                }
-            }
-        }
-    }
-    return 1;
-}
-
-int find_matching_http_header(char* key, http_header* match, http_header* second, 
-        int second_count) {
-    int i;
-    if(!strncmp(match->key, key, MAX_HEADER_KEY_LENGTH)) {
-        for(i = 0; i < second_count; i++) {
-            if(!strncmp(second[i].key, key, MAX_HEADER_KEY_LENGTH)) {
-                if(strncmp(match->value, second[i].value, 
-                        MAX_HEADER_VALUE_LENGTH)) {
-                    return 0;
-                } else {
-                    break;
-                }
-            }
-        }
-    }
-    return 1;
-}
-
-int equal_cached_http_headers(http_header* first, int first_count,
-        http_header* second, int second_count) {
-    int i;
-    for(i = 0; i < first_count; i++) {
-        if(!find_matching_http_header("Accept", &first[i], second, second_count)) {
-            return 0;
-        }
-        if(!find_matching_http_header("Accept-Language", &first[i], second,
-                    second_count)) {
-            return 0;
-        }
-        if(!find_matching_http_header("Accept-Encoding", &first[i], second,
-                    second_count)) {
-            return 0;
-        }
-    }
-    return 1;
-}
-
-int equal_http_uri(http_uri* first, http_uri* second) {
-    return !strncmp(first->host, second->host, MAX_HOSTNAME_LENGTH)
-        && first->port == second->port
-        && !strncmp(first->path, second->path, MAX_PATH_LENGTH)
-        && first->valid == second->valid;
-}
-
-int equal_http_message(http_message* first, http_message* second) {
-    return first->version == second->version
-            && first->header_count == second->header_count
-            && equal_http_headers(first->headers, first->header_count,
-                    second->headers, second->header_count)
-            && first->length == second->length
-            && first->valid == second->valid;
-}
-
-int equal_http_request(http_request* first, http_request* second) {
-    return first->method == second->method
-            && equal_http_uri(&first->uri, &second->uri)
-            && first->has_host_header && second->has_host_header
-            && equal_http_message(&first->message, &second->message);
-}
-
-int equal_cached_http_request(http_request* first, http_request* second) {
-    return first->method == second->method
-            && equal_http_uri(&first->uri, &second->uri)
-            && equal_cached_http_headers(first->message.headers, 
-                    first->message.header_count,
-                    second->message.headers, second->message.header_count);
-}
-
 http_version string_to_http_version(char* version) {
     http_version result;
     if(!strncmp(version, HTTP_VERSION_1_0_STRING, MAX_VERSION_LENGTH)) {
@@ -113,16 +12,6 @@ http_version string_to_http_version(char* version) {
     return result;
 }
 
-char* http_version_to_string(http_version version) {
-    if(version == HTTP_VERSION_1_0) {
-        return HTTP_VERSION_1_0_STRING;
-    } else if(version == HTTP_VERSION_1_1) {
-        return HTTP_VERSION_1_1_STRING;
-    } else {
-        return HTTP_VERSION_NONE_STRING;
-    }
-}
-
 http_method string_to_http_method(char* method) {
     http_method result;
     if(!strcmp(method, HTTP_METHOD_GET_STRING)) {
@@ -161,149 +50,365 @@ char* http_method_to_string(http_method method) {
     }
 }
 
-void http_headers_to_string(http_message* message, char* buf) {
-    int i;
-    int header_buffer_size = MAX_HEADER_KEY_LENGTH
-            + MAX_HEADER_VALUE_LENGTH + 3;
-    char header[header_buffer_size];
-    for(i = 0; i < message->header_count; i++) {
-        if(strncmp(message->headers[i].key, "Keep-Alive",
-                    MAX_HEADER_KEY_LENGTH)) {
-            snprintf(header, header_buffer_size, "%s: %s\r\n", 
-                    message->headers[i].key, message->headers[i].value);
-            buf = strcat(buf, header);
+char* content_encoding_to_string(content_encoding encoding) {
+    if(encoding == CONTENT_ENCODING_GZIP) {
+        return CONTENT_ENCODING_GZIP_STRING;
+    } else if(encoding == CONTENT_ENCODING_BROTLI) {
+        return CONTENT_ENCODING_BROTLI_STRING;
+    } else {
+        return CONTENT_ENCODING_IDENTITY_STRING;
+    }
+}
+
+char* http_request_string(http_request* request, http_span span) {
+    return request->buffer + span.offset;
+}
+
+char* find_http_header(http_request* request, const char* key) {
+    size_t key_length = strlen(key);
+    for(unsigned int i = 0; i < request->message.header_count; i++) {
+        http_header* header = &request->message.headers[i];
+        if(header->key.length == key_length && !strncasecmp(
+                    http_request_string(request, header->key), key,
+                    key_length)) {
+            return http_request_string(request, header->value);
+        }
+    }
+    return NULL;
+}
+
+int http_request_wants_keep_alive(http_request* request) {
+    char* connection = find_http_header(request, "Connection");
+    if(request->message.version == HTTP_VERSION_1_1) {
+        return connection == NULL || !strcasestr(connection, "close");
+    }
+    return connection != NULL && strcasestr(connection, "keep-alive");
+}
+
+int http_request_accepts_encoding(http_request* request, char* coding) {
+    char* token = find_http_header(request, "Accept-Encoding");
+    if(token == NULL) {
+        return 0;
+    }
+
+    while(*token) {
+        token += strspn(token, " \t,");
+        size_t length = strcspn(token, " \t,;");
+        char* end = token + strcspn(token, ",");
+        int matches = (length == strlen(coding)
+                && !strncasecmp(token, coding, length))
+            || (length == 1 && *token == '*');
+
+        double quality = 1;
+        char* parameter = token + length;
+        while(parameter < end && (parameter = memchr(parameter, ';',
+                        end - parameter))) {
+            parameter += 1 + strspn(parameter + 1, " \t");
+            if(!strncasecmp(parameter, "q=", 2)) {
+                quality = strtod(parameter + 2, NULL);
+            }
+        }
+
+        if(matches && quality > 0) {
+            return 1;
         }
+        token = end;
     }
+    return 0;
 }
 
-char* http_request_to_string(http_request* request, char* buf) {
-    snprintf(buf, MAXBUF, "%s %s %s\r\n", 
-            http_method_to_string(request->method), request->uri.path,
-            HTTP_VERSION_1_0_STRING);
-    http_headers_to_string(&request->message, buf);
-    buf = strcat(buf, "\r\n");
-    return buf;
+int http_request_matches_entity_tag(http_request* request,
+        char* entity_tag) {
+    char* tag = find_http_header(request, "If-None-Match");
+    if(tag == NULL) {
+        return 0;
+    }
+
+    while(*tag) {
+        tag += strspn(tag, " \t,");
+        if(*tag == '*') {
+            return 1;
+        }
+        /* The weak comparison, so W/ prefixes don't matter */
+        if(!strncmp(tag, "W/", 2)) {
+            tag += 2;
+        }
+        size_t length = strcspn(tag, " \t,");
+        if(length == strlen(entity_tag) && !strncmp(tag, entity_tag, length)) {
+            return 1;
+        }
+        tag += length;
+    }
+    return 0;
 }
 
-char* http_response_to_string(http_response* response, char* buf) {
-    snprintf(buf, MAXBUF, "%s %d %s\r\n", 
-            http_version_to_string(response->message.version), response->status, 
-            response->status_reason);
-    http_headers_to_string(&response->message, buf);
-    buf = strcat(buf, "\r\n");
-    return buf;
+int parse_http_byte_ranges(http_request* request, size_t length,
+        byte_range* ranges) {
+    char* spec = find_http_header(request, "Range");
+    if(spec == NULL || strncasecmp(spec, "bytes=", 6)) {
+        return 0;
+    }
+
+    int count = 0;
+    int specs = 0;
+    spec += 6;
+    while(*(spec += strspn(spec, " \t,"))) {
+        char* end;
+        byte_range range;
+        int satisfiable;
+        if(*spec == '-') {
+            /* A suffix range, the last n bytes */
+            size_t suffix = strtoull(spec + 1, &end, 10);
+            if(end == spec + 1 || !isdigit(spec[1])) {
+                return 0;
+            }
+            satisfiable = suffix > 0 && length > 0;
+            range.first = suffix < length ? length - suffix : 0;
+            range.last = length - 1;
+        } else {
+            if(!isdigit(*spec)) {
+                return 0;
+            }
+            range.first = strtoull(spec, &end, 10);
+            if(*end != '-') {
+                return 0;
+            }
+            range.last = length - 1;
+            if(isdigit(end[1])) {
+                size_t last = strtoull(end + 1, &end, 10);
+                if(last < range.first) {
+                    return 0;
+                }
+                if(last < range.last) {
+                    range.last = last;
+                }
+            } else {
+                end++;
+            }
+            satisfiable = range.first < length;
+        }
+
+        spec = end + strspn(end, " \t");
+        if(*spec && *spec != ',') {
+            return 0;
+        }
+        specs++;
+        if(satisfiable) {
+            if(count == MAX_BYTE_RANGES) {
+                return 0;
+            }
+            ranges[count++] = range;
+        }
+    }
+
+    if(specs == 0) {
+        return 0;
+    }
+    return count > 0 ? count : -1;
 }
 
-void parse_http_header(http_header* header, char* header_string) {
-    // This could do more error checking, but we will assume proper HTTP headers
-    // for now.
-    header->valid = 1;
-    strcpy(header->key, header_string);
-    char* key_value_separator = strchr(header->key, ':');
-    strcpy(header->value, key_value_separator + 2);
-    key_value_separator[0] = '\0';
+int format_http_date(char* buf, time_t time) {
+    struct tm date;
+    gmtime_r(&time, &date);
+    return strftime(buf, MAX_HTTP_DATE_LENGTH, HTTP_DATE_FORMAT, &date);
 }
 
-http_uri parse_http_uri(char* uri) {
-    http_uri parsed_uri;
-    parsed_uri.valid = 0;
-    parsed_uri.query_string[0] = '\0';
-    parsed_uri.port = DEFAULT_HTTP_PORT;
-    parsed_uri.host[0] = '\0';
-    parsed_uri.path[0] = '\0';
-    char* port;
-    char* protocol_index;
-    if((protocol_index = strstr(uri, "://"))) {
-        uri = protocol_index + 3;
+int parse_http_date(char* date, time_t* time) {
+    struct tm parsed;
+    memset(&parsed, 0, sizeof(parsed));
+    date += strspn(date, " \t");
+    if(strptime(date, HTTP_DATE_FORMAT, &parsed) == NULL) {
+        return -1;
     }
+    *time = timegm(&parsed);
+    return 0;
+}
 
-    /* Proxy expects http://hostname/path/... or /path/... style requests,
-     * and if there is no hostname we just assume it is for us since we don't do
-     * virtual hosts.
-     */ 
-    int tokens = sscanf(uri, "%"XSTR(MAX_HOSTNAME_LENGTH)"[^/]/%"XSTR(MAX_PATH_LENGTH)"[^\r\n]", 
-            parsed_uri.host, parsed_uri.path);
-    if(tokens == 0) {
-        tokens = sscanf(uri, "/%"XSTR(MAX_PATH_LENGTH)"[^\r\n]", parsed_uri.path);
-    } else {
-        if((port = strchr(parsed_uri.host, ':'))) {
-            *port++ = '\0';
-            parsed_uri.port = atoi(port);
+/* Point a span at the length bytes at start in buffer, ending them with a
+ * NUL in place of the delimiter that follows them.
+ */
+http_span terminate_span(char* buffer, char* start, size_t length) {
+    start[length] = '\0';
+    http_span span = {start - buffer, length};
+    return span;
+}
+
+void parse_http_uri(http_request* request, char* uri, char* end) {
+    char* slash = uri;
+    if(*uri != '/') {
+        /* Absolute URIs name a host, which is assumed to be this one since
+         * we don't do virtual hosts.
+         */
+        char* authority = memmem(uri, end - uri, "://", 3);
+        if(authority == NULL) {
+            request->message.valid = 0;
+            return;
+        }
+        slash = memchr(authority + 3, '/', end - authority - 3);
+        if(slash == NULL) {
+            /* No path at all, so borrow a slash from the "://" */
+            request->uri.path = terminate_span(request->buffer,
+                    authority + 1, 1);
+            request->uri.query_string = terminate_span(request->buffer, end,
+                    0);
+            return;
         }
-        parsed_uri.valid = 1;
     }
 
-    if(parsed_uri.path && parsed_uri.path[0] == '\0') {
-        memcpy(parsed_uri.path, "/", 2);
+    char* query_string = memchr(slash, '?', end - slash);
+    char* path_end = query_string ? query_string : end;
+    if(path_end - slash > MAX_PATH_LENGTH || (query_string
+                && end - query_string > MAX_QUERY_STRING_LENGTH)) {
+        request->message.valid = 0;
+        return;
     }
 
-    char* query_string_index = strchr(parsed_uri.path, '?');
-    if(query_string_index) {
-        strcpy(parsed_uri.query_string, query_string_index + 1);
-        *query_string_index = '\0';
+    if(query_string) {
+        request->uri.query_string = terminate_span(request->buffer,
+                query_string + 1, end - query_string - 1);
+    } else {
+        request->uri.query_string = terminate_span(request->buffer, end, 0);
+    }
+    if(path_end - slash > 1) {
+        request->uri.path = terminate_span(request->buffer, slash + 1,
+                path_end - slash - 1);
+    } else {
+        request->uri.path = terminate_span(request->buffer, slash, 1);
     }
-    return parsed_uri;
 }
 
-http_request parse_http_request(char* request) {
-    char uri[MAXLINE];
-    char version[MAX_VERSION_LENGTH];
-    char method[MAX_METHOD_LENGTH];
-    version[0] = uri[0] = method[0] = '\0';
-    http_request parsed_request;
-    parsed_request.message.valid = 1;
-
-    memcpy(method, request, MAX_METHOD_LENGTH);
-    strchr(method, ' ')[0] = '\0';
-    char* separator = strchr(request, ' ');
-    memcpy(uri, separator + 1, MAXLINE);
-    strchr(uri, ' ')[0] = '\0';
-    separator = strchr(separator + 1, ' ');
-    memcpy(version, separator + 1, MAX_VERSION_LENGTH);
-    version[MAX_VERSION_LENGTH - 1] = '\0';
-
-    parsed_request.method = string_to_http_method(method);
-    if(parsed_request.method == HTTP_METHOD_NONE) {
-        parsed_request.message.valid = 0;
+/* Parse "METHOD URI VERSION" from the length bytes at line. */
+void parse_http_request_line(http_request* request, char* line,
+        size_t length) {
+    char* end = line + length;
+    char* method_end = memchr(line, ' ', length);
+    char* uri_end = method_end
+        ? memchr(method_end + 1, ' ', end - method_end - 1) : NULL;
+    if(uri_end == NULL || uri_end == method_end + 1) {
+        request->message.valid = 0;
+        return;
+    }
+
+    *method_end = '\0';
+    request->method = string_to_http_method(line);
+    *end = '\0';
+    request->message.version = string_to_http_version(uri_end + 1);
+    if(request->method == HTTP_METHOD_NONE
+            || request->message.version == HTTP_VERSION_NONE) {
+        request->message.valid = 0;
     }
+    parse_http_uri(request, method_end + 1, uri_end);
+}
 
-    parsed_request.message.version = string_to_http_version(version);
-    if(parsed_request.message.version == HTTP_VERSION_NONE) {
-        parsed_request.message.valid = 0;
+/* Parse "Key: value" from the length bytes at line. */
+void parse_http_header(http_request* request, char* line, size_t length) {
+    char* end = line + length;
+    char* separator = memchr(line, ':', length);
+    if(separator == NULL || separator == line
+            || request->message.header_count == HTTP_HEADER_LIST_LENGTH) {
+        request->message.valid = 0;
+        return;
     }
 
-    if(uri[0]) {
-        parsed_request.uri = parse_http_uri(uri);
+    char* value = separator + 1;
+    while(value < end && (*value == ' ' || *value == '\t')) {
+        value++;
+    }
+    while(end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    http_header* header =
+        &request->message.headers[request->message.header_count++];
+    header->key = terminate_span(request->buffer, line, separator - line);
+    header->value = terminate_span(request->buffer, value, end - value);
+}
+
+void init_http_parser(http_parser* parser, http_request* request) {
+    parser->state = HTTP_PARSE_REQUEST_LINE;
+    parser->line_start = 0;
+    parser->scanned = 0;
+    request->length = 0;
+    request->method = HTTP_METHOD_NONE;
+    request->message.version = HTTP_VERSION_NONE;
+    request->message.header_count = 0;
+    request->message.valid = 1;
+}
+
+/* Parse the line that ends with the line feed at offset newline in the
+ * request's buffer.
+ */
+void parse_http_line(http_parser* parser, http_request* request,
+        size_t newline) {
+    char* line = request->buffer + parser->line_start;
+    size_t line_length = newline - parser->line_start;
+    if(line_length > 0 && line[line_length - 1] == '\r') {
+        line_length--;
+    }
+    parser->line_start = newline + 1;
+
+    if(parser->state == HTTP_PARSE_REQUEST_LINE) {
+        /* Stray line breaks before a request are ignored */
+        if(line_length > 0) {
+            parse_http_request_line(request, line, line_length);
+            parser->state = HTTP_PARSE_HEADERS;
+        }
+    } else if(line_length == 0) {
+        parser->state = HTTP_PARSE_DONE;
     } else {
-        parsed_request.message.valid = 0;
+        parse_http_header(request, line, line_length);
     }
-    parsed_request.message.header_count = 0;
-    return parsed_request;
 }
 
-http_response parse_http_response(char* response) {
-    char version[MAX_VERSION_LENGTH];
-    version[0] = '\0';
-    http_response parsed_response;
-    parsed_response.message.valid = 1;
-    parsed_response.message.length = 0;
-    parsed_response.message.header_count = 0;
-    parsed_response.status = 0;
-    parsed_response.from_cache = 0;
-    parsed_response.data = NULL;
-    sscanf(response,
-            "%"XSTR(MAX_VERSION_LENGTH)"s %"XSTR(MAX_STATUS_LENGTH)"d %"XSTR(MAX_STATUS_MESSAGE_LENGTH)"[^\r\n]",
-            version, &parsed_response.status, parsed_response.status_reason);
-
-    parsed_response.message.version = string_to_http_version(version);
-    if(parsed_response.message.version == HTTP_VERSION_NONE) {
-        parsed_response.message.valid = 0;
+int parse_http_request(http_parser* parser, http_request* request,
+        char* buffer, size_t length) {
+    request->buffer = buffer;
+    /* Only search the bytes that have arrived since the last call, a block
+     * at a time, stopping only at control characters.
+     */
+    while(parser->state != HTTP_PARSE_DONE && parser->scanned < length) {
+        size_t block = parser->scanned;
+        uint64_t delimiters = find_http_delimiters(buffer + block,
+                length - block);
+        parser->scanned = length - block > HTTP_SCAN_BLOCK
+            ? block + HTTP_SCAN_BLOCK : length;
+
+        while(delimiters && parser->state != HTTP_PARSE_DONE) {
+            size_t offset = block + __builtin_ctzll(delimiters);
+            delimiters &= delimiters - 1;
+            if(buffer[offset] == '\n') {
+                parse_http_line(parser, request, offset);
+            } else if(buffer[offset] == '\r') {
+                if(offset + 1 == length) {
+                    /* Come back once we know whether a line feed follows */
+                    parser->scanned = offset;
+                    return 0;
+                } else if(buffer[offset + 1] != '\n') {
+                    request->message.valid = 0;
+                } else if(offset + 1 < block + HTTP_SCAN_BLOCK) {
+                    /* Take the line feed's bit now too */
+                    delimiters &= delimiters - 1;
+                    parse_http_line(parser, request, offset + 1);
+                }
+            } else if(buffer[offset] != '\t') {
+                request->message.valid = 0;
+            }
+        }
     }
 
-    if(parsed_response.status < 100 || parsed_response.status > 510) {
-        parsed_response.message.valid = 0;
+    if(parser->state != HTTP_PARSE_DONE) {
+        return 0;
     }
+    request->length = parser->line_start;
+    return 1;
+}
 
-    parsed_response.message.header_count = 0;
-    return parsed_response;
+http_request* copy_http_request(http_request* request) {
+    http_request* copy = malloc(sizeof(http_request) + request->length);
+    if(copy == NULL) {
+        return NULL;
+    }
+    *copy = *request;
+    copy->buffer = (char*) (copy + 1);
+    memcpy(copy->buffer, request->buffer, request->length);
+    return copy;
 }
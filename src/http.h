@@ -5,6 +5,7 @@
 
 #include "csapp.h"
 #include "constants.h"
+#include "scan.h"
 
 /**
  * 15-845 Independent Project
@@ -35,10 +36,19 @@
 #define MAX_URI_LENGTH 8192
 #define MAX_STATUS_LENGTH 3
 #define MAX_STATUS_MESSAGE_LENGTH 32
+#define MAX_HTTP_DATE_LENGTH 32
+
+/* IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT" */
+#define HTTP_DATE_FORMAT "%a, %d %b %Y %H:%M:%S GMT"
 
 /* Maximum number of HTTP headers, used for stack allocated buffer. */
 #define HTTP_HEADER_LIST_LENGTH 64
 
+/* Most ranges honoured in one Range header; requests for more are answered
+ * with the whole file.
+ */
+#define MAX_BYTE_RANGES 8
+
 #define HTTP_VERSION_1_0_STRING "HTTP/1.0"
 #define HTTP_VERSION_1_1_STRING "HTTP/1.1"
 #define HTTP_VERSION_NONE_STRING "HTTP/NONE"
@@ -51,6 +61,16 @@
 #define HTTP_METHOD_DELETE_STRING "DELETE"
 #define HTTP_METHOD_NONE_STRING ""
 
+#define CONTENT_ENCODING_IDENTITY_STRING "identity"
+#define CONTENT_ENCODING_GZIP_STRING "gzip"
+#define CONTENT_ENCODING_BROTLI_STRING "br"
+
+typedef enum {
+    CONTENT_ENCODING_IDENTITY,
+    CONTENT_ENCODING_GZIP,
+    CONTENT_ENCODING_BROTLI
+} content_encoding;
+
 typedef enum {
     HTTP_VERSION_1_0,
     HTTP_VERSION_1_1,
@@ -67,89 +87,152 @@ typedef enum {
     HTTP_METHOD_NONE
 } http_method;
 
+/* A run of bytes in a request's buffer, counted from the start of the
+ * request. The parser writes a NUL after each one, so it can also be used
+ * as a string.
+ */
 typedef struct {
-    char key[MAX_HEADER_KEY_LENGTH];
-    char value[MAX_HEADER_VALUE_LENGTH];
-    int valid;
+    unsigned short offset;
+    unsigned short length;
+} http_span;
+
+typedef struct {
+    http_span key;
+    http_span value; /* Without surrounding whitespace */
 } http_header;
 
+/* An inclusive range of byte positions in a response body */
 typedef struct {
-    char host[MAX_HOSTNAME_LENGTH];
-    int port;
-    char path[MAX_PATH_LENGTH];
-    int valid;
-    char query_string[MAX_QUERY_STRING_LENGTH];
+    size_t first;
+    size_t last;
+} byte_range;
+
+typedef struct {
+    http_span path; /* Without its leading slash, or "/" if that's all */
+    http_span query_string;
 } http_uri;
 
 typedef struct {
     http_version version;
     http_header headers[HTTP_HEADER_LIST_LENGTH];
     unsigned int header_count;
-    int length;
     int valid;
 } http_message;
 
+/* A request's method, URI and headers, which refer to the raw request line
+ * and headers in buffer rather than holding copies of them.
+ */
 typedef struct {
+    char* buffer;
+    size_t length;  /* Of the request line and headers in buffer */
     http_method method;
     http_uri uri;
-    int has_host_header;
     http_message message;
     char remote_host[NI_MAXHOST];
     char remote_address[MAX_IP_ADDRESS]; // TODO is this the correct limit?
+    int keep_alive; /* Leave the connection open after the response */
 } http_request;
 
+typedef enum {
+    HTTP_PARSE_REQUEST_LINE,
+    HTTP_PARSE_HEADERS,
+    HTTP_PARSE_DONE
+} http_parse_state;
+
+/* Progress through a request that may arrive over several reads. Offsets
+ * are from the start of the request, so the buffer can move between calls
+ * as long as the request's bytes move with it.
+ */
 typedef struct {
-    int status;
-    int from_cache;
-    char status_reason[MAX_STATUS_MESSAGE_LENGTH];
-    http_message message;
-    void* data; /* Requests don't have data since we only accept GET for now */
-} http_response;
+    http_parse_state state;
+    size_t line_start; /* Start of the first line not yet parsed */
+    size_t scanned;    /* Bytes already searched for control characters */
+} http_parser;
 
 /* "Public" utility methods */
 
-/* Free an HTTP response, specifically any buffer allocated for response
- * content.
- */
-void free_http_response(http_response* response);
-
 /* To/from string conversion metods */
 char* http_method_to_string(http_method method);
 http_method string_to_http_method(char* method);
-char* http_request_to_string(http_request* request, char* buf);
-char* http_response_to_string(http_response* response, char* buf);
+char* content_encoding_to_string(content_encoding encoding);
 
-void parse_http_header(http_header* header, char* header_string);
+/* Returns the NUL terminated string that span refers to in the request. */
+char* http_request_string(http_request* request, http_span span);
 
-/* Parse an http_uri from the buffer at uri. The valid bit in the returned
- * uri will be 0 if a URI was not found or it was invalid.
+/* Find a header in the request by case-insensitive key.
+ *
+ * Returns the header's value, or NULL if the request doesn't have it.
+ */
+char* find_http_header(http_request* request, const char* key);
+
+/* Returns 1 if the request asks for its connection to stay open: the
+ * default for HTTP/1.1 unless it sent "Connection: close", and only with
+ * "Connection: keep-alive" for HTTP/1.0.
+ */
+int http_request_wants_keep_alive(http_request* request);
+
+/* Returns 1 if the request's Accept-Encoding header lists coding, or "*",
+ * without a quality of 0.
  */
-http_uri parse_http_uri(char* uri);
+int http_request_accepts_encoding(http_request* request, char* coding);
 
-/* Parse an http_request from the buffer at request. The valid bit in the
- * returned request will be 0 if a request was not found or it was invalid.
+/* Returns 1 if the request's If-None-Match header lists entity_tag, which
+ * includes its quotes, or is "*". Weak tags match their strong
+ * counterparts.
+ */
+int http_request_matches_entity_tag(http_request* request,
+        char* entity_tag);
+
+/* Parse the request's Range header against a body of length bytes,
+ * dropping any range that lies past the end of the body and clipping the
+ * rest to it.
  *
- * Does not parse content in the buffer.
+ * Modifies ranges, which must hold MAX_BYTE_RANGES.
+ * Returns the number of ranges, 0 if the whole body should be sent because
+ * there is no usable Range header, or -1 if none of the ranges can be
+ * satisfied.
  */
-http_request parse_http_request(char* request);
+int parse_http_byte_ranges(http_request* request, size_t length,
+        byte_range* ranges);
 
-/* Parse an http_response from the buffer at request. The valid bit in the
- * returned response will be 0 if a response was not found or it was invalid.
+/* Format time as an HTTP date in buf, which must hold MAX_HTTP_DATE_LENGTH
+ * bytes.
  *
- * Does not parse content in the buffer.
+ * Returns the length of the date.
  */
-http_response parse_http_response(char* response);
+int format_http_date(char* buf, time_t time);
 
-/* Equality testing methods */
-int equal_http_request(http_request* first, http_request* second);
-int equal_http_uri(http_uri* first, http_uri* second);
-int equal_http_headers(http_header* first, int first_count,
-        http_header* second, int second_count);
-int equal_http_message(http_message* first, http_message* second);
+/* Parse an HTTP date in IMF-fixdate format.
+ *
+ * Modifies *time to the parsed time.
+ * Returns 0 on success, or -1 if date couldn't be parsed.
+ */
+int parse_http_date(char* date, time_t* time);
+
+/* Start parsing a new request. */
+void init_http_parser(http_parser* parser, http_request* request);
 
-/* Slightly less strict equality testing requirements if we're checking
- * for a cached entry.
+/* Parse whatever complete lines of the request line and headers have
+ * arrived in the length bytes at buffer since the last call, recording
+ * where each part of the request lies instead of copying it. A malformed
+ * request is parsed to the end of its headers and left without
+ * message.valid.
+ *
+ * Does not parse content in the buffer.
+ *
+ * Modifies parser, request and the parsed lines in buffer.
+ * Returns 1 once the request line and headers are complete, with
+ * request->length set to their length, or 0 if more bytes are needed.
+ */
+int parse_http_request(http_parser* parser, http_request* request,
+        char* buffer, size_t length);
+
+/* Copy a parsed request along with the bytes it refers to, so that it
+ * outlives the buffer it was read into.
+ *
+ * Returns a single allocation for the caller to free, or NULL if it
+ * couldn't be allocated.
  */
-int equal_cached_http_request(http_request* first, http_request* second);
+http_request* copy_http_request(http_request* request);
 
 #endif // _HTTP_H_
@@ -0,0 +1,95 @@
+#include "pool.h"
+
+/* Worker thread primary function. Sleeps until a connection is queued and
+ * serves it to completion.
+ */
+void* worker_helper(void* args) {
+    signal(SIGPIPE, SIG_IGN);
+    worker_pool* pool = (worker_pool*) args;
+
+    while(1) {
+        if(sem_wait(&pool->queued)) {
+            continue;
+        }
+
+        queued_connection queued;
+        while(ring_dequeue(&pool->ring, &queued)) {
+            /* A producer has claimed a cell but not published it yet */
+            sched_yield();
+        }
+
+        receive_args receive_arguments;
+        receive_arguments.server = pool->server;
+        receive_arguments.incoming_socket = queued.socket;
+        receive_arguments.client_address = queued.client_address;
+        receive(&receive_arguments);
+    }
+    return 0;
+}
+
+int start_worker_pool(spade_server* server) {
+    worker_pool* pool = malloc(sizeof(worker_pool));
+    if(pool == NULL) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Unable to malloc space for the worker pool: %s",
+                strerror(errno));
+        return -1;
+    }
+    pool->server = server;
+    pool->rejected = 0;
+    pool->thread_count = server->worker_threads;
+
+    if(initialize_ring(&pool->ring, server->worker_queue_length)) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Unable to allocate a worker queue of length %d",
+                server->worker_queue_length);
+        free(pool);
+        return -1;
+    }
+    sem_init(&pool->queued, 0, 0);
+
+    pool->threads = malloc(pool->thread_count * sizeof(pthread_t));
+    if(pool->threads == NULL) {
+        free_ring(&pool->ring);
+        free(pool);
+        return -1;
+    }
+    for(unsigned int i = 0; i < pool->thread_count; i++) {
+        if(pthread_create(&pool->threads[i], &server->thread_attr,
+                    worker_helper, pool)) {
+            log4c_category_log(log4c_category_get("spade"),
+                    LOG4C_PRIORITY_ERROR,
+                    "Only able to start %d of %d worker threads", i,
+                    pool->thread_count);
+            pool->thread_count = i;
+            break;
+        }
+    }
+
+    log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+            "Started %d worker threads with a queue of %zu connections",
+            pool->thread_count, ring_capacity(&pool->ring));
+    server->pool = pool;
+    return pool->thread_count > 0 ? 0 : -1;
+}
+
+int submit_connection(worker_pool* pool, int incoming_socket,
+        struct sockaddr_in* client_address) {
+    queued_connection queued;
+    queued.socket = incoming_socket;
+    queued.client_address = *client_address;
+
+    if(ring_enqueue(&pool->ring, &queued)) {
+        __atomic_add_fetch(&pool->rejected, 1, __ATOMIC_RELAXED);
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_WARN,
+                "Worker queue full with %zu connections, rejecting socket %d",
+                ring_depth(&pool->ring), incoming_socket);
+        return_client_error(incoming_socket, "all workers are busy", "503",
+                "Service Unavailable",
+                "Spade is too busy to take this request");
+        close(incoming_socket);
+        return -1;
+    }
+    sem_post(&pool->queued);
+    return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#define _GNU_SOURCE
+
+#include <semaphore.h>
+
+#include "server.h"
+#include "ring.h"
+
+/**
+ * pool.h/.c, fixed size pool of worker threads fed accepted connections
+ * through a lock-free ring.
+ */
+
+#define DEFAULT_WORKER_THREADS 16
+#define DEFAULT_WORKER_QUEUE_LENGTH 1024
+
+typedef struct worker_pool {
+    spade_server* server;
+    connection_ring ring;
+    sem_t queued; /* Counts connections waiting in the ring */
+    unsigned int thread_count;
+    pthread_t* threads;
+    unsigned long rejected; /* Connections turned away with a 503 */
+} worker_pool;
+
+/* Allocate the pool's ring and start server->worker_threads workers.
+ *
+ * Modifies server->pool.
+ * Returns 0 if successful.
+ */
+int start_worker_pool(spade_server* server);
+
+/* Queue an accepted connection for the next free worker. If the ring is
+ * full the client is sent a 503 and the socket closed, so the number of
+ * connections being served never grows past the pool.
+ *
+ * Returns 0 if the connection was queued.
+ */
+int submit_connection(worker_pool* pool, int incoming_socket,
+        struct sockaddr_in* client_address);
+
+#endif // _POOL_H_
@@ -0,0 +1,199 @@
+#include "reactor.h"
+
+/* Add a connection that has finished a response to the back of the idle
+ * list. The keep-alive timeout is the same for everyone, so the list stays
+ * ordered by how long each connection has been idle.
+ */
+void mark_idle(reactor* loop, spade_connection* connection) {
+    connection->idle_since = time(NULL);
+    connection->idle_next = NULL;
+    connection->idle_previous = loop->idle_tail;
+    if(loop->idle_tail) {
+        loop->idle_tail->idle_next = connection;
+    } else {
+        loop->idle_head = connection;
+    }
+    loop->idle_tail = connection;
+}
+
+void unmark_idle(reactor* loop, spade_connection* connection) {
+    if(connection->idle_since == 0) {
+        return;
+    }
+    if(connection->idle_previous) {
+        connection->idle_previous->idle_next = connection->idle_next;
+    } else {
+        loop->idle_head = connection->idle_next;
+    }
+    if(connection->idle_next) {
+        connection->idle_next->idle_previous = connection->idle_previous;
+    } else {
+        loop->idle_tail = connection->idle_previous;
+    }
+    connection->idle_since = 0;
+    connection->idle_previous = connection->idle_next = NULL;
+}
+
+void close_reactor_connection(reactor* loop, spade_connection* connection) {
+    unmark_idle(loop, connection);
+    free_connection(connection);
+}
+
+/* Close every connection that has been idle longer than the keep-alive
+ * timeout.
+ */
+void close_idle_connections(reactor* loop) {
+    time_t now = time(NULL);
+    unsigned int timeout = loop->listener->server->idle_timeout;
+    while(loop->idle_head && now - loop->idle_head->idle_since >= timeout) {
+        close_reactor_connection(loop, loop->idle_head);
+    }
+}
+
+/* Stop watching a connection and hand its dynamic request to a thread. */
+void detach_request(reactor* loop, spade_connection* connection) {
+    unmark_idle(loop, connection);
+    epoll_ctl(loop->epoll_descriptor, EPOLL_CTL_DEL, connection->socket,
+            NULL);
+    detach_connection(connection);
+}
+
+/* Advance the connection's state machine as far as it can go without
+ * blocking, serving each batch of pipelined requests in turn on persistent
+ * connections.
+ *
+ * Returns 0 if the connection should stay registered with the reactor, or
+ * -1 if it has been closed or detached.
+ */
+int service_connection(reactor* loop, spade_connection* connection) {
+    while(1) {
+        if(connection->state == CONNECTION_READING) {
+            if(connection_read(connection)) {
+                close_reactor_connection(loop, connection);
+                return -1;
+            }
+            if(!connection_has_request(connection)) {
+                return 0;
+            }
+            unmark_idle(loop, connection);
+            connection_respond(connection);
+        }
+
+        if(connection->state == CONNECTION_WRITING) {
+            int result = connection_write(connection);
+            if(result == 0) {
+                return 0;
+            } else if(result < 0 || !connection_finish_response(connection)) {
+                close_reactor_connection(loop, connection);
+                return -1;
+            }
+            if(connection->state == CONNECTION_READING) {
+                mark_idle(loop, connection);
+            }
+        }
+
+        if(connection->state == CONNECTION_DETACHED) {
+            detach_request(loop, connection);
+            return -1;
+        }
+    }
+}
+
+/* Accept every pending connection on the listening socket and register
+ * them with the reactor.
+ */
+void accept_connections(reactor* loop) {
+    spade_listener* listener = loop->listener;
+    while(1) {
+        struct sockaddr_in client_address;
+        socklen_t sin_size = sizeof(struct sockaddr_in);
+        int message_socket = accept4(listener->socket,
+                (struct sockaddr *) &client_address, &sin_size,
+                SOCK_NONBLOCK);
+        if(message_socket < 0) {
+            if(__atomic_load_n(&listener->server->stopping,
+                        __ATOMIC_ACQUIRE)) {
+                epoll_ctl(loop->epoll_descriptor, EPOLL_CTL_DEL,
+                        listener->socket, NULL);
+                return;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                check_error(message_socket, "accept");
+            }
+            if(errno != EINTR) {
+                return;
+            }
+            continue;
+        }
+        __atomic_add_fetch(&listener->accepted, 1, __ATOMIC_RELAXED);
+
+        spade_connection* connection = create_connection(listener->server,
+                message_socket, &client_address);
+        if(connection == NULL) {
+            close(message_socket);
+            continue;
+        }
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = connection;
+        if(check_error(epoll_ctl(loop->epoll_descriptor, EPOLL_CTL_ADD,
+                        message_socket, &event), "epoll_ctl")) {
+            free_connection(connection);
+            continue;
+        }
+
+        /* Counted as idle until its first request arrives, so clients
+         * that never send one are timed out too. Edge-triggered, so pick
+         * up any request that arrived with the connection.
+         */
+        mark_idle(loop, connection);
+        service_connection(loop, connection);
+    }
+}
+
+void run_reactor(spade_listener* listener) {
+    reactor loop;
+    loop.listener = listener;
+    loop.idle_head = loop.idle_tail = NULL;
+    loop.epoll_descriptor = epoll_create1(0);
+    if(check_error(loop.epoll_descriptor, "epoll_create1")
+            || set_nonblocking(listener->socket, 1)) {
+        return;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL;
+    if(check_error(epoll_ctl(loop.epoll_descriptor, EPOLL_CTL_ADD,
+                    listener->socket, &event), "epoll_ctl")) {
+        close(loop.epoll_descriptor);
+        return;
+    }
+
+    log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+            "Serving listener %d from an epoll event loop", listener->index);
+
+    /* Wake up once a second to time out idle connections */
+    int wait_timeout = 1000;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    while(1) {
+        int ready = epoll_wait(loop.epoll_descriptor, events,
+                REACTOR_MAX_EVENTS, wait_timeout);
+        if(ready < 0 && errno != EINTR) {
+            check_error(ready, "epoll_wait");
+            break;
+        }
+
+        for(int i = 0; i < ready; i++) {
+            if(events[i].data.ptr == NULL) {
+                accept_connections(&loop);
+            } else {
+                service_connection(&loop,
+                        (spade_connection*) events[i].data.ptr);
+            }
+        }
+        close_idle_connections(&loop);
+    }
+    close(loop.epoll_descriptor);
+}
@@ -0,0 +1,35 @@
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+
+#include "server.h"
+#include "connection.h"
+
+/**
+ * reactor.h/.c, edge-triggered epoll event loop serving many connections
+ * from a single thread.
+ */
+
+#define REACTOR_MAX_EVENTS 256
+
+/* State for one listener's event loop */
+typedef struct {
+    spade_listener* listener;
+    int epoll_descriptor;
+    spade_connection* idle_head; /* Persistent connections waiting for */
+    spade_connection* idle_tail; /* their next request, oldest first */
+} reactor;
+
+/* Accept connections and serve static requests with non-blocking I/O on
+ * the listener's socket. Each listener gets its own event loop. Requests
+ * for dynamic handlers are passed to a thread, since CGI, Dirt and Clay
+ * write to the client socket directly. Should never return.
+ *
+ * Requires server to be initialized with initialize_server.
+ */
+void run_reactor(spade_listener* listener);
+
+#endif // _REACTOR_H_
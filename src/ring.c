@@ -0,0 +1,92 @@
+#include <stdlib.h>
+
+#include "ring.h"
+
+int initialize_ring(connection_ring* ring, size_t length) {
+    size_t capacity = 2;
+    while(capacity < length) {
+        capacity <<= 1;
+    }
+
+    ring->cells = malloc(capacity * sizeof(ring_cell));
+    if(ring->cells == NULL) {
+        return -1;
+    }
+    for(size_t i = 0; i < capacity; i++) {
+        ring->cells[i].sequence = i;
+    }
+    ring->mask = capacity - 1;
+    ring->enqueue_position = 0;
+    ring->dequeue_position = 0;
+    return 0;
+}
+
+void free_ring(connection_ring* ring) {
+    free(ring->cells);
+    ring->cells = NULL;
+}
+
+int ring_enqueue(connection_ring* ring, queued_connection* connection) {
+    ring_cell* cell;
+    size_t position = __atomic_load_n(&ring->enqueue_position,
+            __ATOMIC_RELAXED);
+    while(1) {
+        cell = &ring->cells[position & ring->mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        long difference = (long) sequence - (long) position;
+        if(difference == 0) {
+            if(__atomic_compare_exchange_n(&ring->enqueue_position, &position,
+                        position + 1, 1, __ATOMIC_RELAXED,
+                        __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if(difference < 0) {
+            return -1;
+        } else {
+            position = __atomic_load_n(&ring->enqueue_position,
+                    __ATOMIC_RELAXED);
+        }
+    }
+    cell->connection = *connection;
+    __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int ring_dequeue(connection_ring* ring, queued_connection* connection) {
+    ring_cell* cell;
+    size_t position = __atomic_load_n(&ring->dequeue_position,
+            __ATOMIC_RELAXED);
+    while(1) {
+        cell = &ring->cells[position & ring->mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        long difference = (long) sequence - (long) (position + 1);
+        if(difference == 0) {
+            if(__atomic_compare_exchange_n(&ring->dequeue_position, &position,
+                        position + 1, 1, __ATOMIC_RELAXED,
+                        __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if(difference < 0) {
+            return -1;
+        } else {
+            position = __atomic_load_n(&ring->dequeue_position,
+                    __ATOMIC_RELAXED);
+        }
+    }
+    *connection = cell->connection;
+    __atomic_store_n(&cell->sequence, position + ring->mask + 1,
+            __ATOMIC_RELEASE);
+    return 0;
+}
+
+size_t ring_depth(connection_ring* ring) {
+    size_t enqueued = __atomic_load_n(&ring->enqueue_position,
+            __ATOMIC_RELAXED);
+    size_t dequeued = __atomic_load_n(&ring->dequeue_position,
+            __ATOMIC_RELAXED);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
+size_t ring_capacity(connection_ring* ring) {
+    return ring->mask + 1;
+}
@@ -0,0 +1,63 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <netinet/in.h>
+
+/**
+ * ring.h/.c, bounded lock-free multi-producer multi-consumer queue of
+ * accepted connections.
+ *
+ * Each cell carries a sequence number that tells producers and consumers
+ * whether it is free for their lap around the ring, so enqueue and dequeue
+ * only contend on a single compare-and-swap of their position.
+ */
+
+#define CACHE_LINE_SIZE 64
+
+typedef struct {
+    int socket;
+    struct sockaddr_in client_address;
+} queued_connection;
+
+typedef struct {
+    size_t sequence;
+    queued_connection connection;
+} ring_cell;
+
+typedef struct {
+    ring_cell* cells;
+    size_t mask;
+    char enqueue_padding[CACHE_LINE_SIZE];
+    size_t enqueue_position;
+    char dequeue_padding[CACHE_LINE_SIZE];
+    size_t dequeue_position;
+    char end_padding[CACHE_LINE_SIZE];
+} connection_ring;
+
+/* Allocate a ring with room for at least length connections, rounded up to
+ * a power of two.
+ *
+ * Returns 0 if successful.
+ */
+int initialize_ring(connection_ring* ring, size_t length);
+
+void free_ring(connection_ring* ring);
+
+/* Returns 0 if the connection was queued, or -1 if the ring is full. */
+int ring_enqueue(connection_ring* ring, queued_connection* connection);
+
+/* Modifies *connection.
+ * Returns 0 if a connection was dequeued, or -1 if the ring is empty.
+ */
+int ring_dequeue(connection_ring* ring, queued_connection* connection);
+
+/* Returns the approximate number of queued connections. */
+size_t ring_depth(connection_ring* ring);
+
+/* Returns the number of connections the ring can hold. */
+size_t ring_capacity(connection_ring* ring);
+
+#endif // _RING_H_
@@ -0,0 +1,249 @@
+#include "router.h"
+
+route_node* create_route_node(const char* label, size_t length) {
+    route_node* node = calloc(1, sizeof(route_node));
+    if(node == NULL) {
+        return NULL;
+    }
+    node->label = strndup(label, length);
+    if(node->label == NULL) {
+        free(node);
+        return NULL;
+    }
+    node->label_length = length;
+    node->exact.type = node->wildcard.type = ROUTE_STATIC;
+    return node;
+}
+
+route_node* create_route_tree() {
+    return create_route_node("", 0);
+}
+
+void free_route_tree(route_node* root) {
+    if(root == NULL) {
+        return;
+    }
+    for(unsigned int i = 0; i < root->child_count; i++) {
+        free_route_tree(root->children[i]);
+    }
+    free_route_tree(root->parameter);
+    free(root->parameter_name);
+    free(root->children);
+    free(root->indices);
+    free(root->label);
+    free(root);
+}
+
+route_node* find_route_child(route_node* node, char first) {
+    if(node->child_count == 0) {
+        return NULL;
+    }
+    char* index = memchr(node->indices, first, node->child_count);
+    return index ? node->children[index - node->indices] : NULL;
+}
+
+/* Returns 0 if successful, or -1 if out of memory. */
+int add_route_child(route_node* node, route_node* child) {
+    route_node** children = realloc(node->children,
+            (node->child_count + 1) * sizeof(route_node*));
+    if(children == NULL) {
+        return -1;
+    }
+    node->children = children;
+    char* indices = realloc(node->indices, node->child_count + 1);
+    if(indices == NULL) {
+        return -1;
+    }
+    node->indices = indices;
+
+    node->children[node->child_count] = child;
+    node->indices[node->child_count++] = child->label[0];
+    return 0;
+}
+
+/* Split the label on the edge from parent to child after at bytes, with a
+ * new node between them.
+ *
+ * Returns the new node, or NULL if out of memory.
+ */
+route_node* split_route_node(route_node* parent, route_node* child,
+        size_t at) {
+    route_node* middle = create_route_node(child->label, at);
+    if(middle == NULL || add_route_child(middle, child)) {
+        free_route_tree(middle);
+        return NULL;
+    }
+    memmove(child->label, child->label + at, child->label_length - at + 1);
+    child->label_length -= at;
+    middle->indices[0] = child->label[0];
+
+    /* The middle node starts with the same byte, so the index stays */
+    for(unsigned int i = 0; i < parent->child_count; i++) {
+        if(parent->children[i] == child) {
+            parent->children[i] = middle;
+        }
+    }
+    return middle;
+}
+
+/* Returns the number of literal bytes at the start of pattern + offset,
+ * before a ":name" segment or trailing "*".
+ */
+size_t literal_route_length(const char* pattern, size_t offset) {
+    size_t end = offset + 1;
+    while(pattern[end] != '\0'
+            && !(pattern[end] == ':' && pattern[end - 1] == '/')
+            && !(pattern[end] == '*' && pattern[end + 1] == '\0')) {
+        end++;
+    }
+    return end - offset;
+}
+
+/* Returns 0 if successful, or -1 if the slot already has a handler. */
+int set_route_target(route* slot, route* target) {
+    if(slot->type != ROUTE_STATIC) {
+        return -1;
+    }
+    slot->type = target->type;
+    slot->cgi = target->cgi;
+    slot->dirt = target->dirt;
+    slot->clay = target->clay;
+    return 0;
+}
+
+int add_route(route_node* root, const char* pattern, route* target) {
+    route_node* node = root;
+    size_t offset = 0;
+    unsigned int parameter_count = 0;
+    while(pattern[offset] != '\0') {
+        const char* rest = pattern + offset;
+        if(rest[0] == '*' && rest[1] == '\0') {
+            return set_route_target(&node->wildcard, target);
+        } else if(rest[0] == ':' && (offset == 0 || rest[-1] == '/')) {
+            size_t length = strcspn(rest + 1, "/");
+            if(length == 0 || ++parameter_count > MAX_ROUTE_PARAMETERS) {
+                return -1;
+            }
+            if(node->parameter == NULL) {
+                char* name = strndup(rest + 1, length);
+                route_node* child = create_route_node("", 0);
+                if(name == NULL || child == NULL) {
+                    free(name);
+                    free_route_tree(child);
+                    return -1;
+                }
+                node->parameter_name = name;
+                node->parameter = child;
+            } else if(strlen(node->parameter_name) != length
+                    || strncmp(node->parameter_name, rest + 1, length)) {
+                /* Another route names the same segment differently */
+                return -1;
+            }
+            node = node->parameter;
+            offset += length + 1;
+            continue;
+        }
+
+        size_t length = literal_route_length(pattern, offset);
+        while(length > 0) {
+            route_node* child = find_route_child(node, pattern[offset]);
+            if(child == NULL) {
+                child = create_route_node(pattern + offset, length);
+                if(child == NULL || add_route_child(node, child)) {
+                    free_route_tree(child);
+                    return -1;
+                }
+            }
+
+            size_t common = 0;
+            while(common < child->label_length && common < length
+                    && child->label[common] == pattern[offset + common]) {
+                common++;
+            }
+            if(common < child->label_length) {
+                child = split_route_node(node, child, common);
+                if(child == NULL) {
+                    return -1;
+                }
+            }
+            node = child;
+            offset += common;
+            length -= common;
+        }
+    }
+    return set_route_target(&node->exact, target);
+}
+
+/* Match path against the routes below node, trying literal text, then a
+ * parameter, then a wildcard, and backing up to try the next if the first
+ * leads nowhere.
+ *
+ * Returns 1 and fills in found if there's a match.
+ */
+int match_route_node(route_node* node, const char* path, route* found) {
+    if(path[0] == '\0' && node->exact.type != ROUTE_STATIC) {
+        set_route_target(found, &node->exact);
+        found->rest = path;
+        return 1;
+    }
+
+    if(path[0] != '\0') {
+        route_node* child = find_route_child(node, path[0]);
+        if(child && !strncmp(child->label, path, child->label_length)
+                && match_route_node(child, path + child->label_length,
+                    found)) {
+            return 1;
+        }
+
+        size_t length = strcspn(path, "/");
+        if(node->parameter && length > 0) {
+            route_parameter* parameter =
+                &found->parameters[found->parameter_count++];
+            parameter->name = node->parameter_name;
+            parameter->value = path;
+            parameter->length = length;
+            if(match_route_node(node->parameter, path + length, found)) {
+                return 1;
+            }
+            found->parameter_count--;
+        }
+    }
+
+    if(node->wildcard.type != ROUTE_STATIC) {
+        set_route_target(found, &node->wildcard);
+        found->rest = path;
+        return 1;
+    }
+    return 0;
+}
+
+route match_route(route_node* root, const char* path) {
+    route found;
+    found.type = ROUTE_STATIC;
+    found.cgi = NULL;
+    found.dirt = NULL;
+    found.clay = NULL;
+    found.rest = "";
+    found.parameter_count = 0;
+    if(root != NULL) {
+        match_route_node(root, path, &found);
+    }
+    return found;
+}
+
+void format_route_parameters(route* found, char* buf, size_t length) {
+    size_t used = 0;
+    buf[0] = '\0';
+    for(unsigned int i = 0; i < found->parameter_count; i++) {
+        route_parameter* parameter = &found->parameters[i];
+        int written = snprintf(buf + used, length - used, "%s%s=%.*s",
+                i > 0 ? "&" : "", parameter->name, (int) parameter->length,
+                parameter->value);
+        if(written < 0 || used + written >= length) {
+            /* Only pass on whole parameters */
+            buf[used] = '\0';
+            return;
+        }
+        used += written;
+    }
+}
@@ -0,0 +1,97 @@
+#ifndef _ROUTER_H_
+#define _ROUTER_H_
+
+#define _GNU_SOURCE
+
+#include "http.h"
+#include "cgi.h"
+#include "dirt.h"
+#include "clay.h"
+
+/**
+ * router.h/.c, radix tree that maps request paths to dynamic handlers.
+ *
+ * Routes are added once, as the configuration is read. A route's URL is a
+ * pattern made of:
+ *
+ *   - literal text, which must match exactly ("reports/daily")
+ *   - ":name" segments, which match any one non-empty path segment and are
+ *     handed to the handler as parameters ("users/:id/orders")
+ *   - a trailing "*", which matches the rest of the path, if any ("assets*"
+ *     matches "assets", "assets.css" and "assets/css/site.css")
+ *
+ * Literal runs shared by several routes are stored once on the edge into a
+ * node, so a lookup compares each byte of the path about once however many
+ * routes there are. Where more than one kind of route could carry on
+ * matching, literal text wins over a parameter and a parameter over a
+ * wildcard.
+ */
+
+#define MAX_ROUTE_PARAMETERS 8
+
+/* Which kind of handler a request path resolved to */
+typedef enum {
+    ROUTE_STATIC,
+    ROUTE_CGI,
+    ROUTE_DIRT,
+    ROUTE_CLAY
+} route_type;
+
+typedef struct {
+    const char* name;  /* From the route's pattern */
+    const char* value; /* The path segment it matched, not NUL terminated */
+    size_t length;
+} route_parameter;
+
+typedef struct {
+    route_type type;
+    cgi_handler* cgi;
+    dirt_handler* dirt;
+    clay_handler* clay;
+    const char* rest; /* What a trailing "*" matched, or "" */
+    unsigned int parameter_count;
+    route_parameter parameters[MAX_ROUTE_PARAMETERS];
+} route;
+
+typedef struct route_node {
+    char* label;         /* Literal text on the edge into this node */
+    size_t label_length;
+    char* indices;       /* First byte of each literal child's label */
+    struct route_node** children;
+    unsigned int child_count;
+    struct route_node* parameter; /* Child matching a ":name" segment */
+    char* parameter_name;         /* Name of that segment */
+    route exact;    /* Handler for paths that end here */
+    route wildcard; /* Handler for paths that carry on past here */
+} route_node;
+
+/* Create an empty routing tree.
+ *
+ * Returns the root, or NULL if out of memory.
+ */
+route_node* create_route_tree();
+
+void free_route_tree(route_node* root);
+
+/* Add a route for pattern to the tree. Only the handler fields of target
+ * are used.
+ *
+ * Returns 0 if successful, or -1 if the pattern is malformed, clashes with
+ * a route already in the tree or memory ran out.
+ */
+int add_route(route_node* root, const char* pattern, route* target);
+
+/* Find the route for a path without its leading slash. Paths that don't
+ * match any route are sent to static files.
+ *
+ * Returns the route, with any parameters and what a wildcard matched
+ * pointing into path.
+ */
+route match_route(route_node* root, const char* path);
+
+/* Write the route's parameters to buf as "name=value" pairs separated by
+ * '&', like a query string, truncating them to fit in length bytes.
+ */
+void format_route_parameters(route* found, char* buf, size_t length);
+
+#endif // _ROUTER_H_
@@ -0,0 +1,50 @@
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * scan.h/.c, vectorized search for the bytes of a request that the HTTP
+ * parser has to look at.
+ *
+ * Request lines and headers are mostly printable bytes the parser only
+ * steps over. The ones it has to stop for are control characters: line
+ * feeds that end each line, the carriage returns before them and anything
+ * that has no place in a request. The scanners mark those in a bitmask for
+ * a block of 64 bytes at a time, which the parser then walks one set bit
+ * at a time. An AVX2 or SSE2 kernel is picked once the server knows what
+ * CPU it's running on, with a byte at a time fallback for everything else.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HTTP_SCAN_X86
+#endif
+
+#define HTTP_SCAN_BLOCK 64
+
+/* Returns 1 if c is a control character or DEL. */
+#define IS_HTTP_CONTROL(c) ((unsigned char) (c) < 0x20 || (c) == 0x7f)
+
+typedef uint64_t (*http_scanner)(const char* buffer, size_t length);
+
+/* Returns a mask with bit i set if the parser has to look at buffer[i],
+ * for the first length bytes at buffer up to HTTP_SCAN_BLOCK. Starts out as
+ * the scalar kernel until select_http_scanner is called.
+ */
+extern http_scanner find_http_delimiters;
+
+uint64_t find_http_delimiters_scalar(const char* buffer, size_t length);
+#ifdef HTTP_SCAN_X86
+uint64_t find_http_delimiters_sse2(const char* buffer, size_t length);
+uint64_t find_http_delimiters_avx2(const char* buffer, size_t length);
+#endif
+
+/* Point find_http_delimiters at the widest kernel this CPU supports. Call
+ * before starting any threads.
+ *
+ * Returns the name of the kernel, for logging.
+ */
+const char* select_http_scanner();
+
+#endif // _SCAN_H_
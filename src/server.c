@@ -1,28 +1,31 @@
 #include "server.h"
+#include "reactor.h"
+#include "pool.h"
+#include "uring.h"
+#include "stats.h"
+#include "cgipool.h"
 
-void return_client_error(int incoming_socket, char *cause, char* status_code,
-        char *shortmsg, char *longmsg);
 int return_response_headers(int incoming_socket, char* status_code,
         char* message, char* body, char* content_type, int length,
-        int close_headers);
+        int keep_alive, int close_headers);
 void serve_cgi(spade_server* server, http_request* request,
-        int incoming_socket, cgi_handler* handler);
+        int incoming_socket, route* found);
 void serve_dirt(spade_server* server, http_request* request,
-        int incoming_socket, dirt_handler* handler);
+        int incoming_socket, route* found);
 int serve_clay(spade_server* server, http_request* request,
-        int incoming_socket, clay_handler* handler);
+        int incoming_socket, route* found);
 void serve_static(spade_server* server, http_request* request,
         int incoming_socket);
-int handle_get(spade_server* server, int incoming_socket,
-        http_request* request);
 void resolve_hostname(char* hostname, struct sockaddr_in* client_address);
+void start_cgi_pools(spade_server* server);
 
-/* Initialize socket for proxy server to listen on.
+/* Open a socket for the server to listen on. With reuse_port, several
+ * sockets can bind the same port and the kernel spreads new connections
+ * between them.
  *
- * Modifies server->socket.
- * Returns 0 if sucessful.
+ * Returns the listening socket, or a negative number if an error.
  */
-int initialize_listen_socket(spade_server* server) {
+int open_listen_socket(spade_server* server, int reuse_port) {
     int result;
     int on = 1;
     char port[MAX_PORT_LENGTH];
@@ -42,31 +45,61 @@ int initialize_listen_socket(spade_server* server) {
         return result;
     }
 
-    server->socket =
+    int listen_socket =
         socket(serv->ai_family, serv->ai_socktype, serv->ai_protocol);
-    if(check_error(server->socket, "socket")) {
-        return server->socket;
+    if(check_error(listen_socket, "socket")) {
+        freeaddrinfo(serv);
+        return listen_socket;
     }
 
-    result = setsockopt(server->socket, SOL_SOCKET,
+    result = setsockopt(listen_socket, SOL_SOCKET,
                             SO_REUSEADDR, &on, sizeof(on));
-    if(check_error(result, "setsockopt")) {
+    if(!check_error(result, "setsockopt") && reuse_port) {
+        result = setsockopt(listen_socket, SOL_SOCKET,
+                SO_REUSEPORT, &on, sizeof(on));
+        check_error(result, "setsockopt");
+    }
+    if(result < 0) {
         freeaddrinfo(serv);
+        close(listen_socket);
         return result;
     }
 
-    result = bind(server->socket, serv->ai_addr, serv->ai_addrlen);
+    result = bind(listen_socket, serv->ai_addr, serv->ai_addrlen);
     if(check_error(result, "bind")) {
         freeaddrinfo(serv);
+        close(listen_socket);
         return result;
     }
     freeaddrinfo(serv);
 
-    result = listen(server->socket, MAX_CONNECTION_QUEUE);
+    result = listen(listen_socket, MAX_CONNECTION_QUEUE);
     if(check_error(result, "listen")) {
+        close(listen_socket);
         return result;
     }
 
+    return listen_socket;
+}
+
+/* Initialize the sockets for the server to listen on, one per listener.
+ *
+ * Modifies server->listeners, server->socket.
+ * Returns 0 if sucessful.
+ */
+int initialize_listen_sockets(spade_server* server) {
+    int reuse_port = server->listener_count > 1;
+    for(unsigned int i = 0; i < server->listener_count; i++) {
+        spade_listener* listener = &server->listeners[i];
+        listener->server = server;
+        listener->index = i;
+        listener->accepted = 0;
+        listener->socket = open_listen_socket(server, reuse_port);
+        if(listener->socket < 0) {
+            return -1;
+        }
+    }
+    server->socket = server->listeners[0].socket;
     return 0;
 }
 
@@ -77,129 +110,132 @@ int initialize_server(spade_server* server) {
 
     set_static_cgi_environment(server);
 
-    if(initialize_listen_socket(server)) {
+    if(check_error(pipe2(server->shutdown_pipe, O_CLOEXEC), "pipe2")) {
+        return -1;
+    }
+    server->stopping = 0;
+    if(initialize_listen_sockets(server)) {
         return -1;
     }
 
+    log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+            "Scanning request headers with the %s kernel",
+            select_http_scanner());
+
     log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
             "Starting server on port %d, serving files frome %s",
             server->port, server->static_file_path);
     return 0;
 }
 
-/* Read a line from the rio buffer. Just a wrapper to read the line, print
- * a log statement and check that it ends in a newline if necessary.
- *
- * Modifies rio, buf.
- * Returns the number of bytes read, or a negative number if an error.
- */
-int read_line(rio_t* rio, char* buf, spade_server* server) {
-    int bytes_read = rio_readlineb(rio, buf, MAXLINE);
-    if(bytes_read > 0 && buf[bytes_read - 1] != '\n') {
-        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_WARN,
-                "HTTP request line:\n%s with length %d longer than MAXLINE %d",
-                buf, bytes_read, MAXLINE);
+void log_http_request(http_request* request) {
+    if(request->message.valid) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_DEBUG,
+                "%s /%s", http_method_to_string(request->method),
+                http_request_string(request, request->uri.path));
     }
-    return bytes_read;
 }
 
-/* Read HTTP headers from the rio buffer until CRLF is found or there are no
- * more bytes read.
- *
- * Only stores valid headers.
- *
- * Modifies rio, message.
- */
-void read_http_headers(rio_t* rio, http_message* message,
-        spade_server* server) {
-    if(rio->rio_cnt) {
-        char header_string[MAXLINE];
-        int bytes_read = read_line(rio, header_string, server);
-        http_header header;
-        while(bytes_read > 0 && header_string[0] != '\n'
-                && header_string[0] != '\r') {
-            parse_http_header(&header, header_string);
-            if(header.valid) {
-                message->headers[message->header_count++] = header;
-                bytes_read = read_line(rio, header_string, server);
-            }
+int read_http_request(rio_t* rio, http_request* request) {
+    http_parser parser;
+    init_http_parser(&parser, request);
+    while(!parse_http_request(&parser, request, rio->rio_bufptr,
+                rio->rio_cnt)) {
+        /* Slide the partial request to the front to make room for more */
+        if(rio->rio_bufptr != rio->rio_buf) {
+            memmove(rio->rio_buf, rio->rio_bufptr, rio->rio_cnt);
+            rio->rio_bufptr = rio->rio_buf;
+        }
+        if(rio->rio_cnt == RIO_BUFSIZE) {
+            log4c_category_log(log4c_category_get("spade"),
+                    LOG4C_PRIORITY_WARN,
+                    "Request headers on socket %d longer than %d bytes",
+                    rio->rio_fd, RIO_BUFSIZE);
+            return -1;
         }
-    }
-}
 
-/* Read the HTTP response status line from the rio buffer.
- * Returns the parsed HTTP response, which may or may not be have
- * response.valid.
- *
- * Modifies rio.
- */
-http_response read_http_response(rio_t* rio, spade_server* server) {
-    char message_string[MAXLINE];
-    http_response response;
-    response.message.valid = 0;
-    if(read_line(rio, message_string, server) > 0) {
-        response = parse_http_response(message_string);
-        read_http_headers(rio, &response.message, server);
+        ssize_t bytes_read = read(rio->rio_fd, rio->rio_buf + rio->rio_cnt,
+                RIO_BUFSIZE - rio->rio_cnt);
+        if(bytes_read < 0 && errno == EINTR) {
+            continue;
+        } else if(bytes_read <= 0) {
+            return -1;
+        }
+        rio->rio_cnt += bytes_read;
     }
-    return response;
+
+    rio->rio_bufptr += request->length;
+    rio->rio_cnt -= request->length;
+    log_http_request(request);
+    return 0;
 }
 
-/* Read the HTTP request from the rio buffer, including any headers.
- *
- * Does not read content following the headers.
- *
- * Modifies rio.
- * Returns the parsed request, which may or may not have request.valid.
- */
-http_request read_http_request(rio_t* rio, spade_server* server) {
-    http_request request;
-    request.message.valid = 0;
-    char message_string[MAXLINE];
-    if(read_line(rio, message_string, server) > 0) {
-        char stripped_message_string[MAXLINE];
-        strcpy(stripped_message_string, message_string);
-        strstr(stripped_message_string, "\r\n")[0] = '\0';
-        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_DEBUG,
-                "%s", stripped_message_string);
-        request = parse_http_request(message_string);
-        read_http_headers(rio, &request.message, server);
-    }
-    return request;
+int should_keep_alive(spade_server* server, http_request* request,
+        unsigned int requests_served) {
+    return server->keep_alive_timeout > 0
+        && requests_served < server->keep_alive_max_requests
+        && request->method == HTTP_METHOD_GET
+        && http_request_wants_keep_alive(request);
 }
 
-/* Receiving thread primary function. Receives client request and any content,
- * generates a response and returns it back to the client.
- *
- */
 void receive(receive_args* args) {
     rio_t rio_client;
     rio_readinitb(&rio_client, args->incoming_socket);
-    http_request request = read_http_request(&rio_client, args->server);
-    request.remote_host[0] = '\0';
-    request.remote_address[0] = '\0';
-    if(args->server->do_reverse_lookups) {
-        resolve_hostname(request.remote_host, &args->client_address);
-    }
+    serve_connection_requests(args->server, &rio_client,
+            &args->client_address, 0);
+}
+
+void serve_connection_requests(spade_server* server, rio_t* rio_client,
+        struct sockaddr_in* client_address, unsigned int requests_served) {
+    int incoming_socket = rio_client->rio_fd;
+
+    /* Don't let clients that go quiet, before their first request or
+     * between persistent ones, hold this thread
+     */
+    struct timeval timeout;
+    timeout.tv_sec = server->idle_timeout;
+    timeout.tv_usec = 0;
+    setsockopt(incoming_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+            sizeof(timeout));
 
     int close_socket = 1;
-    if(request.message.valid) {
+    while(1) {
+        http_request request;
+        if(read_http_request(rio_client, &request)
+                || !request.message.valid) {
+            break;
+        }
+        request.remote_host[0] = '\0';
+        request.remote_address[0] = '\0';
+        if(server->do_reverse_lookups) {
+            resolve_hostname(request.remote_host, client_address);
+        }
+        request.keep_alive = should_keep_alive(server, &request,
+                ++requests_served);
+
         switch(request.method) {
             case HTTP_METHOD_GET:
-                close_socket = handle_get(args->server, args->incoming_socket,
+                close_socket = handle_get(server, incoming_socket,
                         &request);
                 break;
             default:
-                return_client_error(args->incoming_socket,
+                request.keep_alive = 0;
+                return_client_error(incoming_socket,
                         http_method_to_string(request.method),
                         "501",
                         "Not Implemented",
                         "Spade does not implement this method");
         }
+
+        if(close_socket == 0 || !request.keep_alive) {
+            break;
+        }
     }
+
     log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_TRACE,
-            "closing socket %d", args->incoming_socket);
+            "closing socket %d", incoming_socket);
     if(close_socket == 1) {
-        close(args->incoming_socket);
+        close(incoming_socket);
     }
 }
 
@@ -216,37 +252,32 @@ void resolve_hostname(char* hostname, struct sockaddr_in* client_address) {
     }
 }
 
+route find_route(spade_server* server, http_request* request) {
+    return match_route(server->routes,
+            http_request_string(request, request->uri.path));
+}
+
 int handle_get(spade_server* server, int incoming_socket,
         http_request* request) {
-    for (int i = 0; i < server->cgi_handler_count; i++) {
-        if(!strcmp(server->cgi_handlers[i].path, request->uri.path)) {
+    route found = find_route(server, request);
+    switch(found.type) {
+        case ROUTE_CGI:
             log4c_category_log(log4c_category_get("spade"),
                     LOG4C_PRIORITY_DEBUG,
                     "Serving request for path '%s' with CGI handler %s'",
-                    request->uri.path, server->cgi_handlers[i].handler);
-            serve_cgi(server, request, incoming_socket,
-                    &server->cgi_handlers[i]);
+                    http_request_string(request, request->uri.path),
+                    found.cgi->handler);
+            serve_cgi(server, request, incoming_socket, &found);
             return 1;
-        }
-    }
-
-    for (int i = 0; i < server->dirt_handler_count; i++) {
-        if(!strcmp(server->dirt_handlers[i].path, request->uri.path)) {
-            serve_dirt(server, request, incoming_socket,
-                    &server->dirt_handlers[i]);
+        case ROUTE_DIRT:
+            serve_dirt(server, request, incoming_socket, &found);
+            return 1;
+        case ROUTE_CLAY:
+            return serve_clay(server, request, incoming_socket, &found);
+        default:
+            serve_static(server, request, incoming_socket);
             return 1;
-        }
-    }
-
-    for (int i = 0; i < server->clay_handler_count; i++) {
-        if(!strcmp(server->clay_handlers[i].path, request->uri.path)) {
-            return serve_clay(server, request, incoming_socket,
-                    &server->clay_handlers[i]);
-        }
     }
-
-    serve_static(server, request, incoming_socket);
-    return 1;
 }
 
 /* Helper function for new threads */
@@ -258,17 +289,42 @@ void* receive_helper(void* args) {
     return 0;
 }
 
-void run_server(spade_server* server) {
-    pthread_t receive_thread;
-    signal(SIGPIPE, SIG_IGN);
+/* Accept connections on the listener's socket and hand each one to the
+ * configured concurrency model. Should never return.
+ */
+void run_listener(spade_listener* listener) {
+    spade_server* server = listener->server;
+    if(server->concurrency_model == CONCURRENCY_MODEL_EPOLL) {
+        run_reactor(listener);
+        return;
+    } else if(server->concurrency_model == CONCURRENCY_MODEL_URING) {
+        if(!run_uring(listener)) {
+            return;
+        }
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_WARN,
+                "Falling back to a thread per connection on listener %d",
+                listener->index);
+    }
 
+    pthread_t receive_thread;
     struct sockaddr_in client_address;
     socklen_t sin_size = sizeof(struct sockaddr_in);
 
     while(1) {
-        int message_socket = accept(server->socket,
+        int message_socket = accept(listener->socket,
                 (struct sockaddr *) &client_address, &sin_size);
-        if(!check_error(message_socket, "accept")) {
+        if(message_socket < 0
+                && __atomic_load_n(&server->stopping, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+        if(check_error(message_socket, "accept")) {
+            continue;
+        }
+        __atomic_add_fetch(&listener->accepted, 1, __ATOMIC_RELAXED);
+
+        if(server->pool != NULL) {
+            submit_connection(server->pool, message_socket, &client_address);
+        } else {
             receive_args* args = malloc(sizeof(receive_args));
             args->server = server;
             args->incoming_socket = message_socket;
@@ -279,102 +335,185 @@ void run_server(spade_server* server) {
     }
 }
 
-void shutdown_server(spade_server* server) {
+/* Helper function for listener threads */
+void* listener_helper(void* listener) {
+    signal(SIGPIPE, SIG_IGN);
+    run_listener((spade_listener*) listener);
+    return 0;
 }
 
-void* clay_receive_helper(void* socket) {
+void run_server(spade_server* server) {
     signal(SIGPIPE, SIG_IGN);
+    start_stats_thread(server);
+    start_dirt_watcher(server);
+    start_cgi_pools(server);
 
-    while(1) {
-        zmq_msg_t msg;
-        zmq_msg_init (&msg);
-        clay_response response;
-        zmq_recv(socket, &msg, 0);
-        memcpy(&response, zmq_msg_data(&msg), zmq_msg_size(&msg));
-        rio_writen(response.incoming_socket, response.response,
-                response.response_length);
-        close(response.incoming_socket);
-        zmq_msg_close(&msg);
+    if(server->cache_size > 0) {
+        server->cache = create_cache(server->cache_size,
+                server->cache_max_file_size);
+    }
+
+    if(server->concurrency_model == CONCURRENCY_MODEL_POOL
+            && start_worker_pool(server)) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Unable to start the worker pool");
+        return;
+    }
+
+    for(unsigned int i = 0; i < server->listener_count; i++) {
+        if(pthread_create(&server->listeners[i].thread, &server->thread_attr,
+                    listener_helper, &server->listeners[i])) {
+            log4c_category_log(log4c_category_get("spade"),
+                    LOG4C_PRIORITY_ERROR,
+                    "Unable to start accept thread for listener %d", i);
+        }
+    }
+
+    /* This thread only waits to be told to stop */
+    char byte;
+    while(read(server->shutdown_pipe[0], &byte, 1) < 0 && errno == EINTR);
+    log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+            "Shutting down");
+
+    /* Shutting a listening socket down wakes up whatever is accepting on
+     * it, which sees stopping and gives up
+     */
+    __atomic_store_n(&server->stopping, 1, __ATOMIC_RELEASE);
+    for(unsigned int i = 0; i < server->listener_count; i++) {
+        shutdown(server->listeners[i].socket, SHUT_RDWR);
+    }
+}
+
+void request_server_shutdown(spade_server* server) {
+    int saved_errno = errno;
+    char byte = 0;
+    ssize_t written = write(server->shutdown_pipe[1], &byte, 1);
+    (void) written;
+    errno = saved_errno;
+}
+
+void shutdown_server(spade_server* server) {
+    for(unsigned int i = 0; i < server->dirt_handler_count; i++) {
+        close_dirt_handler(&server->dirt_handlers[i]);
+    }
+    if(wait_for_dirt_libraries(DIRT_SHUTDOWN_WAIT)) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_WARN,
+                "Gave up waiting for requests still running in Dirt "
+                "handlers after %d seconds", DIRT_SHUTDOWN_WAIT);
+    }
+}
+
+/* Start the persistent workers of CGI handlers that have them. */
+void start_cgi_pools(spade_server* server) {
+    for(unsigned int i = 0; i < server->cgi_handler_count; i++) {
+        cgi_pool* pool = server->cgi_handlers[i].pool;
+        if(pool != NULL) {
+            log4c_category_log(log4c_category_get("spade"),
+                    LOG4C_PRIORITY_INFO,
+                    "Started %u of %u CGI workers for '%s'",
+                    start_cgi_pool(pool), pool->size, pool->program);
+        }
     }
+}
 
+/* Add a route for a handler's URL pattern to the server's routing tree.
+ *
+ * Returns 0 if successful, or -1 if the pattern can't be added.
+ */
+int add_handler_route(spade_server* server, const char* path,
+        route* target) {
+    if(server->routes == NULL && (server->routes = create_route_tree())
+            == NULL) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Unable to allocate the routing tree: %s", strerror(errno));
+        return -1;
+    }
+    if(add_route(server->routes, path, target)) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "URL pattern '%s' is malformed or clashes with another "
+                "handler's -- not adding handler", path);
+        return -1;
+    }
     return 0;
 }
 
 int register_clay_handler(spade_server* server, const char* path,
         const char* endpoint){
-    clay_handler handler;
-    strcpy(handler.path, path);
-    strcpy(handler.endpoint, endpoint);
+    /* The handler's lock can't be copied, so it's set up in place */
+    clay_handler* handler = &server->clay_handlers[server->clay_handler_count];
+    memset(handler, 0, sizeof(clay_handler));
+    strcpy(handler->path, path);
+    strcpy(handler->endpoint, endpoint);
 
     if(server->zmq_context == NULL) {
         server->zmq_context = zmq_init(ZMQ_THREAD_POOL_SIZE);
     }
 
-    if(NULL == (handler.socket =
-                zmq_socket(server->zmq_context, ZMQ_PAIR))) {
+    if(NULL == (handler->socket =
+                zmq_socket(server->zmq_context, ZMQ_ROUTER))) {
         log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_WARN,
                 "Failed to create socket for context %s: %s",
                 server->zmq_context, strerror(errno));
         return -1;
     }
 
+    route target = { .type = ROUTE_CLAY, .clay = handler };
+    if(add_handler_route(server, path, &target)) {
+        zmq_close(handler->socket);
+        return -1;
+    }
+
     log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
-            "Binding handler PAIR socket %s with identity: %s",
-            handler.socket, handler.endpoint);
+            "Binding handler ROUTER socket to %s", handler->endpoint);
 
-    int rc = zmq_bind(handler.socket, handler.endpoint);
+    int rc = zmq_bind(handler->socket, handler->endpoint);
     while(rc != 0) {
         sleep(1);
         log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_WARN,
                 "Failed to bind send socket trying again for %s: %s",
-                handler.endpoint, strerror(errno));
-        rc = zmq_bind(handler.socket, handler.endpoint);
+                handler->endpoint, strerror(errno));
+        rc = zmq_bind(handler->socket, handler->endpoint);
     }
 
-    pthread_create(&handler.receive_thread, &server->thread_attr,
-            clay_receive_helper, handler.socket);
+    pthread_mutex_init(&handler->lock, NULL);
+    if(start_clay_dispatcher(handler, &server->thread_attr)) {
+        /* The route stays, so the slot does too; with no backends ever
+         * connected its requests get a 503
+         */
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Unable to start the dispatch thread for %s",
+                handler->endpoint);
+        server->clay_handler_count++;
+        return -1;
+    }
 
-    server->clay_handlers[server->clay_handler_count] = handler;
     server->clay_handler_count++;
     return 0;
 }
 
 int register_dirt_handler(spade_server* server, const char* path,
         const char* function, const char* library){
-    dirt_handler handler;
-    strcpy(handler.path, path);
-
     char file_path[MAX_PATH_LENGTH];
-    sprintf(file_path, "%s/%s", server->dirt_file_path, library);
+    snprintf(file_path, MAX_PATH_LENGTH, "%s/%s", server->dirt_file_path,
+            library);
 
-    struct stat sbuf;
-    if(stat(file_path, &sbuf) < 0) {
+    /* The handler's lock can't be copied, so it's loaded in place */
+    dirt_handler* handler = &server->dirt_handlers[server->dirt_handler_count];
+    strcpy(handler->path, path);
+    if(open_dirt_handler(handler, file_path, function)) {
         log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
-                "Couldn't find the shared library '%s' -- not adding handler",
-                file_path);
+                "Not adding Dirt handler '%s' for URL pattern '%s'",
+                function, path);
+        return -1;
+    }
+
+    route target = { .type = ROUTE_DIRT, .dirt = handler };
+    if(add_handler_route(server, path, &target)) {
+        release_dirt_library(handler->library);
+        pthread_mutex_destroy(&handler->lock);
         return -1;
-    } else {
-        void* library_handle = dlopen(file_path, RTLD_NOW);
-        if (!library_handle) {
-            log4c_category_log(log4c_category_get("spade"),
-                    LOG4C_PRIORITY_ERROR,
-                    "Couldn't load the shared library '%s' -- not adding handler: %s",
-                    file_path, dlerror());
-            return -1;
-        }
-        handler.handler = dlsym(library_handle, function);
-        char* error;
-        if((error = dlerror()) != NULL) {
-            log4c_category_log(log4c_category_get("spade"),
-                    LOG4C_PRIORITY_ERROR,
-                    "Couldn't find the function '%s' in the shared library '%s' -- not adding handler: %s",
-                    function, file_path, error);
-            return -1;
-        } else {
-            server->dirt_handlers[server->dirt_handler_count] = handler;
-            server->dirt_handler_count++;
-        }
     }
+    server->dirt_handler_count++;
     return 0;
 }
 
@@ -397,6 +536,20 @@ int register_cgi_handler(spade_server* server, const char* path,
                     "Couldn't run the handler file '%s' -- not adding handler",
                     handler.handler);
             return -1;
+        }
+        handler.pool = NULL;
+        if(server->cgi_workers > 0) {
+            handler.pool = create_cgi_pool(handler.handler,
+                    server->cgi_workers, server->cgi_worker_spawn_rate,
+                    server->cgi_worker_max_requests);
+            if(handler.pool == NULL) {
+                return -1;
+            }
+        }
+        route target = { .type = ROUTE_CGI,
+            .cgi = &server->cgi_handlers[server->cgi_handler_count] };
+        if(add_handler_route(server, path, &target)) {
+            return -1;
         } else {
             server->cgi_handlers[server->cgi_handler_count] = handler;
             server->cgi_handler_count++;
@@ -405,156 +558,471 @@ int register_cgi_handler(spade_server* server, const char* path,
     return 0;
 }
 
+/* Write a static response's headers and then its body, or the given
+ * ranges of it, from the cached data if there is any or else from file.
+ * Several ranges are sent as the parts of a multipart/byteranges body.
+ *
+ * Returns 0 if successful, or -1 if a write failed.
+ */
+int send_static_response(int incoming_socket, char* headers,
+        size_t header_length, static_file* file, char* data, int descriptor,
+        size_t length, byte_range* ranges, int range_count) {
+    char part_headers[MAX_BYTE_RANGES][MAX_PART_HEADER_LENGTH];
+    struct iovec iovecs[MAX_BYTE_RANGES * 2 + 2];
+    iovecs[0].iov_base = headers;
+    iovecs[0].iov_len = header_length;
+    int count = 1;
+
+    byte_range whole = {0, length - 1};
+    int parts = range_count > 0 ? range_count : length > 0;
+    for(int i = 0; i < parts; i++) {
+        byte_range* range = range_count > 0 ? &ranges[i] : &whole;
+        size_t range_length = range->last - range->first + 1;
+        if(range_count > 1) {
+            iovecs[count].iov_base = part_headers[i];
+            iovecs[count++].iov_len = format_part_header(part_headers[i],
+                    file, length, range);
+        }
+        if(data) {
+            iovecs[count].iov_base = data + range->first;
+            iovecs[count++].iov_len = range_length;
+        } else {
+            if(writev_all(incoming_socket, iovecs, count)
+                    || send_file_all(incoming_socket, descriptor,
+                        range->first, range_length)) {
+                return -1;
+            }
+            count = 0;
+        }
+    }
+    if(range_count > 1) {
+        iovecs[count].iov_base = BYTERANGES_END;
+        iovecs[count++].iov_len = strlen(BYTERANGES_END);
+    }
+    return writev_all(incoming_socket, iovecs, count);
+}
+
 /*
  * serve_static - copy a file back to the client
  */
 void serve_static(spade_server* server, http_request* request,
         int incoming_socket) {
 
-    char file_path[MAX_PATH_LENGTH];
-    sprintf(file_path, "%s/%s", server->static_file_path, request->uri.path);
-
-    struct stat sbuf;
-    if(stat(file_path, &sbuf) < 0) {
-        return_client_error(incoming_socket, request->uri.path, "404",
+    static_file file;
+    int status = resolve_static_file(server, request, &file);
+    if(status != 0) {
+        request->keep_alive = 0;
+    }
+    if(status == 404) {
+        return_client_error(incoming_socket,
+                http_request_string(request, request->uri.path), "404",
                 "Not found", "Spade couldn't find this file");
         return;
+    } else if(status == 403) {
+        return_client_error(incoming_socket,
+                http_request_string(request, request->uri.path), "403",
+                "Forbidden", "Spade couldn't read the file");
+        return;
+    }
+
+    char headers[MAXLINE];
+    int header_length;
+    cache_entry* entry;
+    if(prepare_static_file(server, request, &file, 0, &entry)) {
+        header_length = format_not_modified_response_headers(headers,
+                &file, request->keep_alive);
+        if(write_response(incoming_socket, headers, header_length, NULL, 0)) {
+            request->keep_alive = 0;
+        }
+        return;
     }
 
-    if(S_ISDIR(sbuf.st_mode)) {
-        strcat(file_path, "index.html");
-        if(stat(file_path, &sbuf) < 0) {
-            return_client_error(incoming_socket, request->uri.path, "404",
-                    "Not found", "Spade couldn't find this file");
+    int file_descriptor = -1;
+    if(entry == NULL) {
+        file_descriptor = open(file.path, O_RDONLY, 0);
+        if(check_error(file_descriptor, "serve_static")) {
+            request->keep_alive = 0;
+            return_client_error(incoming_socket, strerror(errno), "500",
+                    "Internal Server Error", "Spade crashed and burned.");
             return;
         }
     }
 
-    if(!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-        return_client_error(incoming_socket, request->uri.path, "403",
-                "Forbidden", "Spade couldn't read the file");
-        return;
+    size_t length = entry ? entry->length : (size_t) file.sbuf.st_size;
+    byte_range ranges[MAX_BYTE_RANGES];
+    int range_count = find_static_ranges(request, &file, length, ranges);
+    if(range_count < 0) {
+        header_length = format_range_not_satisfiable_headers(headers, &file,
+                length, request->keep_alive);
+        range_count = length = 0;
+    } else if(range_count > 0) {
+        header_length = format_partial_response_headers(headers, &file,
+                length, ranges, range_count, request->keep_alive);
+    } else if(entry) {
+        header_length = format_cached_response_headers(headers, entry,
+                request->keep_alive);
+    } else {
+        header_length = format_static_response_headers(headers, &file,
+                length, request->keep_alive);
     }
 
-    int file_descriptor = open(file_path, O_RDONLY, 0);
-    if(check_error(file_descriptor, "serve_static")) {
-        return_client_error(incoming_socket, strerror(errno), "500",
-                "Internal Server Error", "Spade crashed and burned.");
-        return;
+    if(file_descriptor >= 0) {
+        /* Hold the headers back until they can share a packet with the
+         * body
+         */
+        set_cork(incoming_socket, 1);
+    }
+    if(send_static_response(incoming_socket, headers, header_length, &file,
+                entry ? entry->data : NULL, file_descriptor, length, ranges,
+                range_count)) {
+        check_error(-1, "serve_static");
+        request->keep_alive = 0;
     }
 
-    char content_type[MAXLINE];
-    get_filetype(file_path, content_type);
-    if(-1 != return_response_headers(incoming_socket, "200", "OK", NULL,
-                content_type, sbuf.st_size, 1)) {
-        char *srcp;
-        srcp = mmap(0, sbuf.st_size, PROT_READ, MAP_PRIVATE, file_descriptor,
-                0);
+    if(entry) {
+        cache_release(server->cache, entry);
+    } else {
+        set_cork(incoming_socket, 0);
         close(file_descriptor);
-        if(srcp != (void*)-1) {
-            rio_writen(incoming_socket, srcp, sbuf.st_size);
-            munmap(srcp, sbuf.st_size);
-        }
     }
 }
 
 void serve_dirt(spade_server* server, http_request* request,
-        int incoming_socket, dirt_handler* handler) {
+        int incoming_socket, route* found) {
     log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_DEBUG,
             "Handling request with a Dirt handler");
-    if(-1 != return_response_headers(incoming_socket, "200", "OK", NULL, NULL,
-                0, 0)) {
-        (*handler->handler)(incoming_socket,
-                build_dirt_variables(server, request, handler));
+    char path_parameters[MAX_DIRT_PARAMETER_LENGTH];
+    format_route_parameters(found, path_parameters, MAX_DIRT_PARAMETER_LENGTH);
+
+    /* Holds the library's current version until its response is sent */
+    dirt_library* library = acquire_dirt_library(found->dirt);
+    void* thread_context;
+    if(library == NULL || get_dirt_thread_context(library, &thread_context)) {
+        if(library != NULL) {
+            release_dirt_library(library);
+        }
+        request->keep_alive = 0;
+        return_client_error(incoming_socket,
+                http_request_string(request, request->uri.path), "503",
+                "Service unavailable", "Spade couldn't start the Dirt handler");
+        return;
     }
-}
 
-void free_data(void* data, void* hint) {
-    if(hint) {
-        free(hint);
+    if(library->version == 2) {
+        dirt_request view;
+        dirt_header headers[HTTP_HEADER_LIST_LENGTH];
+        build_dirt_request(server, request, found->dirt, path_parameters,
+                &view, headers);
+        view.context = library->context;
+        view.thread_context = thread_context;
+        dirt_response response;
+        init_dirt_response(&response);
+        (*library->handler_v2)(&view, &response);
+
+        if(send_dirt_response(incoming_socket, &response,
+                    request->keep_alive)) {
+            request->keep_alive = 0;
+        }
+        free_dirt_response(&response);
+        /* Only once the response is out, so shutdown waits for it */
+        release_dirt_library(library);
+        return;
+    }
+
+    /* The handler writes its own headers and body, so the length of the
+     * response isn't known.
+     */
+    request->keep_alive = 0;
+    if(-1 != return_response_headers(incoming_socket, "200", "OK", NULL, NULL,
+                0, 0, 0)) {
+        dirt_variables variables = build_dirt_variables(server, request,
+                found->dirt);
+        strcpy(variables.path_parameters, path_parameters);
+        (*library->handler)(incoming_socket, variables);
     }
+    release_dirt_library(library);
 }
 
+/* Pass a request to a Clay handler's dispatch thread, which sends it to a
+ * backend and writes the status line and response.
+ *
+ * Returns 0 if the dispatch thread now owns incoming_socket, or 1 if the
+ * caller should close it.
+ */
 int serve_clay(spade_server* server, http_request* request,
-        int incoming_socket, clay_handler* handler) {
+        int incoming_socket, route* found) {
     log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_DEBUG,
             "Handling request with a Clay handler");
-    int rc = 0;
-    zmq_msg_t msg;
-    if(-1 != return_response_headers(incoming_socket, "200", "OK", NULL, NULL,
-                0, 0)) {
-        clay_variables variables = build_clay_variables(server, request,
-                handler, incoming_socket);
+    /* The Clay dispatch thread closes the socket once it has replied */
+    request->keep_alive = 0;
+    if(!clay_backends_connected(found->clay)) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_WARN,
+                "No Clay backends are connected to '%s'",
+                found->clay->endpoint);
+        return_client_error(incoming_socket,
+                http_request_string(request, request->uri.path), "503",
+                "Service unavailable",
+                "Spade couldn't connect to the Clay daemon");
+        return 1;
+    }
 
-        if(0 != (rc = zmq_msg_init(&msg))) {
-            log4c_category_log(log4c_category_get("spade"),
-                    LOG4C_PRIORITY_ERROR,
-                    "Failed to initialize 0mq message to send.");
-            return_client_error(incoming_socket, request->uri.path, "503",
-                    "Service unavailable",
-                    "Spade couldn't connect to the Clay daemon");
-            return -1;
+    /* The dispatch thread sends the status line once a backend has the
+     * request, so failures until then can still be answered properly
+     */
+    char path_parameters[MAX_CLAY_PARAMETER_LENGTH];
+    format_route_parameters(found, path_parameters,
+            MAX_CLAY_PARAMETER_LENGTH);
+    uint64_t id = next_clay_request_id(found->clay);
+    clay_encoder encoder;
+    if(encode_clay_variables(server, request, found->clay, path_parameters,
+                found->rest, id, &encoder)) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
+                "Unable to encode a request for a Clay backend");
+        return_client_error(incoming_socket,
+                http_request_string(request, request->uri.path), "500",
+                "Internal Server Error",
+                "Spade couldn't pass the request to the Clay daemon");
+        return 1;
+    }
+    if(submit_clay_request(found->clay, incoming_socket, id, encoder.data,
+                encoder.length)) {
+        free(encoder.data);
+        return_client_error(incoming_socket,
+                http_request_string(request, request->uri.path), "503",
+                "Service unavailable",
+                "Spade couldn't pass the request to the Clay daemon");
+        return 1;
+    }
+    return 0;
+}
+
+/* Returns the length of the header block at the start of buf, including
+ * the blank line that ends it, or 0 if it isn't complete.
+ */
+size_t cgi_header_length(char* buf, size_t length) {
+    char* end = memmem(buf, length, "\r\n\r\n", 4);
+    if(end) {
+        return end - buf + 4;
+    }
+    end = memmem(buf, length, "\n\n", 2);
+    return end ? end - buf + 2 : 0;
+}
+
+/* Returns the value of the named header in a CGI program's NUL terminated
+ * header block, or NULL if it has none. Only a name at the start of a line
+ * counts, so "Length" doesn't match "X-Length".
+ */
+char* find_cgi_header(char* headers, const char* name) {
+    size_t name_length = strlen(name);
+    for(char* line = headers; line != NULL; line = strchr(line, '\n')) {
+        if(*line == '\n') {
+            line++;
+        }
+        if(!strncasecmp(line, name, name_length)
+                && line[name_length] == ':') {
+            return line + name_length + 1;
         }
+    }
+    return NULL;
+}
 
-        void* data = malloc(sizeof(variables));
-        if(data == NULL) {
-            log4c_category_log(log4c_category_get("spade"),
-                    LOG4C_PRIORITY_ERROR,
-                    "Unable to malloc space for the message data: %s",
-                    strerror(errno));
-            return_client_error(incoming_socket, request->uri.path, "503",
-                    "Service unavailable",
-                    "Spade couldn't connect to the Clay daemon");
-            return -1;
+/* Copy the output of a CGI program from its pipe to the client. The status
+ * line is held back until the program's own headers have arrived, so the
+ * connection is only kept alive if they include a Content-Length, and the
+ * body turns out to be that long.
+ */
+void relay_cgi_output(http_request* request, int incoming_socket,
+        int output) {
+    char buf[MAXBUF + 1];
+    size_t buffered = 0;
+    size_t header_length = 0;
+    ssize_t bytes_read;
+    while(buffered < MAXBUF
+            && !(header_length = cgi_header_length(buf, buffered))) {
+        bytes_read = read(output, buf + buffered, MAXBUF - buffered);
+        if(bytes_read < 0 && errno == EINTR) {
+            continue;
+        } else if(bytes_read <= 0) {
+            break;
         }
-        memcpy(data, &variables, sizeof(variables));
-        if(0 != (rc = zmq_msg_init_data(&msg, data, sizeof(variables),
-                        free_data, data))) {
-            log4c_category_log(log4c_category_get("spade"),
-                    LOG4C_PRIORITY_ERROR, "Failed to init 0mq message data.");
-            return_client_error(incoming_socket, request->uri.path, "503",
-                    "Service unavailable",
-                    "Spade couldn't connect to the Clay daemon");
-            return -1;
+        buffered += bytes_read;
+    }
+
+    char* content_length = NULL;
+    size_t expected_length = 0;
+    if(header_length > 0) {
+        char first_body_byte = buf[header_length];
+        buf[header_length] = '\0';
+        content_length = find_cgi_header(buf, "Content-Length");
+        if(content_length) {
+            expected_length = strtoull(content_length, NULL, 10);
         }
+        buf[header_length] = first_body_byte;
+    }
+    if(content_length == NULL) {
+        request->keep_alive = 0;
+    }
+    size_t body_length = buffered - header_length;
+
+    /* The program's own headers go out with ours */
+    char headers[MAXLINE];
+    int response_header_length = format_response_headers(headers, "200",
+            "OK", NULL, 0, request->keep_alive, 0);
+    if(write_response(incoming_socket, headers, response_header_length, buf,
+                buffered)) {
+        request->keep_alive = 0;
+        return;
+    }
 
-        if(0 != (rc = zmq_send(handler->socket, &msg, 0))) {
-            log4c_category_log(log4c_category_get("spade"),
-                    LOG4C_PRIORITY_ERROR,
-                    "Failed to deliver 0mq message to handler.");
-            return_client_error(incoming_socket, request->uri.path, "503",
-                "Service unavailable",
-                "Spade couldn't connect to the Clay daemon");
-            return -1;
+    while(1) {
+        while((bytes_read = read(output, buf, MAXBUF)) < 0 && errno == EINTR);
+        if(bytes_read <= 0) {
+            break;
+        }
+        if(rio_writen(incoming_socket, buf, bytes_read) == -1) {
+            request->keep_alive = 0;
+            return;
         }
+        body_length += bytes_read;
     }
-    return 0;
+
+    /* Otherwise the client would read the next response from the wrong
+     * place
+     */
+    if(content_length && body_length != expected_length) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_WARN,
+                "CGI program sent %zu bytes with a Content-Length of %zu",
+                body_length, expected_length);
+        request->keep_alive = 0;
+    }
+}
+
+/* Run a CGI program with the variables in environment in one of its
+ * handler's persistent workers. Without keep-alive the program writes
+ * straight to the client's socket, as when it's spawned here.
+ */
+void serve_pooled_cgi(http_request* request, int incoming_socket,
+        cgi_handler* handler, char* environment, int length) {
+    cgi_worker* worker = acquire_cgi_worker(handler->pool);
+    if(worker == NULL) {
+        request->keep_alive = 0;
+        return_client_error(incoming_socket,
+                http_request_string(request, request->uri.path), "503",
+                "Service Unavailable", "No CGI worker was free to run it");
+        return;
+    }
+
+    int output[2];
+    if(request->keep_alive && pipe2(output, O_CLOEXEC)) {
+        request->keep_alive = 0;
+    }
+    if(!request->keep_alive) {
+        if(-1 == return_response_headers(incoming_socket, "200", "OK", NULL,
+                    NULL, 0, 0, 0)) {
+            return_cgi_worker(handler->pool, worker);
+            return;
+        }
+        output[0] = -1;
+        output[1] = incoming_socket;
+    }
+
+    if(send_cgi_request(worker, environment, length, output[1])) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_WARN,
+                "Unable to send a request to CGI worker %d", worker->pid);
+        discard_cgi_worker(handler->pool, worker);
+        if(request->keep_alive) {
+            close(output[0]);
+            close(output[1]);
+            request->keep_alive = 0;
+            return_client_error(incoming_socket, strerror(errno), "502",
+                    "Bad Gateway", "Spade couldn't reach a CGI worker");
+        }
+        return;
+    }
+    if(request->keep_alive) {
+        close(output[1]);
+        relay_cgi_output(request, incoming_socket, output[0]);
+        close(output[0]);
+    }
+    release_cgi_worker(handler->pool, worker);
 }
 
 /*
  * serve_cgi - run a CGI program on behalf of the client
  */
 void serve_cgi(spade_server* server, http_request* request,
-        int incoming_socket, cgi_handler* handler) {
+        int incoming_socket, route* found) {
+    cgi_handler* handler = found->cgi;
     struct stat sbuf;
     stat(handler->handler, &sbuf);
     if(!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-        return_client_error(incoming_socket, request->uri.path, "403",
+        request->keep_alive = 0;
+        return_client_error(incoming_socket,
+                http_request_string(request, request->uri.path), "403",
                 "Forbidden", "Spade couldn't run the CGI program");
         return;
     }
 
-    if(-1 != return_response_headers(incoming_socket, "200", "OK", NULL, NULL,
-                0, 0)) {
-        if(fork() == 0) { /* child */
-            set_cgi_environment(server, request, handler);
-            /* Redirect stdout to client */
-            dup2(incoming_socket, STDOUT_FILENO);
-            char *emptylist[] = { NULL };
-            execve(handler->handler, emptylist, environ);
+    char environment[MAX_CGI_ENVIRONMENT_LENGTH];
+    int length = format_cgi_environment(server, request, handler, found->rest,
+            environment, MAX_CGI_ENVIRONMENT_LENGTH);
+    if(length < 0) {
+        request->keep_alive = 0;
+        return_client_error(incoming_socket,
+                http_request_string(request, request->uri.path), "414",
+                "Request-URI Too Long", "Spade couldn't pass on the request");
+        return;
+    }
+
+    if(handler->pool != NULL) {
+        serve_pooled_cgi(request, incoming_socket, handler, environment,
+                length);
+        return;
+    }
+
+    int output[2];
+    if(request->keep_alive && pipe2(output, O_CLOEXEC)) {
+        request->keep_alive = 0;
+    }
+
+    if(!request->keep_alive) {
+        if(-1 != return_response_headers(incoming_socket, "200", "OK", NULL,
+                    NULL, 0, 0, 0)) {
+            /* The program writes straight to the client */
+            pid_t child = spawn_cgi_program(handler->handler, environment,
+                    length, incoming_socket);
+            if(child > 0) {
+                /* Reap this child only, not another thread's or a worker */
+                waitpid(child, NULL, 0);
+            }
         }
-        wait(NULL); /* Parent waits for and reaps child */
+        return;
+    }
+
+    /* Through a pipe, so the server can frame the response */
+    pid_t child = spawn_cgi_program(handler->handler, environment, length,
+            output[1]);
+    close(output[1]);
+    if(child < 0) {
+        close(output[0]);
+        request->keep_alive = 0;
+        return_client_error(incoming_socket, strerror(errno), "500",
+                "Internal Server Error", "Spade couldn't run the CGI program");
+        return;
     }
+    relay_cgi_output(request, incoming_socket, output[0]);
+    close(output[0]);
+    waitpid(child, NULL, 0);
+}
+
+void build_client_error_body(char* body, char* cause, char* status_code,
+        char* short_message, char* long_message) {
+    sprintf(body, "<html><title>Spade Error</title>"
+            "<body bgcolor=""ffffff"">\r\n"
+            "%s: %s\r\n"
+            "<p>%s: %s\r\n"
+            "<hr><em>The Spade Web server</em>\r\n",
+            status_code, short_message, long_message, cause);
 }
 
 /*
@@ -563,26 +1031,134 @@ void serve_cgi(spade_server* server, http_request* request,
 void return_client_error(int incoming_socket, char *cause, char *status_code,
         char *short_message, char *longmsg) {
     char body[MAXBUF];
-
-    /* Build the HTTP response body */
-    sprintf(body, "<html><title>Spade Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, status_code, short_message);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Spade Web server</em>\r\n", body);
+    build_client_error_body(body, cause, status_code, short_message, longmsg);
 
     // TODO if the dynamic process doesn't close the headers, should we?
     return_response_headers(incoming_socket, status_code, short_message, body,
-            "text/html", 0, 1);
+            "text/html", 0, 0, 1);
+}
+
+/* The last Date and Server headers each thread formatted, and the second
+ * they were formatted for.
+ */
+__thread time_t common_headers_time;
+__thread char common_headers[MAX_COMMON_HEADER_LENGTH];
+__thread int common_headers_length;
+
+int format_common_headers(char* buf) {
+    time_t now = time(NULL);
+    if(now != common_headers_time) {
+        char date[MAX_HTTP_DATE_LENGTH];
+        format_http_date(date, now);
+        common_headers_length = sprintf(common_headers,
+                "Date: %s\r\nServer: %s\r\n", date, SPADE_SERVER_DESCRIPTOR);
+        common_headers_time = now;
+    }
+    memcpy(buf, common_headers, common_headers_length);
+    return common_headers_length;
+}
+
+/* Build the status line, Date, Server and Connection headers of a response
+ * in buf.
+ *
+ * Returns the length of the headers.
+ */
+int format_status_line(char* buf, char* status_code, char* message,
+        int keep_alive) {
+    int header_length = sprintf(buf, "HTTP/1.1 %s %s\r\n", status_code,
+            message);
+    header_length += format_common_headers(buf + header_length);
+    return header_length + sprintf(buf + header_length,
+            "Connection: %s\r\n", keep_alive ? "keep-alive" : "close");
+}
+
+int write_response(int incoming_socket, char* headers, size_t header_length,
+        char* body, size_t body_length) {
+    struct iovec iovecs[2];
+    iovecs[0].iov_base = headers;
+    iovecs[0].iov_len = header_length;
+    iovecs[1].iov_base = body;
+    iovecs[1].iov_len = body_length;
+    return writev_all(incoming_socket, iovecs, body_length > 0 ? 2 : 1);
+}
+
+int format_response_headers(char* buf, char* status_code, char* message,
+        char* content_type, int length, int keep_alive, int close_headers) {
+    int header_length = format_status_line(buf, status_code, message,
+            keep_alive);
+    if(content_type) {
+        header_length += sprintf(buf + header_length, "Content-Type: %s\r\n",
+                content_type);
+    }
+    if(length != 0) {
+        header_length += sprintf(buf + header_length,
+                "Content-Length: %d\r\n", length);
+    }
+    if(close_headers) {
+        header_length += sprintf(buf + header_length, "\r\n");
+    }
+    return header_length;
+}
+
+int format_static_response_headers(char* buf, static_file* file,
+        size_t length, int keep_alive) {
+    int header_length = format_status_line(buf, "200", "OK", keep_alive);
+    header_length += format_static_headers(buf + header_length, file,
+            length);
+    memcpy(buf + header_length, "\r\n", 2);
+    return header_length + 2;
+}
+
+int format_not_modified_response_headers(char* buf, static_file* file,
+        int keep_alive) {
+    int header_length = format_status_line(buf, "304", "Not Modified",
+            keep_alive);
+    header_length += format_validator_headers(buf + header_length, file);
+    memcpy(buf + header_length, "\r\n", 2);
+    return header_length + 2;
+}
+
+int format_partial_response_headers(char* buf, static_file* file,
+        size_t length, byte_range* ranges, int range_count, int keep_alive) {
+    int header_length = format_status_line(buf, "206", "Partial Content",
+            keep_alive);
+    header_length += format_partial_headers(buf + header_length, file,
+            length, ranges, range_count);
+    memcpy(buf + header_length, "\r\n", 2);
+    return header_length + 2;
+}
+
+int format_range_not_satisfiable_headers(char* buf, static_file* file,
+        size_t length, int keep_alive) {
+    int header_length = format_status_line(buf, "416",
+            "Range Not Satisfiable", keep_alive);
+    return header_length + sprintf(buf + header_length,
+            "Content-Range: bytes */%zu\r\nContent-Length: 0\r\n\r\n",
+            length);
+}
+
+int format_cached_response_headers(char* buf, cache_entry* entry,
+        int keep_alive) {
+    int header_length = format_status_line(buf, "200", "OK", keep_alive);
+    memcpy(buf + header_length, entry->headers, entry->header_length);
+    header_length += entry->header_length;
+    memcpy(buf + header_length, "\r\n", 2);
+    return header_length + 2;
 }
 
 int return_response_headers(int incoming_socket, char* status_code,
         char* message, char* body, char* content_type, int length,
-        int close_headers) {
+        int keep_alive, int close_headers) {
     char buf[MAXLINE];
 
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", status_code, message);
-    if(rio_writen(incoming_socket, buf, strlen(buf)) == -1) {
+    if(body) {
+        length = (int) strlen(body);
+    }
+    int header_length = format_response_headers(buf, status_code, message,
+            content_type, length, keep_alive, close_headers);
+    if(write_response(incoming_socket, buf, header_length,
+                close_headers ? body : NULL,
+                close_headers && body ? length : 0)) {
         log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_ERROR,
                 "Couldn't write to socket: %s", strerror(errno));
         return -1;
@@ -590,45 +1166,5 @@ int return_response_headers(int incoming_socket, char* status_code,
     strstr(buf, "\r\n")[0] = '\0';
     log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_DEBUG,
             "%s", buf);
-
-    if(body) {
-        length = (int) strlen(body);
-
-        sprintf(buf, "Content-Type: %s\r\n", content_type);
-        if(rio_writen(incoming_socket, buf, strlen(buf)) == -1) {
-            log4c_category_log(log4c_category_get("spade"),
-                    LOG4C_PRIORITY_ERROR,
-                    "Couldn't write to socket: %s", strerror(errno));
-            return -1;
-        }
-    }
-    if (length != 0) {
-        sprintf(buf, "Content-Length: %d\r\n", length);
-        if(rio_writen(incoming_socket, buf, strlen(buf)) == -1) {
-            log4c_category_log(log4c_category_get("spade"),
-                    LOG4C_PRIORITY_ERROR, "Couldn't write to socket: %s",
-                    strerror(errno));
-            return -1;
-        }
-    }
-
-    if(close_headers) {
-        sprintf(buf, "\r\n");
-        if(rio_writen(incoming_socket, buf, strlen(buf)) == -1) {
-            log4c_category_log(log4c_category_get("spade"),
-                    LOG4C_PRIORITY_ERROR, "Couldn't write to socket: %s",
-                    strerror(errno));
-            return -1;
-        }
-
-        if (body) {
-            if(rio_writen(incoming_socket, body, strlen(body)) == -1) {
-                log4c_category_log(log4c_category_get("spade"),
-                        LOG4C_PRIORITY_ERROR, "Couldn't write to socket: %s",
-                        strerror(errno));
-                return -1;
-            }
-        }
-    }
     return 0;
 }
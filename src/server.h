@@ -18,9 +18,33 @@
 #include "cgi.h"
 #include "dirt.h"
 #include "clay.h"
+#include "cache.h"
+#include "router.h"
 
 #define MAX_CONNECTION_QUEUE 3000
+#define MAX_LISTENERS 64
 #define ZMQ_THREAD_POOL_SIZE 10
+#define MAX_COMMON_HEADER_LENGTH 128
+
+/* How accepted connections are handled */
+typedef enum {
+    CONCURRENCY_MODEL_THREAD, /* One detached thread per connection */
+    CONCURRENCY_MODEL_EPOLL,  /* Edge-triggered epoll event loop */
+    CONCURRENCY_MODEL_POOL,   /* Fixed pool of worker threads */
+    CONCURRENCY_MODEL_URING   /* io_uring event loop */
+} concurrency_model;
+
+struct worker_pool;
+struct spade_server;
+
+/* A listening socket and the accept loop that serves it */
+typedef struct {
+    struct spade_server* server;
+    unsigned int index;
+    int socket;
+    unsigned long accepted; /* Connections accepted on this socket */
+    pthread_t thread;
+} spade_listener;
 
 /* Struct to hold server-wide settings and variables */
 typedef struct spade_server {
@@ -28,17 +52,44 @@ typedef struct spade_server {
     unsigned int port;
     char static_file_path[MAX_PATH_LENGTH];
     char cgi_file_path[MAX_PATH_LENGTH];
+    /* CGI variables common to every request, see format_cgi_environment */
+    char cgi_environment[MAX_STATIC_CGI_ENVIRONMENT_LENGTH];
+    size_t cgi_environment_length;
     char dirt_file_path[MAX_PATH_LENGTH];
     char hostname[MAX_HOSTNAME_LENGTH];
     int socket;
+    unsigned int listener_count;
+    spade_listener listeners[MAX_LISTENERS];
 	int do_reverse_lookups;
+    concurrency_model concurrency_model;
+    unsigned int worker_threads;
+    unsigned int worker_queue_length;
+    struct worker_pool* pool;
+    size_t cache_size; /* Byte budget of the static cache, 0 for none */
+    size_t cache_max_file_size;
+    static_cache* cache;
+    int precompressed;  /* Send .br and .gz siblings of static files */
+    int compress;       /* Compress text files into the static cache */
+    unsigned int stats_interval; /* Seconds between stats logs, 0 for never */
+    unsigned int keep_alive_timeout; /* Idle seconds, 0 disables keep-alive */
+    /* Idle seconds before any connection is closed, from accept onwards */
+    unsigned int idle_timeout;
+    unsigned int keep_alive_max_requests;
     unsigned int cgi_handler_count;
     cgi_handler cgi_handlers[MAX_HANDLERS];
+    unsigned int cgi_workers; /* Per CGI handler, 0 to fork each request */
+    unsigned int cgi_worker_spawn_rate;
+    unsigned int cgi_worker_max_requests;
     unsigned int dirt_handler_count;
     dirt_handler dirt_handlers[MAX_HANDLERS];
+    int dirt_reload;  /* Reload Dirt libraries when their files change */
+    int dirt_watcher; /* inotify descriptor watching them */
     unsigned int clay_handler_count;
     clay_handler clay_handlers[MAX_HANDLERS];
+    route_node* routes; /* Radix tree over the handlers' URL patterns */
     void* zmq_context;
+    int shutdown_pipe[2]; /* Written to by signal handlers to stop */
+    int stopping;         /* Set once listeners should stop accepting */
 } spade_server;
 
 
@@ -56,15 +107,158 @@ typedef struct {
  */
 int initialize_server(spade_server* server);
 
-/* Main thread for proxy server. Listens on the server socket and spawns
- * threads to handle new requests. Should never return.
+/* Main thread for proxy server. Listens on the server sockets, with one
+ * accept loop thread per listener, and hands new connections to the
+ * configured concurrency model. Returns once request_server_shutdown has
+ * been called and the listeners have stopped accepting.
  *
  * Requires server to be initialized with initialize_server.
  */
 void run_server(spade_server* server);
 
+/* Ask the main thread to stop the server. Only async-signal-safe calls are
+ * made, so this may be called from a signal handler.
+ */
+void request_server_shutdown(spade_server* server);
+
+/* Shut down the Dirt handlers, waiting up to DIRT_SHUTDOWN_WAIT seconds for
+ * requests still running in them so every library's shutdown hooks run.
+ * Must be called from a thread, not a signal handler.
+ */
 void shutdown_server(spade_server* server);
 
+/* Receive a client request on args->incoming_socket, generate a response
+ * and return it to the client.
+ */
+void receive(receive_args* args);
+
+/* Answer requests read from rio_client's blocking socket, requests_served
+ * of which have already been answered on the connection, until the client
+ * or a response ends it. The socket is closed unless a Clay handler has
+ * taken it over.
+ */
+void serve_connection_requests(spade_server* server, rio_t* rio_client,
+        struct sockaddr_in* client_address, unsigned int requests_served);
+
+/* Send an HTML error page with the given status to the client. */
+void return_client_error(int incoming_socket, char* cause, char* status_code,
+        char* short_message, char* long_message);
+
+/* Read the HTTP request line and headers from a blocking socket's rio
+ * buffer, reading more from the socket until they're complete. The request
+ * refers to the bytes in the buffer, so it's only good until the next read.
+ *
+ * Does not read content following the headers.
+ *
+ * Modifies rio, request.
+ * Returns 0 with the parsed request, which may or may not have
+ * message.valid, or -1 if the socket closed or failed or the headers didn't
+ * fit in the buffer.
+ */
+int read_http_request(rio_t* rio, http_request* request);
+
+/* Log a parsed request's method and path. */
+void log_http_request(http_request* request);
+
+/* Find the handler whose URL pattern matches the request's path. Requests
+ * that don't match a dynamic handler are routed to static files.
+ *
+ * Returns the route, which refers to the request's buffer.
+ */
+route find_route(spade_server* server, http_request* request);
+
+/* Dispatch a GET request to its handler, writing the response to
+ * incoming_socket.
+ *
+ * Returns 1 if the caller should close the socket, or 0 if the handler has
+ * taken ownership of it.
+ */
+int handle_get(spade_server* server, int incoming_socket,
+        http_request* request);
+
+/* Write the Date and Server headers that start every response to buf. The
+ * date only changes once a second, so each thread reuses the headers it
+ * last formatted until then.
+ *
+ * Returns the length of the headers.
+ */
+int format_common_headers(char* buf);
+
+/* Write a response's headers and whatever part of its body is in memory to
+ * a blocking socket in a single writev.
+ *
+ * Returns 0 if successful, or -1 if the write failed.
+ */
+int write_response(int incoming_socket, char* headers, size_t header_length,
+        char* body, size_t body_length);
+
+/* Build the status line and headers of a response in buf. A NULL
+ * content_type or zero length omits that header, keep_alive picks the
+ * Connection header and close_headers adds the blank line that ends the
+ * header block.
+ *
+ * Modifies buf.
+ * Returns the length of the headers.
+ */
+int format_response_headers(char* buf, char* status_code, char* message,
+        char* content_type, int length, int keep_alive, int close_headers);
+
+/* Build the headers of a 200 response for a static file with a body of
+ * length bytes in buf, including the blank line that ends them.
+ *
+ * Modifies buf.
+ * Returns the length of the headers.
+ */
+int format_static_response_headers(char* buf, static_file* file,
+        size_t length, int keep_alive);
+
+/* Build the headers of a body-less 304 response for a static file in buf,
+ * including the blank line that ends them.
+ *
+ * Modifies buf.
+ * Returns the length of the headers.
+ */
+int format_not_modified_response_headers(char* buf, static_file* file,
+        int keep_alive);
+
+/* Build the headers of a 206 response for ranges of a static file's body
+ * of length bytes in buf, including the blank line that ends them.
+ *
+ * Modifies buf.
+ * Returns the length of the headers.
+ */
+int format_partial_response_headers(char* buf, static_file* file,
+        size_t length, byte_range* ranges, int range_count, int keep_alive);
+
+/* Build the headers of a body-less 416 response for a static file's body
+ * of length bytes in buf, including the blank line that ends them.
+ *
+ * Modifies buf.
+ * Returns the length of the headers.
+ */
+int format_range_not_satisfiable_headers(char* buf, static_file* file,
+        size_t length, int keep_alive);
+
+/* Build the headers of a 200 response for a cached static file in buf,
+ * including the blank line that ends them.
+ *
+ * Modifies buf.
+ * Returns the length of the headers.
+ */
+int format_cached_response_headers(char* buf, cache_entry* entry,
+        int keep_alive);
+
+/* Returns 1 if the connection a request arrived on should stay open after
+ * the response, given the server's keep-alive settings and the number of
+ * requests already served on it including this one.
+ */
+int should_keep_alive(spade_server* server, http_request* request,
+        unsigned int requests_served);
+
+/* Build the HTML body of an error page in body. */
+void build_client_error_body(char* body, char* cause, char* status_code,
+        char* short_message, char* long_message);
+
 int register_cgi_handler(spade_server* server, const char* path,
         const char* handler_path);
 
@@ -2,14 +2,14 @@
 
 #include "spade.h"
 
-/* Proxy server struct is global so we can free it upon SIGINT. Nothing should
- * access this directly except free_server and main!
+/* Proxy server struct is global so it can be stopped upon SIGINT or SIGTERM.
+ * Nothing should access this directly except stop_server and main!
  */ 
 spade_server global_server;
 
-void free_server() {
-    shutdown_server(&global_server);
-    exit(0);
+/* Signal handler, which only wakes up the main thread to do the work */
+void stop_server(int signal) {
+    request_server_shutdown(&global_server);
 }
 
 void print_help() {
@@ -20,6 +20,7 @@ void print_help() {
     printf(" -s <path>   set the path to static files to serve (default ./static)\n");
     printf(" -c <path>   set the path to the config file (default config/spade.cfg)\n");
     printf(" -h          display this dialogue\n");
+    printf(" -w <path>   run as a CGI worker (started by the server)\n");
 }
 
 int main(int argc, char *argv []) {
@@ -31,7 +32,8 @@ int main(int argc, char *argv []) {
     int c;
     unsigned int override_port = 0;
     char* configuration_path = DEFAULT_CONFIGURATION_FILE_PATH;
-    while((c = getopt(argc, argv, "h:c:p:")) != -1) {
+    char* worker_program = NULL;
+    while((c = getopt(argc, argv, "h:c:p:w:")) != -1) {
         switch(c) {
             case 'h':
                 print_help();
@@ -42,6 +44,9 @@ int main(int argc, char *argv []) {
             case 'c':
                 configuration_path = optarg;
                 break;
+            case 'w':
+                worker_program = optarg;
+                break;
             case '?':
                 if (optopt == 'p') {
                     fprintf(stderr, "Option -%c requires an argument.\n", 
@@ -65,6 +70,10 @@ int main(int argc, char *argv []) {
         exit(1);
     }
 
+    if(worker_program != NULL) {
+        return run_cgi_worker(worker_program);
+    }
+
     if(configure_server(&global_server, configuration_path, override_port)) {
         printf("Unable to configure server\n");
         exit(EXIT_FAILURE);
@@ -73,10 +82,11 @@ int main(int argc, char *argv []) {
         printf("Unable to initialize server\n");
         exit(1);
     }
-    signal(SIGINT, free_server);
+    signal(SIGINT, stop_server);
+    signal(SIGTERM, stop_server);
 
     run_server(&global_server);
-    free_server();
+    shutdown_server(&global_server);
 
     return 0;
 }
@@ -11,6 +11,7 @@
 #include "util.h"
 #include "server.h"
 #include "config.h"
+#include "cgipool.h"
 
 #define DEFAULT_CONFIGURATION_FILE_PATH "config/spade.cfg"
 
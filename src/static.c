@@ -0,0 +1,258 @@
+#include "static.h"
+#include "server.h"
+
+/* Encodings to try, most preferred first */
+content_encoding preferred_encodings[] = {
+    CONTENT_ENCODING_BROTLI,
+    CONTENT_ENCODING_GZIP
+};
+#define PREFERRED_ENCODING_COUNT 2
+
+char* encoding_extension(content_encoding encoding) {
+    return encoding == CONTENT_ENCODING_BROTLI ? ".br" : ".gz";
+}
+
+int is_compressible(char* content_type) {
+    return !strncmp(content_type, "text/", 5);
+}
+
+/* Switch file to its precompressed sibling for encoding, if there is a
+ * readable one at least as new as the file.
+ *
+ * Returns 1 if the sibling will be sent.
+ */
+int use_precompressed_file(static_file* file, content_encoding encoding) {
+    char sibling_path[MAX_PATH_LENGTH];
+    struct stat sibling_sbuf;
+    if(snprintf(sibling_path, MAX_PATH_LENGTH, "%s%s", file->path,
+                encoding_extension(encoding)) >= MAX_PATH_LENGTH
+            || stat(sibling_path, &sibling_sbuf) < 0
+            || !S_ISREG(sibling_sbuf.st_mode)
+            || !(S_IRUSR & sibling_sbuf.st_mode)
+            || sibling_sbuf.st_mtime < file->sbuf.st_mtime) {
+        return 0;
+    }
+    strcpy(file->path, sibling_path);
+    file->sbuf = sibling_sbuf;
+    file->encoding = encoding;
+    file->vary = 1;
+    return 1;
+}
+
+void negotiate_encoding(spade_server* server, http_request* request,
+        static_file* file) {
+    int accepted[PREFERRED_ENCODING_COUNT];
+    for(int i = 0; i < PREFERRED_ENCODING_COUNT; i++) {
+        accepted[i] = http_request_accepts_encoding(request,
+                content_encoding_to_string(preferred_encodings[i]));
+        if(accepted[i] && server->precompressed
+                && use_precompressed_file(file, preferred_encodings[i])) {
+            return;
+        }
+    }
+
+    if(!server->compress || server->cache == NULL
+            || !is_compressible(file->content_type)
+            || (size_t) file->sbuf.st_size > server->cache_max_file_size) {
+        return;
+    }
+    for(int i = 0; i < PREFERRED_ENCODING_COUNT; i++) {
+        if(accepted[i]) {
+            file->encoding = preferred_encodings[i];
+            file->compress = 1;
+            return;
+        }
+    }
+}
+
+int resolve_static_file(spade_server* server, http_request* request,
+        static_file* file) {
+    int length = snprintf(file->path, MAX_PATH_LENGTH, "%s/%s",
+            server->static_file_path,
+            http_request_string(request, request->uri.path));
+    if(length >= MAX_PATH_LENGTH || stat(file->path, &file->sbuf) < 0) {
+        return 404;
+    }
+
+    if(S_ISDIR(file->sbuf.st_mode)) {
+        if(length + strlen("index.html") >= MAX_PATH_LENGTH) {
+            return 404;
+        }
+        strcat(file->path, "index.html");
+        if(stat(file->path, &file->sbuf) < 0) {
+            return 404;
+        }
+    }
+
+    if(!(S_ISREG(file->sbuf.st_mode)) || !(S_IRUSR & file->sbuf.st_mode)) {
+        return 403;
+    }
+
+    get_filetype(file->path, file->content_type);
+    file->encoding = CONTENT_ENCODING_IDENTITY;
+    file->compress = 0;
+    /* Other clients may be sent this file compressed, so shared caches
+     * have to key it on Accept-Encoding.
+     */
+    file->vary = is_compressible(file->content_type)
+        && (server->precompressed || server->compress);
+    negotiate_encoding(server, request, file);
+    return 0;
+}
+
+cache_entry* get_cached_static_file(spade_server* server, static_file* file,
+        int defer_compression) {
+    if(server->cache == NULL) {
+        return NULL;
+    }
+    cache_entry* entry;
+    if(file->compress && defer_compression) {
+        entry = cache_lookup(server->cache, file);
+        if(entry == NULL) {
+            cache_compress_later(server->cache, file, &server->thread_attr);
+        }
+    } else {
+        entry = cache_get(server->cache, file);
+    }
+    if(entry == NULL && file->compress) {
+        file->encoding = CONTENT_ENCODING_IDENTITY;
+        file->compress = 0;
+        entry = cache_get(server->cache, file);
+    }
+    return entry;
+}
+
+int prepare_static_file(spade_server* server, http_request* request,
+        static_file* file, int defer_compression, cache_entry** entry) {
+    *entry = NULL;
+    if(static_file_not_modified(request, file)) {
+        return 1;
+    }
+    int compress = file->compress;
+    *entry = get_cached_static_file(server, file, defer_compression);
+    if(compress && !file->compress
+            && static_file_not_modified(request, file)) {
+        if(*entry) {
+            cache_release(server->cache, *entry);
+            *entry = NULL;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+int format_entity_tag(char* buf, static_file* file) {
+    unsigned long long modified =
+        file->sbuf.st_mtim.tv_sec * 1000000000ULL + file->sbuf.st_mtim.tv_nsec;
+    /* A precompressed sibling has its own inode, but a body compressed in
+     * memory shares the original's, so mark its coding too.
+     */
+    return sprintf(buf, "\"%lx-%llx-%llx%s%s\"",
+            (unsigned long) file->sbuf.st_ino,
+            (unsigned long long) file->sbuf.st_size, modified,
+            file->compress ? "-" : "",
+            file->compress ? content_encoding_to_string(file->encoding) : "");
+}
+
+int static_file_not_modified(http_request* request, static_file* file) {
+    char entity_tag[MAX_ENTITY_TAG_LENGTH];
+    format_entity_tag(entity_tag, file);
+    /* If-None-Match takes precedence when a client sends both */
+    if(find_http_header(request, "If-None-Match")) {
+        return http_request_matches_entity_tag(request, entity_tag);
+    }
+
+    char* since_date = find_http_header(request, "If-Modified-Since");
+    time_t since;
+    return since_date && !parse_http_date(since_date, &since)
+        && file->sbuf.st_mtime <= since;
+}
+
+int find_static_ranges(http_request* request, static_file* file,
+        size_t length, byte_range* ranges) {
+    char* validator = find_http_header(request, "If-Range");
+    if(validator) {
+        /* Only a strong comparison will do, as the ranges have to come
+         * from exactly the representation the client has.
+         */
+        if(validator[0] == '"') {
+            char entity_tag[MAX_ENTITY_TAG_LENGTH];
+            format_entity_tag(entity_tag, file);
+            if(strcmp(validator, entity_tag)) {
+                return 0;
+            }
+        } else {
+            time_t date;
+            if(parse_http_date(validator, &date)
+                    || date != file->sbuf.st_mtime) {
+                return 0;
+            }
+        }
+    }
+    return parse_http_byte_ranges(request, length, ranges);
+}
+
+int format_part_header(char* buf, static_file* file, size_t length,
+        byte_range* range) {
+    return sprintf(buf, "\r\n--" BYTERANGES_BOUNDARY "\r\n"
+            "Content-Type: %s\r\nContent-Range: bytes %zu-%zu/%zu\r\n\r\n",
+            file->content_type, range->first, range->last, length);
+}
+
+int format_partial_headers(char* buf, static_file* file, size_t length,
+        byte_range* ranges, int range_count) {
+    int header_length;
+    if(range_count == 1) {
+        header_length = format_static_headers(buf, file,
+                ranges[0].last - ranges[0].first + 1);
+        header_length += sprintf(buf + header_length,
+                "Content-Range: bytes %zu-%zu/%zu\r\n", ranges[0].first,
+                ranges[0].last, length);
+        return header_length;
+    }
+
+    size_t body_length = strlen(BYTERANGES_END);
+    char part_header[MAX_PART_HEADER_LENGTH];
+    for(int i = 0; i < range_count; i++) {
+        body_length += format_part_header(part_header, file, length,
+                &ranges[i]);
+        body_length += ranges[i].last - ranges[i].first + 1;
+    }
+    header_length = sprintf(buf, "Content-Type: multipart/byteranges; "
+            "boundary=" BYTERANGES_BOUNDARY "\r\nContent-Length: %zu\r\n",
+            body_length);
+    if(file->encoding != CONTENT_ENCODING_IDENTITY) {
+        header_length += sprintf(buf + header_length,
+                "Content-Encoding: %s\r\n",
+                content_encoding_to_string(file->encoding));
+    }
+    return header_length + format_validator_headers(buf + header_length,
+            file);
+}
+
+int format_validator_headers(char* buf, static_file* file) {
+    int header_length = sprintf(buf, "ETag: ");
+    header_length += format_entity_tag(buf + header_length, file);
+    header_length += sprintf(buf + header_length, "\r\nLast-Modified: ");
+    header_length += format_http_date(buf + header_length,
+            file->sbuf.st_mtime);
+    header_length += sprintf(buf + header_length, "\r\n");
+    if(file->vary) {
+        header_length += sprintf(buf + header_length,
+                "Vary: Accept-Encoding\r\n");
+    }
+    return header_length;
+}
+
+int format_static_headers(char* buf, static_file* file, size_t length) {
+    int header_length = sprintf(buf,
+            "Content-Type: %s\r\nContent-Length: %zu\r\n"
+            "Accept-Ranges: bytes\r\n", file->content_type, length);
+    if(file->encoding != CONTENT_ENCODING_IDENTITY) {
+        header_length += sprintf(buf + header_length,
+                "Content-Encoding: %s\r\n",
+                content_encoding_to_string(file->encoding));
+    }
+    return header_length + format_validator_headers(buf + header_length,
+            file);
+}
@@ -0,0 +1,130 @@
+#ifndef _STATIC_H_
+#define _STATIC_H_
+
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+
+#include "http.h"
+
+/**
+ * static.h/.c, choosing which file and content coding to send for a static
+ * request.
+ *
+ * A request resolves to a file under the document root. If the client
+ * accepts it, a precompressed .br or .gz sibling of that file is sent
+ * instead, or failing that a compressible file may be compressed once and
+ * kept in the static cache.
+ */
+
+#define MAX_CONTENT_TYPE_LENGTH 64
+#define MAX_ENTITY_TAG_LENGTH 64
+/* Separates the parts of a multipart/byteranges body */
+#define BYTERANGES_BOUNDARY "7d3c1b8a4f2e6095spade"
+#define BYTERANGES_END "\r\n--" BYTERANGES_BOUNDARY "--\r\n"
+#define MAX_PART_HEADER_LENGTH 192
+
+struct spade_server;
+struct cache_entry;
+
+typedef struct {
+    char path[MAX_PATH_LENGTH]; /* File whose bytes are sent */
+    struct stat sbuf;           /* stat of path */
+    char content_type[MAX_CONTENT_TYPE_LENGTH]; /* Of the requested file */
+    content_encoding encoding;  /* Coding of the response body */
+    int compress;               /* Body must be compressed in memory */
+    int vary;                   /* Response depends on Accept-Encoding */
+} static_file;
+
+/* Resolve the file a static request refers to, serving index.html for
+ * directories, and pick the representation to send.
+ *
+ * Modifies file.
+ * Returns 0 if the file can be served, otherwise the HTTP status code that
+ * should be returned to the client.
+ */
+int resolve_static_file(struct spade_server* server, http_request* request,
+        static_file* file);
+
+/* Look up a resolved file in the server's static cache. If a compressed
+ * copy can't be made, file is switched back to the identity coding. With
+ * defer_compression set, as on an event loop's thread, a compressed copy
+ * that isn't cached yet is made in the background and this response goes
+ * out uncompressed.
+ *
+ * Returns an entry to pass to cache_release, or NULL if the file should be
+ * sent from disk.
+ */
+struct cache_entry* get_cached_static_file(struct spade_server* server,
+        static_file* file, int defer_compression);
+
+/* Check the request's If-None-Match and If-Modified-Since headers against
+ * file and, unless the client's copy is current, look it up as
+ * get_cached_static_file does. If that falls back to the identity coding
+ * the check is made again, as the identity body has its own entity tag.
+ *
+ * Modifies *entry, which is NULL if the client's copy is current.
+ * Returns 1 if the client already has this representation of file.
+ */
+int prepare_static_file(struct spade_server* server, http_request* request,
+        static_file* file, int defer_compression,
+        struct cache_entry** entry);
+
+/* Write file's entity tag, built from its inode, size, modification time
+ * and in-memory coding, with quotes to buf.
+ *
+ * Returns the length of the tag.
+ */
+int format_entity_tag(char* buf, static_file* file);
+
+/* Returns 1 if the request's If-None-Match or If-Modified-Since header
+ * shows that the client already has this representation of file.
+ */
+int static_file_not_modified(http_request* request, static_file* file);
+
+/* Write the ETag, Last-Modified and Vary headers for file to buf, without
+ * the blank line that ends a header block. These are the headers a 304
+ * response repeats.
+ *
+ * Returns the length of the headers.
+ */
+int format_validator_headers(char* buf, static_file* file);
+
+/* Find the ranges of file's body of length bytes that the request asks
+ * for, unless an If-Range header shows the client's copy is out of date.
+ *
+ * Modifies ranges, which must hold MAX_BYTE_RANGES.
+ * Returns the number of ranges, 0 to send the whole body, or -1 if the
+ * ranges can't be satisfied.
+ */
+int find_static_ranges(http_request* request, static_file* file,
+        size_t length, byte_range* ranges);
+
+/* Write the headers for a 206 response with range_count ranges of file's
+ * body of length bytes to buf, without the blank line that ends a header
+ * block. A single range is sent as it is, several as a multipart/byteranges
+ * body.
+ *
+ * Returns the length of the headers.
+ */
+int format_partial_headers(char* buf, static_file* file, size_t length,
+        byte_range* ranges, int range_count);
+
+/* Write the boundary and headers that come before one range of file's body
+ * of length bytes in a multipart/byteranges body to buf.
+ *
+ * Returns the length written, at most MAX_PART_HEADER_LENGTH.
+ */
+int format_part_header(char* buf, static_file* file, size_t length,
+        byte_range* range);
+
+/* Write the Content-Type, Content-Length, Accept-Ranges and
+ * Content-Encoding headers for file's body of length bytes, followed by its
+ * validator headers, to buf, without the blank line that ends a header
+ * block.
+ *
+ * Returns the length of the headers.
+ */
+int format_static_headers(char* buf, static_file* file, size_t length);
+
+#endif // _STATIC_H_
@@ -0,0 +1,64 @@
+#include "stats.h"
+#include "pool.h"
+
+void log_server_stats(spade_server* server) {
+    for(unsigned int i = 0; i < server->listener_count; i++) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+                "Listener %d accepted %lu connections", i,
+                __atomic_load_n(&server->listeners[i].accepted,
+                    __ATOMIC_RELAXED));
+    }
+    if(server->pool != NULL) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+                "Worker queue depth %zu of %zu, %lu connections rejected",
+                ring_depth(&server->pool->ring),
+                ring_capacity(&server->pool->ring),
+                __atomic_load_n(&server->pool->rejected, __ATOMIC_RELAXED));
+    }
+    if(server->cache != NULL) {
+        static_cache* cache = server->cache;
+        pthread_mutex_lock(&cache->lock);
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+                "Static cache holds %u files in %zu of %zu bytes: %lu hits, "
+                "%lu misses, %lu evictions, %lu invalidations",
+                cache->entry_count, cache->size, cache->capacity, cache->hits,
+                cache->misses, cache->evictions, cache->invalidations);
+        pthread_mutex_unlock(&cache->lock);
+    }
+    for(unsigned int i = 0; i < server->clay_handler_count; i++) {
+        clay_handler* handler = &server->clay_handlers[i];
+        pthread_mutex_lock(&handler->lock);
+        for(unsigned int j = 0; j < handler->backend_count; j++) {
+            log4c_category_log(log4c_category_get("spade"),
+                    LOG4C_PRIORITY_INFO,
+                    "Clay backend %u of '%s' has %u requests in flight, "
+                    "%lu served", j, handler->endpoint,
+                    handler->backends[j].in_flight,
+                    handler->backends[j].served);
+        }
+        pthread_mutex_unlock(&handler->lock);
+    }
+}
+
+/* Helper function for the stats thread */
+void* stats_helper(void* args) {
+    spade_server* server = (spade_server*) args;
+    while(1) {
+        sleep(server->stats_interval);
+        log_server_stats(server);
+    }
+    return 0;
+}
+
+void start_stats_thread(spade_server* server) {
+    if(server->stats_interval == 0) {
+        return;
+    }
+
+    pthread_t stats_thread;
+    if(pthread_create(&stats_thread, &server->thread_attr, stats_helper,
+                server)) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_WARN,
+                "Unable to start the stats thread");
+    }
+}
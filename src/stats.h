@@ -0,0 +1,19 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include "server.h"
+
+/**
+ * stats.h/.c, periodic logging of server counters used to size queues and
+ * check how load is spread.
+ */
+
+/* Log the current value of every server counter at INFO priority. */
+void log_server_stats(spade_server* server);
+
+/* Start a thread that calls log_server_stats every server->stats_interval
+ * seconds. Does nothing if the interval is 0.
+ */
+void start_stats_thread(spade_server* server);
+
+#endif // _STATS_H_
@@ -0,0 +1,470 @@
+#include "uring.h"
+
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#define URING_SLOT(user_data) ((unsigned int) ((user_data) >> 8))
+#define URING_OPERATION(user_data) ((uring_operation) ((user_data) & 0xff))
+#define URING_USER_DATA(slot, operation) \
+    (((unsigned long long) (slot) << 8) | (operation))
+
+/* State for one listener's event loop */
+typedef struct {
+    spade_listener* listener;
+    uring ring;
+    uring_slot* slots;
+    unsigned int* free_slots;
+    unsigned int free_count;
+    int registered_buffers;
+    int accepting;
+    struct __kernel_timespec idle_timeout;
+} uring_loop;
+
+int setup_uring(uring* ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->descriptor = syscall(__NR_io_uring_setup, URING_QUEUE_DEPTH,
+            &params);
+    if(ring->descriptor < 0) {
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array
+        + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes
+        + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_ring_size = ring->cq_ring_size =
+            MAX(ring->sq_ring_size, ring->cq_ring_size);
+    }
+
+    ring->sq_ring = mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->descriptor, IORING_OFF_SQ_RING);
+    if(ring->sq_ring == MAP_FAILED) {
+        close(ring->descriptor);
+        return -1;
+    }
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(0, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->descriptor,
+                IORING_OFF_CQ_RING);
+        if(ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->descriptor);
+            return -1;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->descriptor, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) {
+        if(ring->cq_ring != ring->sq_ring) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->descriptor);
+        return -1;
+    }
+
+    char* sq_ring = ring->sq_ring;
+    char* cq_ring = ring->cq_ring;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head = (unsigned int*) (sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned int*) (sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned int*) (sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int*) (sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned int*) (cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned int*) (cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned int*) (cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq_ring + params.cq_off.cqes);
+    ring->to_submit = 0;
+    return 0;
+}
+
+void free_uring(uring* ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->descriptor);
+}
+
+/* Submit queued requests and optionally wait for at least one completion.
+ *
+ * Returns the result of io_uring_enter.
+ */
+int enter_uring(uring* ring, unsigned int wait) {
+    int result;
+    do {
+        result = syscall(__NR_io_uring_enter, ring->descriptor,
+                ring->to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0,
+                NULL, 0);
+    } while(result < 0 && errno == EINTR);
+    if(result >= 0) {
+        ring->to_submit -= MIN((unsigned int) result, ring->to_submit);
+    }
+    return result;
+}
+
+/* Returns a zeroed submission queue entry, flushing the queue to the kernel
+ * first if it is full. The entry isn't visible to the kernel until
+ * commit_sqe.
+ */
+struct io_uring_sqe* next_sqe(uring* ring) {
+    unsigned int tail = *ring->sq_tail;
+    while(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)
+            >= ring->sq_entries) {
+        enter_uring(ring, 0);
+    }
+    struct io_uring_sqe* sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+void commit_sqe(uring* ring) {
+    unsigned int tail = *ring->sq_tail;
+    unsigned int index = tail & *ring->sq_mask;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+void submit_accept(uring_loop* loop) {
+    struct io_uring_sqe* sqe = next_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listener->socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = URING_USER_DATA(0, URING_ACCEPT);
+    commit_sqe(&loop->ring);
+}
+
+/* Read more of the request into the slot's registered rio buffer. Every
+ * read is linked to a timeout, which cancels it if the client stays idle
+ * too long, whether or not it has sent a request yet.
+ */
+void submit_read(uring_loop* loop, unsigned int slot) {
+    spade_connection* connection = &loop->slots[slot].connection;
+    rio_t* rio = &connection->rio;
+    if(rio->rio_bufptr != rio->rio_buf) {
+        memmove(rio->rio_buf, rio->rio_bufptr, rio->rio_cnt);
+        rio->rio_bufptr = rio->rio_buf;
+    }
+
+    struct io_uring_sqe* sqe = next_sqe(&loop->ring);
+    sqe->fd = loop->slots[slot].connection.socket;
+    sqe->addr = (unsigned long) (rio->rio_buf + rio->rio_cnt);
+    sqe->len = RIO_BUFSIZE - rio->rio_cnt;
+    if(loop->registered_buffers) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->buf_index = slot;
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+    }
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = URING_USER_DATA(slot, URING_READ);
+    commit_sqe(&loop->ring);
+    loop->slots[slot].in_flight++;
+
+    sqe = next_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long) &loop->idle_timeout;
+    sqe->len = 1;
+    sqe->user_data = URING_USER_DATA(slot, URING_TIMEOUT);
+    commit_sqe(&loop->ring);
+    loop->slots[slot].in_flight++;
+}
+
+/* Send whatever is left of the queued responses. The sends are linked so
+ * every response's headers and body go to the kernel in one submission and
+ * are sent in order. Without MSG_WAITALL a partial send counts as done and
+ * the next one in the chain would go out after it, so the kernel is made to
+ * finish each send, and only a failure, with or without some bytes sent,
+ * breaks the chain. The rest is resent once its cancelled sends have
+ * completed.
+ */
+void submit_response(uring_loop* loop, unsigned int slot) {
+    spade_connection* connection = &loop->slots[slot].connection;
+    struct iovec iovecs[MAX_RESPONSE_IOVECS];
+    int count = connection_pending_iovecs(connection, iovecs);
+    for(int i = 0; i < count; i++) {
+        int more = i + 1 < count;
+        struct io_uring_sqe* sqe = next_sqe(&loop->ring);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = connection->socket;
+        sqe->addr = (unsigned long) iovecs[i].iov_base;
+        sqe->len = iovecs[i].iov_len;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (more ? MSG_MORE : 0);
+        sqe->flags = more ? IOSQE_IO_LINK : 0;
+        sqe->user_data = URING_USER_DATA(slot, URING_SEND);
+        commit_sqe(&loop->ring);
+        loop->slots[slot].in_flight++;
+        loop->slots[slot].sending++;
+    }
+}
+
+/* Give up the slot's connection. The slot only goes back on the free list
+ * once the kernel has completed everything submitted for it, so a late
+ * completion can't land on a new connection.
+ */
+void release_slot(uring_loop* loop, unsigned int slot) {
+    loop->slots[slot].connection.state = CONNECTION_CLOSED;
+    loop->slots[slot].released = 1;
+    if(loop->slots[slot].in_flight == 0) {
+        loop->free_slots[loop->free_count++] = slot;
+    }
+}
+
+void close_slot(uring_loop* loop, unsigned int slot) {
+    close_connection(&loop->slots[slot].connection);
+    release_slot(loop, slot);
+}
+
+/* Move a deferred dynamic request to a heap allocated connection served by
+ * its own thread, and free the slot for another client.
+ */
+void detach_slot(uring_loop* loop, unsigned int slot) {
+    spade_connection* slot_connection = &loop->slots[slot].connection;
+    spade_connection* connection = create_connection(slot_connection->server,
+            slot_connection->socket, &slot_connection->client_address);
+    if(connection == NULL) {
+        close_slot(loop, slot);
+        return;
+    }
+    connection->deferred = slot_connection->deferred;
+    slot_connection->deferred = NULL;
+    connection->requests_served = slot_connection->requests_served;
+    /* Anything pipelined after the request is served by the thread */
+    rio_t* rio = &slot_connection->rio;
+    memcpy(connection->rio.rio_buf, rio->rio_bufptr, rio->rio_cnt);
+    connection->rio.rio_cnt = rio->rio_cnt;
+    release_slot(loop, slot);
+    detach_connection(connection);
+}
+
+void handle_accept(uring_loop* loop, struct io_uring_cqe* cqe) {
+    if(cqe->res < 0 && __atomic_load_n(&loop->listener->server->stopping,
+                __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    if(!(cqe->flags & IORING_CQE_F_MORE)) {
+        submit_accept(loop);
+    }
+    if(cqe->res < 0) {
+        errno = -cqe->res;
+        check_error(cqe->res, "io_uring accept");
+        return;
+    }
+    __atomic_add_fetch(&loop->listener->accepted, 1, __ATOMIC_RELAXED);
+    loop->accepting = 1;
+
+    if(loop->free_count == 0) {
+        return_client_error(cqe->res, "all connections are busy", "503",
+                "Service Unavailable",
+                "Spade is too busy to take this request");
+        close(cqe->res);
+        return;
+    }
+
+    unsigned int slot = loop->free_slots[--loop->free_count];
+    /* Multishot accept doesn't report the address, and dynamic requests
+     * handed to a thread need it for reverse lookups
+     */
+    struct sockaddr_in client_address;
+    socklen_t address_length = sizeof(client_address);
+    memset(&client_address, 0, sizeof(client_address));
+    getpeername(cqe->res, (struct sockaddr*) &client_address,
+            &address_length);
+    initialize_connection(&loop->slots[slot].connection,
+            loop->listener->server, cqe->res, &client_address);
+    loop->slots[slot].failed = 0;
+    loop->slots[slot].released = 0;
+    /* io_uring has no sendfile, bodies are mapped and sent with SEND */
+    loop->slots[slot].connection.send_files = 0;
+    submit_read(loop, slot);
+}
+
+/* Respond to the requests buffered in the slot's rio buffer. */
+void serve_slot_requests(uring_loop* loop, unsigned int slot) {
+    connection_respond(&loop->slots[slot].connection);
+    if(loop->slots[slot].connection.state == CONNECTION_DETACHED) {
+        detach_slot(loop, slot);
+    } else {
+        submit_response(loop, slot);
+    }
+}
+
+void handle_read(uring_loop* loop, unsigned int slot, int result) {
+    spade_connection* connection = &loop->slots[slot].connection;
+    if(result <= 0) {
+        close_slot(loop, slot);
+        return;
+    }
+
+    connection->rio.rio_cnt += result;
+    if(!connection_has_request(connection)) {
+        if(connection->rio.rio_cnt == RIO_BUFSIZE) {
+            log4c_category_log(log4c_category_get("spade"),
+                    LOG4C_PRIORITY_WARN,
+                    "Request headers on socket %d longer than %d bytes",
+                    connection->socket, RIO_BUFSIZE);
+            close_slot(loop, slot);
+        } else {
+            submit_read(loop, slot);
+        }
+        return;
+    }
+    serve_slot_requests(loop, slot);
+}
+
+void handle_send(uring_loop* loop, unsigned int slot, int result) {
+    uring_slot* entry = &loop->slots[slot];
+    spade_connection* connection = &entry->connection;
+    if(result == -ECANCELED) {
+        /* A failed send broke the link, the rest is resent below */
+    } else if(result < 0) {
+        entry->failed = 1;
+    } else {
+        /* Sends complete in full and in order up to the first failed one,
+         * which reports what it managed, so together they cover the start
+         * of the queue.
+         */
+        connection->sent += result;
+    }
+
+    if(entry->sending > 0) {
+        return;
+    }
+
+    struct iovec iovecs[MAX_RESPONSE_IOVECS];
+    if(entry->failed) {
+        close_slot(loop, slot);
+    } else if(connection_pending_iovecs(connection, iovecs) > 0) {
+        submit_response(loop, slot);
+    } else if(!connection_finish_response(connection)) {
+        close_slot(loop, slot);
+    } else if(connection->state == CONNECTION_DETACHED) {
+        detach_slot(loop, slot);
+    } else if(connection_has_request(connection)) {
+        serve_slot_requests(loop, slot);
+    } else {
+        submit_read(loop, slot);
+    }
+}
+
+void handle_completion(uring_loop* loop, struct io_uring_cqe* cqe) {
+    uring_operation operation = URING_OPERATION(cqe->user_data);
+    unsigned int slot = URING_SLOT(cqe->user_data);
+    if(operation == URING_ACCEPT) {
+        handle_accept(loop, cqe);
+        return;
+    }
+
+    uring_slot* entry = &loop->slots[slot];
+    entry->in_flight--;
+    if(operation == URING_SEND) {
+        entry->sending--;
+    }
+    if(entry->released) {
+        if(entry->in_flight == 0) {
+            loop->free_slots[loop->free_count++] = slot;
+        }
+    } else if(operation == URING_READ) {
+        handle_read(loop, slot, cqe->res);
+    } else if(operation == URING_SEND) {
+        handle_send(loop, slot, cqe->res);
+    }
+}
+
+/* Register every slot's rio buffer with the ring so reads skip the per-I/O
+ * page pinning. Locked memory limits can refuse this, in which case reads
+ * use plain recv.
+ */
+void register_buffers(uring_loop* loop) {
+    struct iovec iovecs[URING_MAX_CONNECTIONS];
+    for(unsigned int i = 0; i < URING_MAX_CONNECTIONS; i++) {
+        iovecs[i].iov_base = loop->slots[i].connection.rio.rio_buf;
+        iovecs[i].iov_len = RIO_BUFSIZE;
+    }
+    loop->registered_buffers = syscall(__NR_io_uring_register,
+            loop->ring.descriptor, IORING_REGISTER_BUFFERS, iovecs,
+            URING_MAX_CONNECTIONS) == 0;
+    if(!loop->registered_buffers) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_WARN,
+                "Unable to register io_uring buffers, using recv: %s",
+                strerror(errno));
+    }
+}
+
+int run_uring(spade_listener* listener) {
+    uring_loop loop;
+    loop.listener = listener;
+    loop.accepting = 0;
+    loop.idle_timeout.tv_sec = listener->server->idle_timeout;
+    loop.idle_timeout.tv_nsec = 0;
+    if(setup_uring(&loop.ring)) {
+        log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_WARN,
+                "io_uring is unavailable: %s", strerror(errno));
+        return -1;
+    }
+
+    loop.slots = calloc(URING_MAX_CONNECTIONS, sizeof(uring_slot));
+    loop.free_slots = malloc(URING_MAX_CONNECTIONS * sizeof(unsigned int));
+    if(loop.slots == NULL || loop.free_slots == NULL) {
+        free(loop.slots);
+        free(loop.free_slots);
+        free_uring(&loop.ring);
+        return -1;
+    }
+    loop.free_count = 0;
+    for(unsigned int i = URING_MAX_CONNECTIONS; i > 0; i--) {
+        loop.free_slots[loop.free_count++] = i - 1;
+    }
+    register_buffers(&loop);
+
+    log4c_category_log(log4c_category_get("spade"), LOG4C_PRIORITY_INFO,
+            "Serving listener %d from an io_uring event loop",
+            listener->index);
+
+    submit_accept(&loop);
+    while(1) {
+        if(enter_uring(&loop.ring, 1) < 0) {
+            check_error(-1, "io_uring_enter");
+            break;
+        }
+
+        unsigned int head = *loop.ring.cq_head;
+        unsigned int tail = __atomic_load_n(loop.ring.cq_tail,
+                __ATOMIC_ACQUIRE);
+        for(; head != tail; head++) {
+            struct io_uring_cqe* cqe =
+                &loop.ring.cqes[head & *loop.ring.cq_mask];
+            if(URING_OPERATION(cqe->user_data) == URING_ACCEPT
+                    && !loop.accepting
+                    && (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)) {
+                /* Kernels before 5.19 reject multishot accept */
+                log4c_category_log(log4c_category_get("spade"),
+                        LOG4C_PRIORITY_WARN,
+                        "io_uring multishot accept is unavailable");
+                __atomic_store_n(loop.ring.cq_head, head + 1,
+                        __ATOMIC_RELEASE);
+                free(loop.slots);
+                free(loop.free_slots);
+                free_uring(&loop.ring);
+                return -1;
+            }
+            handle_completion(&loop, cqe);
+        }
+        __atomic_store_n(loop.ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    free(loop.slots);
+    free(loop.free_slots);
+    free_uring(&loop.ring);
+    return -1;
+}
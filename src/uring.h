@@ -0,0 +1,71 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#define _GNU_SOURCE
+
+#include <linux/io_uring.h>
+
+#include "server.h"
+#include "connection.h"
+
+/**
+ * uring.h/.c, io_uring event loop for accepting connections, reading
+ * requests and sending static responses with as few syscalls as possible.
+ *
+ * Talks to the kernel with the raw io_uring syscalls, so it needs no extra
+ * library. Connections live in a fixed table whose rio buffers are
+ * registered with the ring, a single multishot accept feeds the table, and
+ * the headers and bodies of queued responses go out as a chain of linked
+ * sends.
+ */
+
+#define URING_QUEUE_DEPTH 1024
+#define URING_MAX_CONNECTIONS 512
+
+/* Operations tagged in the low bits of each request's user_data */
+typedef enum {
+    URING_ACCEPT,
+    URING_READ,
+    URING_SEND,
+    URING_TIMEOUT
+} uring_operation;
+
+/* Submission and completion queues shared with the kernel */
+typedef struct {
+    int descriptor;
+    unsigned int sq_entries;
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_mask;
+    unsigned int* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned int to_submit;
+} uring;
+
+typedef struct {
+    spade_connection connection;
+    unsigned int in_flight; /* Submitted operations not yet completed */
+    unsigned int sending;   /* Of which are sends of the response */
+    int failed;
+    int released; /* Closed or detached, free once in_flight drains */
+} uring_slot;
+
+/* Serve the listener's socket from an io_uring event loop. Requests for
+ * dynamic handlers are passed to a thread, as in the epoll model.
+ *
+ * Returns -1 without serving anything if io_uring or multishot accept isn't
+ * available, so the caller can fall back to another model. Otherwise
+ * should never return.
+ */
+int run_uring(spade_listener* listener);
+
+#endif // _URING_H_
@@ -1,9 +1,16 @@
+#define _GNU_SOURCE
+
 #include <log4c.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
 
 #include "util.h"
 
@@ -17,6 +24,100 @@ int check_error(int result, const char* function) {
     return 0;
 }
 
+int set_nonblocking(int descriptor, int nonblocking) {
+    int flags = fcntl(descriptor, F_GETFL, 0);
+    if(check_error(flags, "fcntl")) {
+        return -1;
+    }
+    flags = nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+    return check_error(fcntl(descriptor, F_SETFL, flags), "fcntl");
+}
+
+int writev_all(int descriptor, struct iovec* iovecs, int count) {
+    while(count > 0) {
+        ssize_t written = writev(descriptor, iovecs, count);
+        if(written < 0 && errno == EINTR) {
+            continue;
+        } else if(written < 0) {
+            return -1;
+        }
+        while(count > 0 && (size_t) written >= iovecs->iov_len) {
+            written -= iovecs->iov_len;
+            iovecs++;
+            count--;
+        }
+        if(count > 0) {
+            iovecs->iov_base = (char*) iovecs->iov_base + written;
+            iovecs->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+int set_cork(int socket, int corked) {
+    return setsockopt(socket, IPPROTO_TCP, TCP_CORK, &corked,
+            sizeof(corked));
+}
+
+/* Move bytes from file to socket through a temporary pipe. Anything that
+ * reaches the pipe but not the socket is dropped with the pipe, and is
+ * read from the file again on the next call.
+ */
+ssize_t splice_file(int socket, int file, off_t* offset, size_t count) {
+    int pipe_descriptors[2];
+    if(pipe(pipe_descriptors)) {
+        return -1;
+    }
+
+    loff_t file_offset = *offset;
+    ssize_t buffered = splice(file, &file_offset, pipe_descriptors[1], NULL,
+            count, SPLICE_F_MOVE);
+    ssize_t sent = 0;
+    ssize_t result = buffered;
+    while(sent < buffered) {
+        result = splice(pipe_descriptors[0], NULL, socket, NULL,
+                buffered - sent, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(result < 0 && errno == EINTR) {
+            continue;
+        } else if(result <= 0) {
+            break;
+        }
+        sent += result;
+    }
+
+    int saved_errno = errno;
+    close(pipe_descriptors[0]);
+    close(pipe_descriptors[1]);
+    errno = saved_errno;
+    *offset += sent;
+    return sent > 0 ? sent : result;
+}
+
+ssize_t send_file(int socket, int file, off_t* offset, size_t count) {
+    ssize_t sent = sendfile(socket, file, offset, count);
+    if(sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        return splice_file(socket, file, offset, count);
+    }
+    return sent;
+}
+
+int send_file_all(int socket, int file, off_t offset, size_t count) {
+    off_t end = offset + count;
+    while(offset < end) {
+        ssize_t sent = send_file(socket, file, &offset, end - offset);
+        if(sent < 0 && errno == EINTR) {
+            continue;
+        } else if(sent <= 0) {
+            if(sent == 0) {
+                /* The file was truncated after it was opened */
+                errno = EIO;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
 void get_filetype(char *filename, char *filetype) {
     if (strstr(filename, ".html")) {
         strcpy(filetype, "text/html");
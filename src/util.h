@@ -2,6 +2,8 @@
 #define _UTIL_H_
 
 #include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * 15-213 ProxyLab
@@ -21,6 +23,43 @@
  */ 
 int check_error(int result, const char* function);
 
+/* Set or clear O_NONBLOCK on a file descriptor.
+ *
+ * Returns 0 if successful.
+ */
+int set_nonblocking(int descriptor, int nonblocking);
+
+/* Write everything described by iovecs to a blocking descriptor, picking
+ * up where partial writes left off.
+ *
+ * Modifies iovecs.
+ * Returns 0 if successful, or -1 on error.
+ */
+int writev_all(int descriptor, struct iovec* iovecs, int count);
+
+/* Set or clear TCP_CORK on a socket. While corked, partial frames are held
+ * back so headers and body leave in full packets.
+ *
+ * Returns 0 if successful.
+ */
+int set_cork(int socket, int corked);
+
+/* Send up to count bytes of file, starting at *offset, to socket without
+ * copying them through user space. Uses sendfile, or splice through a pipe
+ * if sendfile can't handle the file.
+ *
+ * Modifies *offset to follow the bytes that were sent.
+ * Returns the number of bytes sent, or -1 on error.
+ */
+ssize_t send_file(int socket, int file, off_t* offset, size_t count);
+
+/* Send count bytes of file, starting at offset, to a blocking socket,
+ * retrying partial and interrupted sends.
+ *
+ * Returns 0 once everything is sent, or -1 on error.
+ */
+int send_file_all(int socket, int file, off_t offset, size_t count);
+
 /*
  * get_filetype - derive file type from file name
  * Borrowed from the Tiny web server.
@@ -0,0 +1,119 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "http.h"
+
+/**
+ * parser.c, microbenchmark of the HTTP request parser with each of the
+ * header scanning kernels this CPU supports.
+ *
+ * Run ./parser after building, ideally on an otherwise idle machine.
+ *
+ * The request carries the kind of cookies and tracing headers that make
+ * header scanning show up in profiles.
+ */
+
+#define ROUNDS 10
+#define ITERATIONS 200000
+
+const char* REQUEST =
+    "GET /api/v2/accounts/84213/orders?status=open&page=3 HTTP/1.1\r\n"
+    "Host: shop.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 "
+        "Firefox/118.0\r\n"
+    "Accept: application/json, text/plain, */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: https://shop.example.com/accounts/84213/orders\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d6c"
+        "15b0f00a08; csrftoken=Yx1bQm3VfO2nZs8Kj4LwTe6Rp0HuDa9G; _ga=GA1.2."
+        "1748291034.1697541200; _gid=GA1.2.2018461732.1697541200; theme=dark"
+        "; locale=en-US; recently_viewed=1932,8812,2210,4471,9005\r\n"
+    "traceparent: 00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01"
+        "\r\n"
+    "tracestate: congo=t61rcWkgMzE,rojo=00f067aa0ba902b7\r\n"
+    "X-Request-ID: 2c1a8e4f-7b3d-4f6a-9e21-5d8c0b7a3f19\r\n"
+    "X-B3-TraceId: 80f198ee56343ba864fe8b2a57d3eff7\r\n"
+    "X-B3-SpanId: e457b5a2e4d86bd1\r\n"
+    "X-B3-ParentSpanId: 05e3ac9a4f6e3b90\r\n"
+    "X-B3-Sampled: 1\r\n"
+    "X-Forwarded-For: 203.0.113.195, 70.41.3.18, 150.172.238.178\r\n"
+    "X-Forwarded-Proto: https\r\n"
+    "Sec-Fetch-Dest: empty\r\n"
+    "Sec-Fetch-Mode: cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "If-None-Match: \"33a64df551425fcc55e4d42a148795d9f25f89d4\"\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Pragma: no-cache\r\n"
+    "\r\n";
+
+/* Returns the nanoseconds it takes to parse REQUEST, on average over the
+ * fastest of ROUNDS rounds so other work on the machine doesn't count.
+ */
+double time_parser(http_scanner scanner) {
+    find_http_delimiters = scanner;
+    size_t length = strlen(REQUEST);
+    char buffer[MAXBUF];
+    http_parser parser;
+    http_request request;
+
+    double fastest = -1;
+    for(int round = 0; round < ROUNDS; round++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(int i = 0; i < ITERATIONS; i++) {
+            /* Parsing terminates strings in place, so use a fresh copy */
+            memcpy(buffer, REQUEST, length);
+            init_http_parser(&parser, &request);
+            if(!parse_http_request(&parser, &request, buffer, length)
+                    || !request.message.valid) {
+                fprintf(stderr, "Parser failed on the benchmark request\n");
+                return -1;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double elapsed = (end.tv_sec - start.tv_sec) * 1e9
+            + (end.tv_nsec - start.tv_nsec);
+        if(fastest < 0 || elapsed < fastest) {
+            fastest = elapsed;
+        }
+    }
+    return fastest / ITERATIONS;
+}
+
+int report(const char* name, http_scanner scanner, double baseline) {
+    double nanoseconds = time_parser(scanner);
+    if(nanoseconds < 0) {
+        return -1;
+    }
+    printf("%-8s %8.1f ns/request %8.1f MB/s %6.2fx\n", name, nanoseconds,
+            strlen(REQUEST) / nanoseconds * 1e3,
+            baseline / nanoseconds);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    printf("Parsing a %zu byte request with 23 headers, best of %d rounds "
+            "of %d\n", strlen(REQUEST), ROUNDS, ITERATIONS);
+    double baseline = time_parser(find_http_delimiters_scalar);
+    if(baseline < 0 || report("scalar", find_http_delimiters_scalar,
+                baseline)) {
+        return 1;
+    }
+#ifdef HTTP_SCAN_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2")
+            && report("SSE2", find_http_delimiters_sse2, baseline)) {
+        return 1;
+    }
+    if(__builtin_cpu_supports("avx2")
+            && report("AVX2", find_http_delimiters_avx2, baseline)) {
+        return 1;
+    }
+#endif
+    return 0;
+}
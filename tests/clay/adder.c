@@ -7,43 +7,81 @@
 #include "csapp.h"
 #include "../../src/clay.h"
 
-// TODO inthe future, can use ZMQ_SNDMORE to allow bigger responses
+/* Send the next chunk of the response to a request, which the server
+ * writes to the client straight away
+ */
+void send_chunk(void* socket, clay_message* request, int flags,
+        const char* data, size_t length) {
+    zmq_msg_t msg;
+    zmq_msg_init_size(&msg, CLAY_RESPONSE_HEADER_LENGTH);
+    encode_clay_response_header(zmq_msg_data(&msg), request->id, flags);
+    zmq_send(socket, &msg, ZMQ_SNDMORE);
+    zmq_msg_close(&msg);
 
-void adder(void* socket, clay_variables variables) {
-    int first = 0, second = 0;
-    sscanf(variables.query_string, "value=%d&value=%d", &first, &second);
+    zmq_msg_init_size(&msg, length);
+    memcpy(zmq_msg_data(&msg), data, length);
+    zmq_send(socket, &msg, 0);
+    zmq_msg_close(&msg);
+}
 
+void adder(void* socket, clay_message* request) {
+    /* Variables aren't NUL terminated */
+    char query_string[MAXLINE] = "";
+    size_t length;
+    const char* value = find_clay_variable(request, "QUERY_STRING", &length);
+    if(value != NULL && length < MAXLINE) {
+        memcpy(query_string, value, length);
+        query_string[length] = '\0';
+    }
+
+    int first = 0, second = 0;
+    sscanf(query_string, "value=%d&value=%d", &first, &second);
 
     char content[MAXLINE];
     sprintf(content, "%d\r\n", first + second);
 
-    char buf[MAX_RESPONSE_SIZE];
-    sprintf(buf, "Content-Type: text/html\r\n");
-    sprintf(buf, "%sContent-Length: %zu\r\n\r\n", buf, strlen(content));
-    sprintf(buf, "%s%s", buf, content);
+    char headers[MAXLINE];
+    sprintf(headers, "Content-Type: text/html\r\nContent-Length: %zu\r\n\r\n",
+            strlen(content));
 
-    clay_response response;
-    response.incoming_socket = variables.incoming_socket;
-    response.response_length = strlen(buf);
-    memcpy(response.response, buf, response.response_length);
+    send_chunk(socket, request, 0, headers, strlen(headers));
+    send_chunk(socket, request, CLAY_RESPONSE_END, content,
+            strlen(content));
+}
 
+/* Tell the server this backend is ready for requests */
+void send_ready(void* socket) {
     zmq_msg_t msg;
-    zmq_msg_init_data(&msg, &response, sizeof(clay_response), NULL, NULL);
+    zmq_msg_init(&msg);
     zmq_send(socket, &msg, 0);
+    zmq_msg_close(&msg);
 }
 
 int main(void) {
-    zmq_msg_t msg;
-    zmq_msg_init (&msg);
-
-    void* zmq_context = zmq_init(10);
-    void* socket = zmq_socket(zmq_context, ZMQ_PAIR);
-    int rc = zmq_connect(socket, "ipc:///tmp/adder.sock");
-    clay_variables variables;
+    void* zmq_context = zmq_init(1);
+    void* socket = zmq_socket(zmq_context, ZMQ_DEALER);
+    if(zmq_connect(socket, "ipc:///tmp/adder.sock")) {
+        fprintf(stderr, "Unable to connect: %s\n", zmq_strerror(zmq_errno()));
+        return 1;
+    }
+    send_ready(socket);
 
+    zmq_pollitem_t item = { socket, 0, ZMQ_POLLIN, 0 };
+    clay_message request;
     while(1) {
-        rc = zmq_recv(socket, &msg, 0);
-        memcpy(&variables, zmq_msg_data(&msg), zmq_msg_size(&msg));
-        adder(socket, variables);
+        /* zmq_poll takes microseconds */
+        if(zmq_poll(&item, 1, CLAY_HEARTBEAT_INTERVAL * 1000000L) <= 0) {
+            send_ready(socket);
+            continue;
+        }
+
+        zmq_msg_t msg;
+        zmq_msg_init(&msg);
+        if(zmq_recv(socket, &msg, 0) == 0
+                && !decode_clay_request(zmq_msg_data(&msg),
+                    zmq_msg_size(&msg), &request)) {
+            adder(socket, &request);
+        }
+        zmq_msg_close(&msg);
     }
 }
@@ -0,0 +1,74 @@
+"""
+claywire.py - the Clay wire format in Python, for backends written without
+the C library. See src/claywire.h for the layout.
+"""
+
+import struct
+
+WIRE_VERSION = 1
+
+MESSAGE_REQUEST = 1
+MESSAGE_RESPONSE = 2
+
+RESPONSE_END = 1
+
+RESPONSE_HEADER = struct.Struct(">BBBQ")
+REQUEST_HEADER = struct.Struct(">BBQH")
+
+
+def encode_request(request_id, variables, body=b""):
+    """Encode a request from a list of (name, value) byte string pairs."""
+    parts = [REQUEST_HEADER.pack(WIRE_VERSION, MESSAGE_REQUEST, request_id,
+                                 len(variables))]
+    for name, value in variables:
+        parts.append(struct.pack(">B", len(name)) + name)
+        parts.append(struct.pack(">H", len(value)) + value)
+    parts.append(struct.pack(">I", len(body)) + body)
+    return b"".join(parts)
+
+
+def decode_request(data):
+    """Returns (id, variables, body), with variables a dict of byte strings.
+
+    Raises ValueError if the message is malformed or of another version.
+    """
+    try:
+        version, kind, request_id, count = REQUEST_HEADER.unpack_from(data)
+        if version != WIRE_VERSION or kind != MESSAGE_REQUEST:
+            raise ValueError("not a version %d request" % WIRE_VERSION)
+        offset = REQUEST_HEADER.size
+        variables = {}
+        for _ in range(count):
+            name_length = data[offset]
+            name = data[offset + 1:offset + 1 + name_length]
+            offset += 1 + name_length
+            (value_length,) = struct.unpack_from(">H", data, offset)
+            value = data[offset + 2:offset + 2 + value_length]
+            offset += 2 + value_length
+            variables.setdefault(name, value)
+        (body_length,) = struct.unpack_from(">I", data, offset)
+        offset += 4
+    except (IndexError, struct.error):
+        raise ValueError("truncated request")
+    if offset + body_length != len(data):
+        raise ValueError("request length doesn't match its body")
+    return request_id, variables, data[offset:]
+
+
+def encode_response_header(request_id, flags=0):
+    """Encode the header part of a response chunk."""
+    return RESPONSE_HEADER.pack(WIRE_VERSION, MESSAGE_RESPONSE, flags,
+                                request_id)
+
+
+def decode_response_header(data):
+    """Returns (id, flags).
+
+    Raises ValueError if the header is malformed or of another version.
+    """
+    if len(data) != RESPONSE_HEADER.size:
+        raise ValueError("response header is %d bytes" % len(data))
+    version, kind, flags, request_id = RESPONSE_HEADER.unpack(data)
+    if version != WIRE_VERSION or kind != MESSAGE_RESPONSE:
+        raise ValueError("not a version %d response" % WIRE_VERSION)
+    return request_id, flags
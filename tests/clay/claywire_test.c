@@ -0,0 +1,192 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "claywire.h"
+
+/**
+ * claywire_test.c, round trips through the Clay wire format and the
+ * malformed messages decode_clay_request has to turn away.
+ *
+ * Run ./claywire_test after building. It prints each failed check and
+ * exits with the number of them.
+ */
+
+int failures = 0;
+
+#define CHECK(condition) do { \
+        if(!(condition)) { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #condition); \
+            failures++; \
+        } \
+    } while(0)
+
+/* Returns 1 if the decoded request has the named variable with value. */
+int has_variable(clay_message* message, const char* name,
+        const char* value, size_t value_length) {
+    size_t length;
+    const char* found = find_clay_variable(message, name, &length);
+    return found && length == value_length
+        && !memcmp(found, value, value_length);
+}
+
+void test_request_round_trip() {
+    clay_encoder encoder;
+    CHECK(begin_clay_request(&encoder, 0x0102030405060708ULL) == 0);
+    add_clay_variable(&encoder, "QUERY_STRING", "value=1&value=2", 15);
+    add_clay_variable(&encoder, "PATH_INFO", "", 0);
+    add_clay_header(&encoder, "Accept-Encoding", "gzip");
+    CHECK(finish_clay_request(&encoder, "body\0bytes", 10) == 0);
+
+    /* Header, variable and body encodings, byte for byte */
+    const unsigned char* data = (const unsigned char*) encoder.data;
+    CHECK(data[0] == CLAY_WIRE_VERSION);
+    CHECK(data[1] == CLAY_MESSAGE_REQUEST);
+    CHECK(!memcmp(data + 2, "\x01\x02\x03\x04\x05\x06\x07\x08", 8));
+    CHECK(data[10] == 0 && data[11] == 3);
+    CHECK(data[12] == 12 && !memcmp(data + 13, "QUERY_STRING", 12));
+    CHECK(data[25] == 0 && data[26] == 15);
+    CHECK(!memcmp(data + 27, "value=1&value=2", 15));
+    CHECK(!memcmp(encoder.data + encoder.length - 14,
+                "\0\0\0\x0a" "body\0bytes", 14));
+
+    clay_message message;
+    CHECK(decode_clay_request(encoder.data, encoder.length, &message) == 0);
+    CHECK(message.id == 0x0102030405060708ULL);
+    CHECK(message.variable_count == 3);
+    CHECK(has_variable(&message, "QUERY_STRING", "value=1&value=2", 15));
+    CHECK(has_variable(&message, "PATH_INFO", "", 0));
+    CHECK(has_variable(&message, "HTTP_ACCEPT_ENCODING", "gzip", 4));
+    CHECK(message.body_length == 10
+            && !memcmp(message.body, "body\0bytes", 10));
+    size_t length;
+    CHECK(find_clay_variable(&message, "CONTENT_TYPE", &length) == NULL);
+    free(encoder.data);
+}
+
+void test_variable_limits() {
+    static char value[MAX_CLAY_VARIABLE_VALUE + 1];
+    char name[MAX_CLAY_VARIABLE_NAME + 2];
+    memset(value, 'v', sizeof(value));
+    memset(name, 'N', sizeof(name));
+
+    /* The longest name and value fit */
+    name[MAX_CLAY_VARIABLE_NAME] = '\0';
+    clay_encoder encoder;
+    CHECK(begin_clay_request(&encoder, 1) == 0);
+    add_clay_variable(&encoder, name, value, MAX_CLAY_VARIABLE_VALUE);
+    CHECK(finish_clay_request(&encoder, NULL, 0) == 0);
+    clay_message message;
+    CHECK(decode_clay_request(encoder.data, encoder.length, &message) == 0);
+    CHECK(has_variable(&message, name, value, MAX_CLAY_VARIABLE_VALUE));
+    free(encoder.data);
+
+    /* One byte more of either doesn't */
+    CHECK(begin_clay_request(&encoder, 1) == 0);
+    add_clay_variable(&encoder, "NAME", value, MAX_CLAY_VARIABLE_VALUE + 1);
+    CHECK(finish_clay_request(&encoder, NULL, 0) == -1);
+    CHECK(encoder.data == NULL);
+
+    name[MAX_CLAY_VARIABLE_NAME] = 'N';
+    name[MAX_CLAY_VARIABLE_NAME + 1] = '\0';
+    CHECK(begin_clay_request(&encoder, 1) == 0);
+    add_clay_variable(&encoder, name, "value", 5);
+    CHECK(finish_clay_request(&encoder, NULL, 0) == -1);
+
+    /* A header's name counts with its HTTP_ prefix */
+    name[MAX_CLAY_VARIABLE_NAME - 5] = '\0';
+    CHECK(begin_clay_request(&encoder, 1) == 0);
+    add_clay_header(&encoder, name, "value");
+    CHECK(finish_clay_request(&encoder, NULL, 0) == 0);
+    free(encoder.data);
+    name[MAX_CLAY_VARIABLE_NAME - 5] = 'N';
+    name[MAX_CLAY_VARIABLE_NAME - 4] = '\0';
+    CHECK(begin_clay_request(&encoder, 1) == 0);
+    add_clay_header(&encoder, name, "value");
+    CHECK(finish_clay_request(&encoder, NULL, 0) == -1);
+}
+
+void test_variable_count_limit() {
+    clay_encoder encoder;
+    CHECK(begin_clay_request(&encoder, 2) == 0);
+    for(int i = 0; i < MAX_CLAY_VARIABLES; i++) {
+        add_clay_variable(&encoder, "V", "1", 1);
+    }
+    CHECK(finish_clay_request(&encoder, NULL, 0) == 0);
+    clay_message message;
+    CHECK(decode_clay_request(encoder.data, encoder.length, &message) == 0);
+    CHECK(message.variable_count == MAX_CLAY_VARIABLES);
+
+    /* A message claiming more than a decoder has room for is refused */
+    encoder.data[10] = (MAX_CLAY_VARIABLES + 1) >> 8;
+    encoder.data[11] = (MAX_CLAY_VARIABLES + 1) & 0xff;
+    CHECK(decode_clay_request(encoder.data, encoder.length, &message) == -1);
+    free(encoder.data);
+
+    CHECK(begin_clay_request(&encoder, 2) == 0);
+    for(int i = 0; i <= MAX_CLAY_VARIABLES; i++) {
+        add_clay_variable(&encoder, "V", "1", 1);
+    }
+    CHECK(finish_clay_request(&encoder, NULL, 0) == -1);
+}
+
+void test_malformed_requests() {
+    clay_encoder encoder;
+    CHECK(begin_clay_request(&encoder, 3) == 0);
+    add_clay_variable(&encoder, "QUERY_STRING", "value=1", 7);
+    CHECK(finish_clay_request(&encoder, "body", 4) == 0);
+
+    /* Cut short anywhere, including inside the header */
+    clay_message message;
+    for(size_t length = 0; length < encoder.length; length++) {
+        CHECK(decode_clay_request(encoder.data, length, &message) == -1);
+    }
+
+    char* longer = malloc(encoder.length + 1);
+    memcpy(longer, encoder.data, encoder.length);
+    longer[encoder.length] = 'x';
+    CHECK(decode_clay_request(longer, encoder.length + 1, &message) == -1);
+    free(longer);
+
+    encoder.data[0] = CLAY_WIRE_VERSION + 1;
+    CHECK(decode_clay_request(encoder.data, encoder.length, &message) == -1);
+    encoder.data[0] = CLAY_WIRE_VERSION;
+    encoder.data[1] = CLAY_MESSAGE_RESPONSE;
+    CHECK(decode_clay_request(encoder.data, encoder.length, &message) == -1);
+    free(encoder.data);
+}
+
+void test_response_header_round_trip() {
+    unsigned char header[CLAY_RESPONSE_HEADER_LENGTH];
+    encode_clay_response_header(header, 0xfedcba9876543210ULL,
+            CLAY_RESPONSE_END);
+    CHECK(header[0] == CLAY_WIRE_VERSION);
+    CHECK(header[1] == CLAY_MESSAGE_RESPONSE);
+    CHECK(header[2] == CLAY_RESPONSE_END);
+    CHECK(!memcmp(header + 3, "\xfe\xdc\xba\x98\x76\x54\x32\x10", 8));
+
+    uint64_t id;
+    int flags;
+    CHECK(decode_clay_response_header(header, sizeof(header), &id,
+                &flags) == 0);
+    CHECK(id == 0xfedcba9876543210ULL && flags == CLAY_RESPONSE_END);
+    CHECK(decode_clay_response_header(header, sizeof(header) - 1, &id,
+                &flags) == -1);
+    header[1] = CLAY_MESSAGE_REQUEST;
+    CHECK(decode_clay_response_header(header, sizeof(header), &id,
+                &flags) == -1);
+}
+
+int main() {
+    test_request_round_trip();
+    test_variable_limits();
+    test_variable_count_limit();
+    test_malformed_requests();
+    test_response_header_round_trip();
+    if(failures == 0) {
+        printf("claywire: all checks passed\n");
+    }
+    return failures;
+}
@@ -5,7 +5,12 @@
 
 void adder(int incoming_socket, dirt_variables variables) {
     int first = 0, second = 0;
-    sscanf(variables.query_string, "value=%d&value=%d", &first, &second);
+    if(variables.path_parameters[0] != '\0') {
+        sscanf(variables.path_parameters, "first=%d&second=%d", &first,
+                &second);
+    } else {
+        sscanf(variables.query_string, "value=%d&value=%d", &first, &second);
+    }
 
     char content[MAXLINE];
     sprintf(content, "%d\r\n", first + second);
@@ -23,3 +28,13 @@ void adder(int incoming_socket, dirt_variables variables) {
 
     rio_writen(incoming_socket, content, strlen(content));
 }
+
+DIRT_HANDLER_VERSION(buffered_adder, 2);
+
+void buffered_adder(const dirt_request* request, dirt_response* response) {
+    int first = 0, second = 0;
+    sscanf(request->query_string, "value=%d&value=%d", &first, &second);
+
+    response->add_header(response, "Content-Type", "text/html");
+    response->printf(response, "%d\r\n", first + second);
+}
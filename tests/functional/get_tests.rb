@@ -1,6 +1,8 @@
 require 'test/unit'
 require 'socket'
 require 'net/http'
+require 'zlib'
+require 'tempfile'
 
 class GetTests < Test::Unit::TestCase
     def setup
@@ -51,16 +53,303 @@ class GetTests < Test::Unit::TestCase
         assert_same_dynamic '/adderpy?', "0"
     end
 
+    def test_cgi_workers
+        config = <<~CONFIG
+            static = { document_root = "tests/static"; };
+            cgi = {
+                document_root = "tests/cgi-bin";
+                workers = 1;
+                worker_max_requests = 2;
+                handlers = ( { handler = "adder"; url = "adder"; } );
+            };
+        CONFIG
+        with_server config do |server|
+            workers = `pgrep -P #{server}`.split
+            assert_equal 1, workers.length
+
+            # The worker is replaced after its second request, and the third
+            # waits for the new one on the same connection
+            socket = TCPSocket.new('localhost', 8001)
+            3.times do |i|
+                socket.write "GET /adder?value=#{i}&value=1 HTTP/1.1\r\n" \
+                    "Host: localhost\r\n\r\n"
+                headers = socket.gets("\r\n\r\n")
+                assert_match /Connection: keep-alive/, headers
+                length = headers[/Content-Length: (\d+)/, 1].to_i
+                assert_equal (i + 1).to_s, socket.read(length).strip
+            end
+            socket.close
+
+            replacements = `pgrep -P #{server}`.split
+            assert_equal 1, replacements.length
+            assert_not_equal workers, replacements
+        end
+    end
+
     def test_dirt
         assert_same_dynamic '/dirt-adder?value=1&value=2', "3"
         assert_same_dynamic '/dirt-adder?', "0"
     end
 
+    def test_dirt_v2
+        assert_same_dynamic '/dirt-adder-v2?value=1&value=2', "3"
+        response = @http.get('/dirt-adder-v2?value=20&value=22')
+        assert_equal "4", response['Content-Length']
+    end
+
+    def test_path_parameters
+        assert_same_dynamic '/dirt-adder/1/2', "3"
+        assert_same_dynamic '/dirt-adder/40/2?value=5', "42"
+        assert_equal "404", @http.get('/dirt-adder/1').code
+    end
+
     def test_clay
         assert_same_dynamic '/clay-adder?value=1&value=2', "3"
         assert_same_dynamic '/clay-adder?', "0"
     end
 
+    def test_keep_alive
+        assert_keep_alive 8000
+    end
+
+    def test_not_modified
+        identity = { 'Accept-Encoding' => 'identity' }
+        response = @http.get('/small.txt', identity)
+        etag = response['ETag']
+        last_modified = response['Last-Modified']
+        assert_not_nil etag
+        assert_equal "304", @http.get('/small.txt', identity.merge(
+            'If-None-Match' => etag)).code
+        assert_equal "304", @http.get('/small.txt', identity.merge(
+            'If-Modified-Since' => last_modified)).code
+        assert_equal "200", @http.get('/small.txt', identity.merge(
+            'If-None-Match' => '"stale"')).code
+    end
+
+    def test_range
+        content = File.binread('tests/static/large.txt')
+        response = @http.get('/large.txt', 'Range' => 'bytes=10-19')
+        assert_equal "206", response.code
+        assert_equal content[10..19], response.body
+        assert_equal "bytes 10-19/#{content.length}",
+            response['Content-Range']
+        response = @http.get('/large.txt', 'Range' => 'bytes=-5')
+        assert_equal content[-5..-1], response.body
+        response = @http.get('/large.txt',
+                             'Range' => "bytes=#{content.length}-")
+        assert_equal "416", response.code
+        assert_equal "bytes */#{content.length}", response['Content-Range']
+        response = @http.get('/large.txt', 'Range' =>
+                             "bytes=#{content.length}-,#{content.length + 9}-")
+        assert_equal "416", response.code
+    end
+
+    def test_multiple_ranges
+        content = File.binread('tests/static/large.txt')
+        response = @http.get('/large.txt', 'Range' => 'bytes=0-4,10-19')
+        assert_equal "206", response.code
+        assert_match %r{^multipart/byteranges}, response['Content-Type']
+        assert_equal response.body.length, response['Content-Length'].to_i
+        boundary = response['Content-Type'][/boundary=(\S+)/, 1]
+        parts = response.body.split("\r\n--#{boundary}")
+        assert_equal "", parts.shift
+        assert_equal "--\r\n", parts.pop
+        assert_equal [[0, 4], [10, 19]], parts.map { |part|
+            headers, body = part.split("\r\n\r\n", 2)
+            first, last = headers[/Content-Range: bytes (\d+-\d+)\//, 1]
+                .split('-').map(&:to_i)
+            assert_equal content[first..last], body
+            [first, last]
+        }
+    end
+
+    def test_if_range
+        content = File.binread('tests/static/large.txt')
+        response = @http.get('/large.txt', 'Range' => 'bytes=0-0')
+        etag = response['ETag']
+        response = @http.get('/large.txt', 'Range' => 'bytes=10-19',
+                             'If-Range' => etag)
+        assert_equal "206", response.code
+        assert_equal content[10..19], response.body
+
+        # A client with an out of date copy gets the whole file instead
+        response = @http.get('/large.txt', 'Range' => 'bytes=10-19',
+                             'If-Range' => '"stale"')
+        assert_equal "200", response.code
+        assert_equal content, response.body
+        response = @http.get('/large.txt', 'Range' => 'bytes=10-19',
+                             'If-Range' => 'Thu, 01 Jan 1970 00:00:00 GMT')
+        assert_equal "200", response.code
+        assert_equal content, response.body
+    end
+
+    def test_content_encoding
+        response = @http.get('/small.txt')
+        assert_nil response['Content-Encoding']
+        assert_equal 'Accept-Encoding', response['Vary']
+
+        # Compressed in memory, possibly in the background
+        content = File.binread('tests/static/small.txt')
+        body = nil
+        10.times do
+            response = @http.get('/small.txt', 'Accept-Encoding' => 'gzip')
+            assert_equal 'Accept-Encoding', response['Vary']
+            body = response.body
+            break if response['Content-Encoding']
+            sleep 0.1
+        end
+        assert_equal 'gzip', response['Content-Encoding']
+        assert_equal content, Zlib.gunzip(body)
+
+        sibling = 'tests/static/small.html.gz'
+        begin
+            File.binwrite(sibling, Zlib.gzip('precompressed'))
+            response = @http.get('/small.html', 'Accept-Encoding' => 'gzip')
+            assert_equal 'gzip', response['Content-Encoding']
+            assert_equal 'Accept-Encoding', response['Vary']
+            assert_equal 'precompressed', Zlib.gunzip(response.body)
+            response = @http.get('/small.html',
+                                 'Accept-Encoding' => 'identity')
+            assert_nil response['Content-Encoding']
+            assert_equal File.binread('tests/static/small.html'),
+                response.body
+        ensure
+            File.delete(sibling)
+        end
+    end
+
+    def test_pipelining
+        assert_pipelined 8000
+    end
+
+    # The event loops answer pipelined requests from a queue of their own
+    def test_event_loop_pipelining
+        ['epoll', 'io_uring'].each do |model|
+            with_server test_config("concurrency_model = \"#{model}\";") do
+                assert_keep_alive 8001
+                assert_pipelined 8001
+            end
+        end
+    end
+
+    def test_concurrency_models
+        ['concurrency_model = "epoll";',
+         'concurrency_model = "io_uring";',
+         'concurrency_model = "pool";',
+         'listeners = 2;'].each do |settings|
+            with_server test_config(settings +
+                                    "\nkeep_alive = { timeout = 1; };") do
+                assert_serves 8001
+            end
+        end
+    end
+
+    def test_worker_pool_full
+        # One worker busy with a silent client and a queue of two
+        settings = <<~CONFIG
+            concurrency_model = "pool";
+            workers = { threads = 1; queue_length = 2; };
+            keep_alive = { timeout = 3; };
+        CONFIG
+        with_server test_config(settings) do
+            sockets = 3.times.map { TCPSocket.new('localhost', 8001) }
+            sockets.each do |socket|
+                assert_nil IO.select([socket], nil, nil, 0.2)
+            end
+            rejected = TCPSocket.new('localhost', 8001)
+            assert_match /\AHTTP\/1.1 503/, rejected.read
+            rejected.close
+            sockets.each(&:close)
+        end
+    end
+
+    # Start a server on port 8001 with the given configuration for as long
+    # as the block runs
+    def with_server config
+        file = Tempfile.new(['spade', '.cfg'])
+        file.write config
+        file.close
+        server = fork {
+            exec "src/spade -c #{file.path} -p 8001"
+        }
+        sleep 0.5
+        yield server
+    ensure
+        if server
+            Process.kill("TERM", server)
+            Process.wait(server)
+        end
+        file.unlink
+    end
+
+    # The test configuration with settings added, and without the Clay
+    # handler so the main server keeps its endpoint
+    def test_config settings
+        settings + "\n" +
+            File.read('config/test.cfg').sub(/^clay = \{.*?^\};\n/m, '')
+    end
+
+    # A static file, dynamic requests passed to threads on a persistent
+    # connection, and a client that connects but never sends a request
+    def assert_serves port
+        http = Net::HTTP.start('localhost', port)
+        response = http.get('/large.txt', 'Accept-Encoding' => 'identity')
+        assert_equal "200", response.code
+        assert_equal File.binread('tests/static/large.txt'), response.body
+        response = http.get('/dirt-adder-v2?value=1&value=2')
+        assert_equal "3", response.body.strip
+        assert_equal "keep-alive", response['Connection']
+        assert_equal "3", http.get('/adder?value=1&value=2').body.strip
+        http.finish
+        assert_keep_alive port
+
+        socket = TCPSocket.new('localhost', port)
+        started = Time.now
+        assert_not_nil IO.select([socket], nil, nil, 5)
+        assert_equal "", socket.read
+        assert_operator Time.now - started, :>=, 0.5
+        assert_operator Time.now - started, :<, 3
+        socket.close
+    end
+
+    def assert_keep_alive port
+        socket = TCPSocket.new('localhost', port)
+        2.times do
+            socket.write "GET /small.txt HTTP/1.1\r\nHost: localhost\r\n\r\n"
+            headers = socket.gets("\r\n\r\n")
+            assert_match /Connection: keep-alive/, headers
+            length = headers[/Content-Length: (\d+)/, 1].to_i
+            assert_equal File.binread('tests/static/small.txt'),
+                socket.read(length)
+        end
+        socket.close
+    end
+
+    # Pipeline requests for files large and small, reading slowly through a
+    # small receive buffer so that big bodies can only be sent in pieces
+    def assert_pipelined port
+        large = 'tests/static/pipelined.bin'
+        File.binwrite(large, Random.new(1).bytes(8 * 1024 * 1024))
+        paths = ['/small.txt', '/pipelined.bin', '/small.html',
+                 '/large.jpg', '/small.txt']
+        socket = Socket.new(:INET, :STREAM)
+        socket.setsockopt(:SOCKET, :RCVBUF, 4096)
+        socket.connect(Socket.sockaddr_in(port, 'localhost'))
+        socket.write paths.map { |path|
+            "GET #{path} HTTP/1.1\r\nHost: localhost\r\n\r\n"
+        }.join
+        sleep 0.2
+        paths.each do |path|
+            headers = socket.gets("\r\n\r\n")
+            length = headers[/Content-Length: (\d+)/, 1].to_i
+            assert_equal File.binread("tests/static#{path}"),
+                socket.read(length), path
+        end
+        socket.close
+    ensure
+        File.delete(large)
+    end
+
     def assert_same_static path, filename=nil
         filename ||= "tests/static#{path}"
         response = @http.get(path)